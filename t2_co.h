@@ -71,85 +71,1499 @@
  * a test case showing how to use t2_co on this exact parser.
  */
 
+/* Statistics
+ *
+ * Build with T2_CO_STATS defined to 1 to have every coroutine count its
+ * resumes, how long it ran and how long it sat suspended, and how deep
+ * its stack got. This is meant for finding the coroutine that's hogging
+ * a thread, and costs a couple of clock reads per switch; otherwise, all
+ * of it compiles away. */
+#ifndef T2_CO_STATS
+#define T2_CO_STATS 0
+#endif
+
+#if T2_CO_STATS
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct t2_co_stats {
+    uint64_t resumes;
+    /* Time spent running, not counting coroutines this one resumed, and
+     * the longest single stretch of it. */
+    uint64_t run_ns, max_run_ns;
+    /* Time between creation or pausing and the next resume. */
+    uint64_t suspended_ns;
+    /* The most stack the coroutine has used, in bytes. Not tracked on
+     * Windows, where the fiber owns the stack. */
+    size_t stack_used;
+};
+
+#define T2_CO__STATS_FIELDS \
+    const char *name; \
+    struct t2_co_stats stats; \
+    uint64_t stats_mark; \
+    struct t2_co *stats_prev, *stats_next;
+
+#else
+
+#define T2_CO__STATS_FIELDS
+
+#endif /* T2_CO_STATS */
+
 #ifdef _WIN32
 
 /* We assume Windows.h is included. */
 
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum t2_co_status {
+    T2_CO_SUSPENDED,
+    T2_CO_RUNNING,
+    T2_CO_DONE,
+};
+
 struct t2_co {
+    struct t2_co *caller;
+    void *transfer;
+    void (*func) (void *data), (*cleanup) (void *data);
+    void *data;
+    enum t2_co_status status;
+    bool cancelled;
+    jmp_buf unwind;
     void *parent, *fiber;
+    T2_CO__STATS_FIELDS
 };
 
 #else /* _WIN32 */
 
-#include <signal.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+
+/* swapcontext saves and restores the signal mask, which is a syscall on
+ * every switch. On the platforms we know, we switch by hand instead,
+ * saving only the callee-saved registers and the stack pointer. Define
+ * T2_CO_USE_UCONTEXT to use ucontext anyway. */
+#if !defined(T2_CO_USE_UCONTEXT) && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+#define T2_CO__ASM 1
+#else
+#define T2_CO__ASM 0
 #include <ucontext.h>
+#endif
+
+enum t2_co_status {
+    /* Created, or paused, and waiting to be resumed. */
+    T2_CO_SUSPENDED,
+    /* Running, or has resumed another coroutine which is. */
+    T2_CO_RUNNING,
+    /* Its function returned, or it was cancelled. */
+    T2_CO_DONE,
+};
 
 struct t2_co {
+    /* Whatever coroutine was running when this one was last resumed,
+     * or NULL if it was resumed from outside of any coroutine. */
+    struct t2_co *caller;
+    /* The value being handed over by t2_co_resume_with / t2_co_pause_with. */
+    void *transfer;
+    void (*func) (void *data), (*cleanup) (void *data);
+    void *data;
+    enum t2_co_status status;
+    bool cancelled;
+    /* Where a cancelled coroutine unwinds to, at the bottom of its stack. */
+    jmp_buf unwind;
+#if T2_CO__ASM
+    void *parent_sp, *sp;
+#else
     ucontext_t parent, ctx;
-    uint8_t stack[SIGSTKSZ];
+#endif
+    /* The usable part of the stack, above its guard page. */
+    uint8_t *stack;
+    size_t stack_size;
+#ifdef __linux__
+    /* The reactor and fd this is parked on in t2_co_read / t2_co_write,
+     * so cancelling it can take it off again. */
+    struct t2_co_reactor *wait_reactor;
+    int wait_fd;
+    bool wait_write;
+#endif
+    T2_CO__STATS_FIELDS
 };
 
 #endif /* !_WIN32 */
 
+/* Sets the stack size for coroutines created after this. Stacks are only
+ * committed as they're touched, so a large size costs address space, not
+ * memory. Defaults to T2_CO_DEFAULT_STACK_SIZE.
+ *
+ * The size is one plain global, read without a lock whenever a coroutine
+ * is created or destroyed, so only set it while no other thread is
+ * creating or destroying coroutines: at startup, before any are
+ * started. */
+#ifndef T2_CO_DEFAULT_STACK_SIZE
+#define T2_CO_DEFAULT_STACK_SIZE (256 * 1024)
+#endif
+void t2_co_set_stack_size (size_t size);
+
+/* Stacks have a guard page below them, so overflowing one faults instead of
+ * scribbling over its neighbour. Keep in mind a stack frame larger than a page
+ * can still jump the guard page. t2_co_destroy puts the stack back in a pool
+ * of up to T2_CO_STACK_POOL_MAX stacks, so that creating and destroying
+ * coroutines doesn't have to go to the kernel. */
+#ifndef T2_CO_STACK_POOL_MAX
+#define T2_CO_STACK_POOL_MAX 64
+#endif
+
 void t2_co_create (struct t2_co *co, void (*func) (void *data), void *data);
+void t2_co_destroy (struct t2_co *co);
 
-/* Called from outside a coroutine, to resume execution of the coroutine
- * that has been started. */
+/* Resumes execution of the coroutine that has been started. This can be
+ * called from outside any coroutine, or from inside another one, in which
+ * case the resumed coroutine will pause back into it. Every thread tracks
+ * its own running coroutine, so each thread can drive its own set. */
 void t2_co_resume (struct t2_co *co);
 
 /* Called from inside a coroutine, to pause and return execution to caller,
  * immediately after the resume that caused it. */
 void t2_co_pause (void);
 
+/* Completion, cancellation and reuse
+ *
+ * Once a coroutine's function returns, it's T2_CO_DONE, and resuming it
+ * does nothing. t2_co_cancel stops a coroutine before that: its next
+ * t2_co_pause never returns, and instead its stack is unwound with
+ * longjmp, and the cleanup hook is run on it, to free whatever the
+ * skipped frames were holding on to. A coroutine that's cancelled before
+ * it first runs just runs the hook.
+ *
+ * A finished coroutine can be rearmed with a new function, which reuses
+ * its stack and costs about as much as a resume. A server can then keep
+ * a pool of coroutines for its requests, instead of creating new ones. */
+enum t2_co_status t2_co_get_status (const struct t2_co *co);
+
+/* Sets the hook run with the coroutine's data when it's cancelled. */
+void t2_co_set_cleanup (struct t2_co *co, void (*cleanup) (void *data));
+
+/* Cancels a suspended coroutine, by resuming it into its cleanup hook, or
+ * the running coroutine itself, which doesn't return. A coroutine further
+ * up the chain of resumes is cancelled when it's next resumed. One waiting
+ * in t2_co_read / t2_co_write stops counting against the reactor. */
+void t2_co_cancel (struct t2_co *co);
+
+/* Resets a T2_CO_DONE coroutine to run func (data) on its next resume.
+ * The cleanup hook is cleared, and so is anything it was waiting on. */
+void t2_co_rearm (struct t2_co *co, void (*func) (void *data), void *data);
+
+#if T2_CO_STATS
+
+/* Names the coroutine in t2_co_stats_dump. name isn't copied. */
+void t2_co_set_name (struct t2_co *co, const char *name);
+
+void t2_co_get_stats (struct t2_co *co, struct t2_co_stats *stats);
+
+/* Prints a line of stats for every coroutine that hasn't been destroyed,
+ * on any thread. Coroutines that are running on other threads at the
+ * time have their numbers from their last switch. */
+void t2_co_stats_dump (FILE *f);
+
+#else
+
+#define t2_co_set_name(co, name) ((void) 0)
+#define t2_co_stats_dump(f) ((void) 0)
+
+#endif /* T2_CO_STATS */
+
+/* Value passing
+ *
+ * These work like t2_co_resume and t2_co_pause, but hand a value across
+ * the switch: the value given to t2_co_pause_with is what the resumer's
+ * t2_co_resume_with returns, and vice versa. A generator is then just a
+ * coroutine that calls t2_co_pause_with for each value it produces. The
+ * value given to the first resume is in t2_co_received. */
+void *t2_co_resume_with (struct t2_co *co, void *value);
+void *t2_co_pause_with (void *value);
+
+/* From inside a coroutine, the last value it was resumed with. */
+void *t2_co_received (void);
+
+/* Channels
+ *
+ * A channel is a bounded queue of fixed-size elements between coroutines
+ * on one thread. It's pulled from the receiving end: receiving from an
+ * empty channel resumes its producer until it sends something, and
+ * sending pauses the producer as soon as the channel is full. This lets
+ * you chain generators into a pipeline, like "socket reader -> inflate ->
+ * JSON extractor", each written as a straight-line loop.
+ *
+ * Elements are copied in and out, so to pass buffers without copying,
+ * send a struct t2_co_view. With a capacity of one, the producer isn't
+ * resumed until the consumer comes back for more, so a view stays good
+ * until the consumer's next receive, and the producer can reuse its
+ * buffer. Larger capacities need as many buffers to rotate through. */
+
+struct t2_co_view {
+    const void *data;
+    size_t size;
+};
+
+struct t2_co_chan {
+    uint8_t *buf;
+    size_t elem_size;
+    int cap, head, n;
+    struct t2_co *producer;
+    bool closed;
+};
+
+/* buf holds cap elements of elem_size bytes. producer is the coroutine
+ * that sends on this channel, and can be NULL if nothing is to be resumed
+ * on an empty channel, in which case receives just fail. Receives also
+ * fail once the producer is done, even if it never closed the channel. */
+void t2_co_chan_init (struct t2_co_chan *ch, void *buf, size_t elem_size, int cap, struct t2_co *producer);
+
+/* Returns false if the channel has been closed. */
+bool t2_co_chan_send (struct t2_co_chan *ch, const void *elem);
+
+/* Returns false once the channel is closed and empty. */
+bool t2_co_chan_recv (struct t2_co_chan *ch, void *elem);
+
+/* Called by the producer when it has nothing more to send. */
+void t2_co_chan_close (struct t2_co_chan *ch);
+
+#ifndef _WIN32
+
+/* Scheduler
+ *
+ * Rather than resuming coroutines by hand, you can spawn them as tasks on
+ * a scheduler, which runs them over a pool of worker threads. Each worker
+ * has its own run queue, and a worker that runs out of tasks steals from
+ * the others, so tasks can migrate between threads whenever they yield.
+ * Inside a task, t2_co_pause works like t2_co_yield. */
+
+struct t2_co_sched;
+struct t2_co_task;
+
+/* Starts a scheduler with n_workers threads, or one per core if 0. */
+struct t2_co_sched *t2_co_sched_new (int n_workers);
+
+/* Waits for every task to finish, and then stops the workers. */
+void t2_co_sched_free (struct t2_co_sched *sched);
+
+/* Spawns a new task running func (data). From inside a task, the new task
+ * goes on the current worker's queue, so it runs on a warm cache unless
+ * another worker steals it. The returned task must be passed to either
+ * t2_co_join or t2_co_detach. */
+struct t2_co_task *t2_co_spawn (struct t2_co_sched *sched, void (*func) (void *data), void *data);
+
+/* From inside a task, gives other tasks a chance to run. */
+void t2_co_yield (void);
+
+/* Waits for task to finish, and frees it. From inside a task this only
+ * suspends the task; from outside, it blocks the thread. */
+void t2_co_join (struct t2_co_task *task);
+
+/* Lets task be freed as soon as it finishes, without joining it. */
+void t2_co_detach (struct t2_co_task *task);
+
+#endif /* !_WIN32 */
+
+#ifdef __linux__
+
+/* I/O
+ *
+ * t2_co_read and t2_co_write look like read (2) and write (2), but when
+ * the fd isn't ready, they pause the coroutine instead of blocking. The
+ * thread's reactor resumes it once epoll says the fd is ready. A parser
+ * written in straight-line style can then serve thousands of sockets from
+ * one thread:
+ *
+ *     struct t2_co_reactor *r = t2_co_reactor_new ();
+ *     for (each connection)
+ *         t2_co_create (&co[i], serve, &conn[i]), t2_co_resume (&co[i]);
+ *     t2_co_reactor_run (r);
+ *
+ * fds must be non-blocking; see t2_co_set_nonblocking. Each fd can have
+ * one coroutine waiting to read and one waiting to write at a time.
+ *
+ * The reactor belongs to the thread, and doesn't know about the
+ * scheduler. A thread with no reactor, which includes the scheduler's
+ * workers, gets plain non-blocking I/O: an fd that isn't ready returns -1
+ * with errno EAGAIN, rather than pausing. */
+
+#include <sys/types.h>
+
+struct t2_co_reactor;
+
+/* Creates a reactor for this thread. t2_co_read and t2_co_write on this
+ * thread will use it. */
+struct t2_co_reactor *t2_co_reactor_new (void);
+void t2_co_reactor_free (struct t2_co_reactor *reactor);
+
+/* Waits up to timeout_ms (or forever, if -1) for fds to become ready,
+ * and resumes the coroutines waiting on them. Returns how many were resumed. */
+int t2_co_reactor_poll (struct t2_co_reactor *reactor, int timeout_ms);
+
+/* Polls until no coroutine is waiting anymore. */
+void t2_co_reactor_run (struct t2_co_reactor *reactor);
+
+int t2_co_set_nonblocking (int fd);
+ssize_t t2_co_read (int fd, void *buf, size_t n);
+ssize_t t2_co_write (int fd, const void *buf, size_t n);
+
+/* Closes fd, and forgets about it, so that a new fd that reuses the
+ * number is registered with epoll afresh. Coroutines waiting on it are
+ * resumed, and their read or write fails with EBADF. */
+int t2_co_close (int fd);
+
+#endif /* __linux__ */
+
 #ifdef T2_CO_IMPLEMENTATION
 
+#include <string.h>
+
+static size_t t2_co__stack_size = T2_CO_DEFAULT_STACK_SIZE;
+
+#ifdef _MSC_VER
+#define T2_CO__NOINLINE __declspec (noinline)
+#else
+#define T2_CO__NOINLINE __attribute__ ((noinline))
+#endif
+
+/* The coroutine running on this thread, or NULL. */
+static _Thread_local struct t2_co *t2_co__current;
+
+/* A coroutine can pause on one thread and be resumed on another, but
+ * the compiler assumes a function stays on the thread it started on,
+ * and is free to work out where a thread local lives once and reuse the
+ * address after a t2_co_pause. Going through a function it can't see
+ * into makes it look the address up again every time. */
+static T2_CO__NOINLINE struct t2_co **t2_co__current_ptr (void) {
+    struct t2_co **p = &t2_co__current;
+#ifndef _MSC_VER
+    /* Also keeps it from deciding the function is pure. */
+    __asm__ volatile ("" : "+r" (p));
+#endif
+    return p;
+}
+
+static struct t2_co *t2_co__get_current (void) { return *t2_co__current_ptr (); }
+static void t2_co__set_current (struct t2_co *co) { *t2_co__current_ptr () = co; }
+
+static void t2_co__start (void);
+
+#if T2_CO_STATS
+
+#include <stdatomic.h>
+#include <time.h>
+
+static uint64_t t2_co__now (void) {
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter (&count);
+    QueryPerformanceFrequency (&freq);
+    return (uint64_t) ((double) count.QuadPart * 1e9 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Every coroutine that hasn't been destroyed, for t2_co_stats_dump. This
+ * is only touched on create and destroy, so a spinlock is plenty. */
+static struct t2_co *t2_co__stats_list;
+static atomic_flag t2_co__stats_lock = ATOMIC_FLAG_INIT;
+
+static void t2_co__stats_list_lock (void) {
+    while (atomic_flag_test_and_set_explicit (&t2_co__stats_lock, memory_order_acquire))
+        ;
+}
+
+static void t2_co__stats_list_unlock (void) {
+    atomic_flag_clear_explicit (&t2_co__stats_lock, memory_order_release);
+}
+
+static void t2_co__stats_create (struct t2_co *co) {
+    co->name = NULL;
+    co->stats = (struct t2_co_stats) {};
+    co->stats_mark = t2_co__now ();
+
+    t2_co__stats_list_lock ();
+    co->stats_prev = NULL;
+    co->stats_next = t2_co__stats_list;
+    if (t2_co__stats_list)
+        t2_co__stats_list->stats_prev = co;
+    t2_co__stats_list = co;
+    t2_co__stats_list_unlock ();
+}
+
+static void t2_co__stats_destroy (struct t2_co *co) {
+    t2_co__stats_list_lock ();
+    if (co->stats_prev)
+        co->stats_prev->stats_next = co->stats_next;
+    else
+        t2_co__stats_list = co->stats_next;
+    if (co->stats_next)
+        co->stats_next->stats_prev = co->stats_prev;
+    t2_co__stats_list_unlock ();
+}
+
+/* The clock of whichever coroutine is running on the thread is started at
+ * stats_mark, so when one resumes another, the resumer's run time stops
+ * accumulating until it's switched back to. */
+static void t2_co__stats_enter (struct t2_co *co) {
+    uint64_t now = t2_co__now ();
+    co->stats.resumes++;
+    co->stats.suspended_ns += now - co->stats_mark;
+    if (co->caller)
+        co->caller->stats.run_ns += now - co->caller->stats_mark;
+    co->stats_mark = now;
+}
+
+static void t2_co__stats_leave (struct t2_co *co) {
+    uint64_t now = t2_co__now ();
+    uint64_t ran = now - co->stats_mark;
+    co->stats.run_ns += ran;
+    if (ran > co->stats.max_run_ns)
+        co->stats.max_run_ns = ran;
+    co->stats_mark = now;
+    if (co->caller)
+        co->caller->stats_mark = now;
+}
+
+static size_t t2_co__stack_used (struct t2_co *co);
+
+#else
+
+#define t2_co__stats_create(co) ((void) 0)
+#define t2_co__stats_destroy(co) ((void) 0)
+#define t2_co__stats_enter(co) ((void) 0)
+#define t2_co__stats_leave(co) ((void) 0)
+
+#endif /* T2_CO_STATS */
+
 #ifdef _WIN32
 
 #include <stdlib.h>
 
+void t2_co_set_stack_size (size_t size) {
+    t2_co__stack_size = size;
+}
+
+static void WINAPI t2_co__fiber_start (void *data) {
+    t2_co__start ();
+}
+
+static void t2_co__init (struct t2_co *co) {
+    co->fiber = CreateFiber (t2_co__stack_size, t2_co__fiber_start, NULL);
+}
+
+void t2_co_destroy (struct t2_co *co) {
+    t2_co__stats_destroy (co);
+    DeleteFiber (co->fiber);
+}
+
+#if T2_CO_STATS
+static size_t t2_co__stack_used (struct t2_co *co) {
+    return 0;
+}
+#endif
+
+/* Each thread has to become a fiber itself before it can switch to one. */
+static _Thread_local void *t2_co__thread_fiber;
+
+static void t2_co__enter (struct t2_co *co) {
+    if (!t2_co__thread_fiber)
+        t2_co__thread_fiber = ConvertThreadToFiber (NULL);
+
+    co->parent = co->caller ? co->caller->fiber : t2_co__thread_fiber;
+    SwitchToFiber (co->fiber);
+}
+
+static void t2_co__leave (struct t2_co *co) {
+    SwitchToFiber (co->parent);
+}
+
+#else /* _WIN32 */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Free stacks are kept in a list, threaded through the top of each stack.
+ * Each thread has its own pool, so there's no locking; a stack destroyed
+ * on a different thread than it was created on just changes pools. */
+struct t2_co__free_stack {
+    struct t2_co__free_stack *next;
+    uint8_t *stack;
+    size_t stack_size;
+};
+
+struct t2_co__stack_pool {
+    struct t2_co__free_stack *head;
+    int n;
+};
+
+static _Thread_local struct t2_co__stack_pool t2_co__stack_pool;
+
+/* Unmaps a thread's pooled stacks when the thread exits. */
+static pthread_key_t t2_co__stack_pool_key;
+static pthread_once_t t2_co__stack_pool_once = PTHREAD_ONCE_INIT;
+
+static void t2_co__stack_unmap (uint8_t *stack, size_t stack_size);
+
+static void t2_co__stack_pool_drain (void *data) {
+    struct t2_co__stack_pool *pool = data;
+    while (pool->head) {
+        struct t2_co__free_stack *free_stack = pool->head;
+        pool->head = free_stack->next;
+        t2_co__stack_unmap (free_stack->stack, free_stack->stack_size);
+    }
+    pool->n = 0;
+}
+
+static void t2_co__stack_pool_key_create (void) {
+    pthread_key_create (&t2_co__stack_pool_key, t2_co__stack_pool_drain);
+}
+
+void t2_co_set_stack_size (size_t size) {
+    size_t page = sysconf (_SC_PAGESIZE);
+    t2_co__stack_size = (size + page - 1) & ~(page - 1);
+}
+
+static void t2_co__stack_unmap (uint8_t *stack, size_t stack_size) {
+    size_t page = sysconf (_SC_PAGESIZE);
+    munmap (stack - page, stack_size + page);
+}
+
+static void t2_co__stack_alloc (struct t2_co *co) {
+    while (t2_co__stack_pool.head) {
+        struct t2_co__free_stack *free_stack = t2_co__stack_pool.head;
+        t2_co__stack_pool.head = free_stack->next;
+        t2_co__stack_pool.n--;
+
+        /* Pooled before the stack size changed. */
+        if (free_stack->stack_size != t2_co__stack_size) {
+            t2_co__stack_unmap (free_stack->stack, free_stack->stack_size);
+            continue;
+        }
+
+        co->stack = free_stack->stack;
+        co->stack_size = free_stack->stack_size;
+#if T2_CO_STATS
+        /* Stack use is measured by the deepest word that isn't zero, so
+         * a reused stack needs to be zeroed again. On Linux, dropping the
+         * pages does that without touching them. */
+#ifdef __linux__
+        madvise (co->stack, co->stack_size, MADV_DONTNEED);
+#else
+        memset (co->stack, 0, co->stack_size);
+#endif
+#endif
+        return;
+    }
+
+    /* Map the whole thing without any access, and then open up everything
+     * above the guard page. MAP_NORESERVE lets the kernel commit pages
+     * lazily, as the stack grows into them. */
+    size_t page = sysconf (_SC_PAGESIZE);
+    size_t size = t2_co__stack_size + page;
+    uint8_t *base = mmap (NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        abort ();
+    if (mprotect (base + page, t2_co__stack_size, PROT_READ | PROT_WRITE) != 0)
+        abort ();
+
+    co->stack = base + page;
+    co->stack_size = t2_co__stack_size;
+}
+
+#if T2_CO_STATS
+/* Fresh stacks are all zeroes, so look for the lowest word that isn't.
+ * The stack grows down from the top, so that's how deep it's been. Pages
+ * that were never touched aren't resident, and can be skipped. */
+static size_t t2_co__stack_used (struct t2_co *co) {
+    size_t page = sysconf (_SC_PAGESIZE);
+    for (size_t offs = 0; offs < co->stack_size; offs += page) {
+#ifdef __linux__
+        unsigned char resident;
+        if (mincore (co->stack + offs, page, &resident) == 0 && !(resident & 1))
+            continue;
+#endif
+        uint64_t *p = (uint64_t *) (co->stack + offs), *e = p + page / sizeof (*p);
+        for (; p < e; p++)
+            if (*p)
+                return co->stack + co->stack_size - (uint8_t *) p;
+    }
+    return 0;
+}
+#endif
+
+void t2_co_destroy (struct t2_co *co) {
+    t2_co__stats_destroy (co);
+    if (t2_co__stack_pool.n >= T2_CO_STACK_POOL_MAX || co->stack_size != t2_co__stack_size) {
+        t2_co__stack_unmap (co->stack, co->stack_size);
+    } else {
+        /* The top of the stack is always committed, so keep the list there. */
+        struct t2_co__free_stack *free_stack = (struct t2_co__free_stack *) (co->stack + co->stack_size) - 1;
+        free_stack->stack = co->stack;
+        free_stack->stack_size = co->stack_size;
+        free_stack->next = t2_co__stack_pool.head;
+        t2_co__stack_pool.head = free_stack;
+        if (t2_co__stack_pool.n++ == 0) {
+            pthread_once (&t2_co__stack_pool_once, t2_co__stack_pool_key_create);
+            pthread_setspecific (t2_co__stack_pool_key, &t2_co__stack_pool);
+        }
+    }
+    co->stack = NULL;
+}
+
+#if T2_CO__ASM
+
+/* Saves the callee-saved registers on the current stack, stores the stack
+ * pointer in *from_sp, and then does the reverse from to_sp. */
+void t2_co__switch (void **from_sp, void *to_sp) __asm__ ("t2_co__switch");
+
+#if defined(__x86_64__)
+
+/* The x87 control word and MXCSR, which the SysV ABI also has callees
+ * preserve, sharing a slot, then its six callee-saved registers, then
+ * the return address. */
+enum { T2_CO__FRAME_SLOTS = 9, T2_CO__FRAME_RET = 7 };
+
+__asm__ (
+    ".text\n"
+    ".globl t2_co__switch\n"
+    ".type t2_co__switch, @function\n"
+    "t2_co__switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    fnstcw (%rsp)\n"
+    "    stmxcsr 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    fldcw (%rsp)\n"
+    "    ldmxcsr 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size t2_co__switch, .-t2_co__switch\n"
+);
+
+#elif defined(__aarch64__)
+
+/* x19-x28, the frame pointer, the link register, and the low halves of
+ * v8-v15, which is 20 slots. */
+enum { T2_CO__FRAME_SLOTS = 20, T2_CO__FRAME_RET = 11 };
+
+__asm__ (
+    ".text\n"
+    ".globl t2_co__switch\n"
+    ".type t2_co__switch, %function\n"
+    "t2_co__switch:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size t2_co__switch, .-t2_co__switch\n"
+);
+
+#endif
+
+static void t2_co__init (struct t2_co *co) {
+    t2_co__stack_alloc (co);
+
+    /* Build a frame at the top of the stack that t2_co__switch can pop,
+     * with everything zeroed except the return address. The top is
+     * page-aligned, so t2_co__start sees an aligned stack. */
+    void **frame = (void **) (co->stack + co->stack_size) - T2_CO__FRAME_SLOTS;
+    for (int i = 0; i < T2_CO__FRAME_SLOTS; i++)
+        frame[i] = NULL;
+    frame[T2_CO__FRAME_RET] = (void *) t2_co__start;
+#if defined(__x86_64__)
+    /* Start with the same floating point modes as the creator, the way a
+     * new thread would. */
+    __asm__ ("fnstcw (%0)\n"
+             "stmxcsr 4(%0)" : : "r" (frame) : "memory");
+#endif
+    co->sp = frame;
+}
+
+static void t2_co__enter (struct t2_co *co) {
+    t2_co__switch (&co->parent_sp, co->sp);
+}
+
+static void t2_co__leave (struct t2_co *co) {
+    t2_co__switch (&co->sp, co->parent_sp);
+}
+
+#else
+
+static void t2_co__init (struct t2_co *co) {
+    t2_co__stack_alloc (co);
+    getcontext (&co->ctx);
+    co->ctx.uc_link = NULL;
+    co->ctx.uc_stack.ss_sp = co->stack;
+    co->ctx.uc_stack.ss_size = co->stack_size;
+    makecontext (&co->ctx, t2_co__start, 0);
+}
+
+static void t2_co__enter (struct t2_co *co) {
+    swapcontext (&co->parent, &co->ctx);
+}
+
+static void t2_co__leave (struct t2_co *co) {
+    swapcontext (&co->ctx, &co->parent);
+}
+
+#endif /* !T2_CO__ASM */
+
+#endif /* !_WIN32 */
+
+/* The first switch into a coroutine lands here, and it never returns:
+ * once the coroutine's function is done, it goes back to whoever resumed
+ * it, and if it's rearmed, the next resume picks up the loop again. */
+static void t2_co__start (void) {
+    struct t2_co *co = t2_co__get_current ();
+    while (1) {
+        if (setjmp (co->unwind) == 0) {
+            if (!co->cancelled) {
+                co->func (co->data);
+                co->cancelled = false;
+            }
+        }
+        if (co->cancelled) {
+            co->cancelled = false;
+            if (co->cleanup)
+                co->cleanup (co->data);
+        }
+        co->status = T2_CO_DONE;
+        t2_co__leave (co);
+    }
+}
+
 void t2_co_create (struct t2_co *co, void (*func) (void *data), void *data) {
-    co->parent = ConvertThreadToFiber (NULL);
-    co->fiber = CreateFiber (0, func, data);
+    co->func = func;
+    co->data = data;
+    co->cleanup = NULL;
+    co->status = T2_CO_SUSPENDED;
+    co->cancelled = false;
+#ifdef __linux__
+    co->wait_reactor = NULL;
+#endif
+    t2_co__init (co);
+    t2_co__stats_create (co);
 }
 
-static struct t2_co *t2_co__global;
 void t2_co_resume (struct t2_co *co) {
-    t2_co__global = co;
-    SwitchToFiber (co->ctx);
-    t2_co__global = NULL;
+    if (co->status != T2_CO_SUSPENDED)
+        return;
+
+    co->caller = t2_co__get_current ();
+    co->status = T2_CO_RUNNING;
+    t2_co__set_current (co);
+    t2_co__stats_enter (co);
+    t2_co__enter (co);
+    t2_co__stats_leave (co);
+    t2_co__set_current (co->caller);
+    if (co->status == T2_CO_RUNNING)
+        co->status = T2_CO_SUSPENDED;
 }
 
 void t2_co_pause (void) {
-    struct t2_co *co = t2_co__global;
-    SwitchToFiber (co->parent);
+    struct t2_co *co = t2_co__get_current ();
+    t2_co__leave (co);
+    if (co->cancelled)
+        longjmp (co->unwind, 1);
+}
+
+enum t2_co_status t2_co_get_status (const struct t2_co *co) {
+    return co->status;
+}
+
+void t2_co_set_cleanup (struct t2_co *co, void (*cleanup) (void *data)) {
+    co->cleanup = cleanup;
 }
 
+#ifdef __linux__
+static void t2_co__unwait (struct t2_co *co);
 #else
+static void t2_co__unwait (struct t2_co *co) {
+    (void) co;
+}
+#endif
+
+void t2_co_cancel (struct t2_co *co) {
+    if (co->status == T2_CO_DONE)
+        return;
+
+    t2_co__unwait (co);
+    co->cancelled = true;
+    if (co == t2_co__get_current ())
+        longjmp (co->unwind, 1);
+    t2_co_resume (co);
+}
+
+void t2_co_rearm (struct t2_co *co, void (*func) (void *data), void *data) {
+    t2_co__unwait (co);
+    co->func = func;
+    co->data = data;
+    co->cleanup = NULL;
+    co->status = T2_CO_SUSPENDED;
+}
+
+#if T2_CO_STATS
+
+void t2_co_set_name (struct t2_co *co, const char *name) {
+    co->name = name;
+}
+
+void t2_co_get_stats (struct t2_co *co, struct t2_co_stats *stats) {
+    *stats = co->stats;
+    stats->stack_used = t2_co__stack_used (co);
+}
+
+void t2_co_stats_dump (FILE *f) {
+    static const char *status_names[] = { "suspended", "running", "done" };
+
+    fprintf (f, "%-24s %9s %10s %10s %12s %9s  %s\n",
+             "coroutine", "resumes", "run ms", "max us", "suspended ms", "stack", "status");
+
+    t2_co__stats_list_lock ();
+    for (struct t2_co *co = t2_co__stats_list; co; co = co->stats_next) {
+        struct t2_co_stats stats;
+        t2_co_get_stats (co, &stats);
+
+        char unnamed[24];
+        const char *name = co->name;
+        if (!name) {
+            snprintf (unnamed, sizeof (unnamed), "%p", (void *) co);
+            name = unnamed;
+        }
+
+        fprintf (f, "%-24s %9llu %10.3f %10.1f %12.3f %8zuK  %s\n", name,
+                 (unsigned long long) stats.resumes, stats.run_ns / 1e6, stats.max_run_ns / 1e3,
+                 stats.suspended_ns / 1e6, (stats.stack_used + 1023) / 1024, status_names[co->status]);
+    }
+    t2_co__stats_list_unlock ();
+}
+
+#endif /* T2_CO_STATS */
+
+void *t2_co_resume_with (struct t2_co *co, void *value) {
+    co->transfer = value;
+    t2_co_resume (co);
+    return co->transfer;
+}
+
+void *t2_co_pause_with (void *value) {
+    struct t2_co *co = t2_co__get_current ();
+    co->transfer = value;
+    t2_co_pause ();
+    return co->transfer;
+}
+
+void *t2_co_received (void) {
+    return t2_co__get_current ()->transfer;
+}
+
+void t2_co_chan_init (struct t2_co_chan *ch, void *buf, size_t elem_size, int cap, struct t2_co *producer) {
+    *ch = (struct t2_co_chan) { .buf = buf, .elem_size = elem_size, .cap = cap, .producer = producer };
+}
+
+bool t2_co_chan_send (struct t2_co_chan *ch, const void *elem) {
+    if (ch->closed)
+        return false;
+
+    /* Only happens if the consumer resumed us some other way than by
+     * receiving; wait for it to make room. */
+    while (ch->n == ch->cap)
+        t2_co_pause ();
+
+    memcpy (ch->buf + ((ch->head + ch->n) % ch->cap) * ch->elem_size, elem, ch->elem_size);
+    ch->n++;
+
+    if (ch->n == ch->cap)
+        t2_co_pause ();
+    return true;
+}
+
+bool t2_co_chan_recv (struct t2_co_chan *ch, void *elem) {
+    while (ch->n == 0) {
+        if (ch->closed || !ch->producer || ch->producer->status == T2_CO_DONE)
+            return false;
+        t2_co_resume (ch->producer);
+    }
+
+    memcpy (elem, ch->buf + ch->head * ch->elem_size, ch->elem_size);
+    ch->head = (ch->head + 1) % ch->cap;
+    ch->n--;
+    return true;
+}
+
+void t2_co_chan_close (struct t2_co_chan *ch) {
+    ch->closed = true;
+}
+
+#ifndef _WIN32
+
+#include <stdatomic.h>
+
+enum t2_co__task_action {
+    T2_CO__TASK_YIELD,
+    T2_CO__TASK_JOIN,
+    T2_CO__TASK_DONE,
+};
+
+struct t2_co_task {
+    /* Must be first, so the running coroutine can be turned into its task. */
+    struct t2_co co;
+    struct t2_co_sched *sched;
+    void (*func) (void *data);
+    void *data;
+
+    /* What the task wants the worker to do with it after it pauses.
+     * The task can't act on this itself, since it's still running on
+     * its own stack until the pause completes. */
+    enum t2_co__task_action action;
+    struct t2_co_task *join_target;
+
+    /* Protected by the scheduler lock. */
+    bool done;
+    struct t2_co_task *waiters, *next_waiter;
+
+    /* One for the scheduler, one for whoever joins or detaches it. */
+    atomic_int refs;
+};
+
+/* A run queue. The owning worker pushes and pops at the tail, so it runs
+ * the task it spawned most recently, while thieves take the oldest task
+ * from the head. Each queue has its own lock, which is only ever
+ * contended by a thief. */
+struct t2_co__deque {
+    pthread_mutex_t lock;
+    struct t2_co_task **tasks;
+    size_t head, tail, cap;
+};
+
+struct t2_co__worker {
+    struct t2_co_sched *sched;
+    struct t2_co__deque deque;
+    pthread_t thread;
+    unsigned int seed;
+    struct t2_co_task *running;
+};
+
+struct t2_co_sched {
+    struct t2_co__worker *workers;
+    int n_workers;
+    atomic_uint next_worker;
+
+    /* Tasks sitting in a run queue, and workers sleeping on work_cv. */
+    atomic_int n_ready, n_sleeping;
+
+    /* Protects stop, n_live, and every task's done and waiters. */
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv, done_cv;
+    bool stop;
+    int n_live;
+};
+
+static _Thread_local struct t2_co__worker *t2_co__worker;
+
+/* Read through a function for the same reason as t2_co__current. */
+static T2_CO__NOINLINE struct t2_co__worker **t2_co__worker_ptr (void) {
+    struct t2_co__worker **p = &t2_co__worker;
+    __asm__ volatile ("" : "+r" (p));
+    return p;
+}
+
+static void t2_co__deque_push (struct t2_co__deque *d, struct t2_co_task *task) {
+    pthread_mutex_lock (&d->lock);
+    if (d->tail - d->head == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 64;
+        struct t2_co_task **tasks = malloc (cap * sizeof (*tasks));
+        for (size_t i = d->head; i < d->tail; i++)
+            tasks[i & (cap - 1)] = d->tasks[i & (d->cap - 1)];
+        free (d->tasks);
+        d->tasks = tasks;
+        d->cap = cap;
+    }
+    d->tasks[d->tail++ & (d->cap - 1)] = task;
+    pthread_mutex_unlock (&d->lock);
+}
+
+static struct t2_co_task *t2_co__deque_pop (struct t2_co__deque *d, bool steal) {
+    struct t2_co_task *task = NULL;
+    pthread_mutex_lock (&d->lock);
+    if (d->head != d->tail)
+        task = steal ? d->tasks[d->head++ & (d->cap - 1)] : d->tasks[--d->tail & (d->cap - 1)];
+    pthread_mutex_unlock (&d->lock);
+    return task;
+}
+
+static void t2_co__sched_push (struct t2_co__worker *worker, struct t2_co_task *task) {
+    struct t2_co_sched *sched = worker->sched;
+    t2_co__deque_push (&worker->deque, task);
+
+    /* Paired with the sleeping side in t2_co__sched_next: either they see
+     * our n_ready, or we see their n_sleeping and wake them up. */
+    atomic_fetch_add (&sched->n_ready, 1);
+    if (atomic_load (&sched->n_sleeping) > 0) {
+        pthread_mutex_lock (&sched->lock);
+        pthread_cond_signal (&sched->work_cv);
+        pthread_mutex_unlock (&sched->lock);
+    }
+}
+
+static struct t2_co_task *t2_co__sched_next (struct t2_co__worker *worker) {
+    struct t2_co_sched *sched = worker->sched;
+
+    while (1) {
+        struct t2_co_task *task = t2_co__deque_pop (&worker->deque, false);
+
+        /* Try to steal, starting from a random victim. */
+        int start = rand_r (&worker->seed);
+        for (int i = 0; !task && i < sched->n_workers; i++) {
+            struct t2_co__worker *victim = &sched->workers[(start + i) % sched->n_workers];
+            if (victim != worker)
+                task = t2_co__deque_pop (&victim->deque, true);
+        }
+
+        if (task) {
+            atomic_fetch_sub (&sched->n_ready, 1);
+            return task;
+        }
+
+        pthread_mutex_lock (&sched->lock);
+        atomic_fetch_add (&sched->n_sleeping, 1);
+        while (!sched->stop && atomic_load (&sched->n_ready) == 0)
+            pthread_cond_wait (&sched->work_cv, &sched->lock);
+        atomic_fetch_sub (&sched->n_sleeping, 1);
+        bool stop = sched->stop;
+        pthread_mutex_unlock (&sched->lock);
+
+        if (stop)
+            return NULL;
+    }
+}
+
+static void t2_co__task_unref (struct t2_co_task *task) {
+    if (atomic_fetch_sub (&task->refs, 1) == 1)
+        free (task);
+}
+
+static void t2_co__task_main (void *data) {
+    struct t2_co_task *task = data;
+    task->func (task->data);
+    task->action = T2_CO__TASK_DONE;
+}
+
+/* Runs task until it pauses, then does whatever it asked for. */
+static void t2_co__sched_run (struct t2_co__worker *worker, struct t2_co_task *task) {
+    struct t2_co_sched *sched = worker->sched;
+
+    task->action = T2_CO__TASK_YIELD;
+    worker->running = task;
+    t2_co_resume (&task->co);
+    worker->running = NULL;
+
+    switch (task->action) {
+    case T2_CO__TASK_YIELD:
+        t2_co__sched_push (worker, task);
+        break;
+
+    case T2_CO__TASK_JOIN: {
+        struct t2_co_task *target = task->join_target;
+        pthread_mutex_lock (&sched->lock);
+        bool done = target->done;
+        if (!done) {
+            task->next_waiter = target->waiters;
+            target->waiters = task;
+        }
+        pthread_mutex_unlock (&sched->lock);
+        if (done)
+            t2_co__sched_push (worker, task);
+        break;
+    }
+
+    case T2_CO__TASK_DONE: {
+        t2_co_destroy (&task->co);
+
+        pthread_mutex_lock (&sched->lock);
+        task->done = true;
+        struct t2_co_task *waiters = task->waiters;
+        task->waiters = NULL;
+        sched->n_live--;
+        pthread_cond_broadcast (&sched->done_cv);
+        pthread_mutex_unlock (&sched->lock);
+
+        while (waiters) {
+            struct t2_co_task *next = waiters->next_waiter;
+            t2_co__sched_push (worker, waiters);
+            waiters = next;
+        }
+
+        t2_co__task_unref (task);
+        break;
+    }
+    }
+}
+
+static void *t2_co__worker_main (void *data) {
+    struct t2_co__worker *worker = data;
+    struct t2_co_task *task;
+
+    *t2_co__worker_ptr () = worker;
+    while ((task = t2_co__sched_next (worker)))
+        t2_co__sched_run (worker, task);
+    return NULL;
+}
+
+struct t2_co_sched *t2_co_sched_new (int n_workers) {
+    if (n_workers <= 0)
+        n_workers = sysconf (_SC_NPROCESSORS_ONLN);
+    if (n_workers <= 0)
+        n_workers = 1;
+
+    struct t2_co_sched *sched = calloc (1, sizeof (*sched));
+    sched->n_workers = n_workers;
+    sched->workers = calloc (n_workers, sizeof (*sched->workers));
+    pthread_mutex_init (&sched->lock, NULL);
+    pthread_cond_init (&sched->work_cv, NULL);
+    pthread_cond_init (&sched->done_cv, NULL);
+
+    for (int i = 0; i < n_workers; i++) {
+        struct t2_co__worker *worker = &sched->workers[i];
+        worker->sched = sched;
+        worker->seed = i;
+        pthread_mutex_init (&worker->deque.lock, NULL);
+    }
+    for (int i = 0; i < n_workers; i++)
+        pthread_create (&sched->workers[i].thread, NULL, t2_co__worker_main, &sched->workers[i]);
+
+    return sched;
+}
+
+void t2_co_sched_free (struct t2_co_sched *sched) {
+    pthread_mutex_lock (&sched->lock);
+    while (sched->n_live > 0)
+        pthread_cond_wait (&sched->done_cv, &sched->lock);
+    sched->stop = true;
+    pthread_cond_broadcast (&sched->work_cv);
+    pthread_mutex_unlock (&sched->lock);
+
+    for (int i = 0; i < sched->n_workers; i++) {
+        pthread_join (sched->workers[i].thread, NULL);
+        pthread_mutex_destroy (&sched->workers[i].deque.lock);
+        free (sched->workers[i].deque.tasks);
+    }
+
+    pthread_mutex_destroy (&sched->lock);
+    pthread_cond_destroy (&sched->work_cv);
+    pthread_cond_destroy (&sched->done_cv);
+    free (sched->workers);
+    free (sched);
+}
+
+/* The task running on this thread, or NULL. Since tasks migrate, the
+ * answer is only good until the task next pauses. */
+static struct t2_co_task *t2_co__task_self (void) {
+    struct t2_co__worker *worker = *t2_co__worker_ptr ();
+    return worker ? worker->running : NULL;
+}
+
+struct t2_co_task *t2_co_spawn (struct t2_co_sched *sched, void (*func) (void *data), void *data) {
+    struct t2_co_task *task = calloc (1, sizeof (*task));
+    task->sched = sched;
+    task->func = func;
+    task->data = data;
+    atomic_init (&task->refs, 2);
+    t2_co_create (&task->co, t2_co__task_main, task);
+
+    pthread_mutex_lock (&sched->lock);
+    sched->n_live++;
+    pthread_mutex_unlock (&sched->lock);
+
+    struct t2_co__worker *worker = *t2_co__worker_ptr ();
+    if (!worker || worker->sched != sched)
+        worker = &sched->workers[atomic_fetch_add (&sched->next_worker, 1) % sched->n_workers];
+    t2_co__sched_push (worker, task);
+    return task;
+}
+
+void t2_co_yield (void) {
+    struct t2_co_task *task = t2_co__task_self ();
+    if (!task)
+        return;
+    task->action = T2_CO__TASK_YIELD;
+    t2_co_pause ();
+}
+
+void t2_co_join (struct t2_co_task *task) {
+    struct t2_co_task *self = t2_co__task_self ();
+    struct t2_co_sched *sched = task->sched;
+
+    if (self) {
+        /* The worker checks whether task is done once we've paused, so it
+         * can't finish in between and leave us waiting forever. */
+        self->action = T2_CO__TASK_JOIN;
+        self->join_target = task;
+        t2_co_pause ();
+    } else {
+        pthread_mutex_lock (&sched->lock);
+        while (!task->done)
+            pthread_cond_wait (&sched->done_cv, &sched->lock);
+        pthread_mutex_unlock (&sched->lock);
+    }
+
+    t2_co__task_unref (task);
+}
+
+void t2_co_detach (struct t2_co_task *task) {
+    t2_co__task_unref (task);
+}
+
+#endif /* !_WIN32 */
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+struct t2_co__fd {
+    struct t2_co *reader, *writer;
+    /* Where to tell a waiter that the fd was closed under it. */
+    int *reader_err, *writer_err;
+    bool registered;
+};
+
+struct t2_co_reactor {
+    int epfd;
+    /* Indexed by fd. */
+    struct t2_co__fd *fds;
+    int n_fds;
+    int n_waiting;
+};
+
+static _Thread_local struct t2_co_reactor *t2_co__reactor;
+
+struct t2_co_reactor *t2_co_reactor_new (void) {
+    struct t2_co_reactor *reactor = calloc (1, sizeof (*reactor));
+    reactor->epfd = epoll_create1 (EPOLL_CLOEXEC);
+    if (reactor->epfd < 0)
+        abort ();
+    t2_co__reactor = reactor;
+    return reactor;
+}
+
+void t2_co_reactor_free (struct t2_co_reactor *reactor) {
+    if (t2_co__reactor == reactor)
+        t2_co__reactor = NULL;
+    close (reactor->epfd);
+    free (reactor->fds);
+    free (reactor);
+}
+
+static struct t2_co__fd *t2_co__reactor_fd (struct t2_co_reactor *reactor, int fd) {
+    if (fd >= reactor->n_fds) {
+        int n_fds = reactor->n_fds ? reactor->n_fds : 64;
+        while (n_fds <= fd)
+            n_fds *= 2;
+        reactor->fds = realloc (reactor->fds, n_fds * sizeof (*reactor->fds));
+        memset (reactor->fds + reactor->n_fds, 0, (n_fds - reactor->n_fds) * sizeof (*reactor->fds));
+        reactor->n_fds = n_fds;
+    }
+    return &reactor->fds[fd];
+}
+
+/* Pauses the current coroutine until fd is readable or writable.
+ *
+ * Each fd is registered once, edge-triggered, for both directions. That's
+ * safe because we only ever wait after the fd said EAGAIN, and anything
+ * that becomes ready between then and epoll_wait is still reported, since
+ * the reactor can't run until we've paused. */
+static int t2_co__wait (int fd, bool write) {
+    struct t2_co_reactor *reactor = t2_co__reactor;
+    int err = 0;
+
+    if (!reactor) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    struct t2_co__fd *f = t2_co__reactor_fd (reactor, fd);
+
+    if (!f->registered) {
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = fd };
+        if (epoll_ctl (reactor->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            return -1;
+        f->registered = true;
+    }
+
+    struct t2_co *co = t2_co__get_current ();
+    if (write)
+        f->writer = co, f->writer_err = &err;
+    else
+        f->reader = co, f->reader_err = &err;
+    co->wait_reactor = reactor;
+    co->wait_fd = fd;
+    co->wait_write = write;
+    reactor->n_waiting++;
+    t2_co_pause ();
+    co->wait_reactor = NULL;
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* Takes co off whatever fd it's waiting on, without waking it. */
+static void t2_co__unwait (struct t2_co *co) {
+    struct t2_co_reactor *reactor = co->wait_reactor;
+    if (!reactor)
+        return;
+
+    co->wait_reactor = NULL;
+    struct t2_co__fd *f = &reactor->fds[co->wait_fd];
+    struct t2_co **waiter = co->wait_write ? &f->writer : &f->reader;
+    if (*waiter == co) {
+        *waiter = NULL;
+        reactor->n_waiting--;
+    }
+}
+
+int t2_co_reactor_poll (struct t2_co_reactor *reactor, int timeout_ms) {
+    struct epoll_event events[64];
+    int n = epoll_wait (reactor->epfd, events, 64, timeout_ms);
+    int resumed = 0;
+
+    for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        uint32_t ev = events[i].events;
+        /* Errors and hangups wake up both sides, so they see them from read / write. */
+        bool hup = ev & (EPOLLERR | EPOLLHUP | EPOLLRDHUP);
+
+        struct t2_co *reader = (ev & EPOLLIN || hup) ? reactor->fds[fd].reader : NULL;
+        if (reader) {
+            reactor->fds[fd].reader = NULL;
+            reactor->n_waiting--;
+            t2_co_resume (reader);
+            resumed++;
+        }
+
+        /* The reader may have closed the fd, which already woke the
+         * writer, or waited on another fd, which can move fds, so look
+         * the writer up only now. */
+        struct t2_co *writer = (ev & EPOLLOUT || hup) ? reactor->fds[fd].writer : NULL;
+        if (writer) {
+            reactor->fds[fd].writer = NULL;
+            reactor->n_waiting--;
+            t2_co_resume (writer);
+            resumed++;
+        }
+    }
+    return resumed;
+}
+
+void t2_co_reactor_run (struct t2_co_reactor *reactor) {
+    while (reactor->n_waiting > 0)
+        t2_co_reactor_poll (reactor, -1);
+}
 
-#include <stdlib.h>
+int t2_co_set_nonblocking (int fd) {
+    int flags = fcntl (fd, F_GETFL);
+    if (flags < 0)
+        return -1;
+    return fcntl (fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-void t2_co_create (struct t2_co *co, void (*func) (void *data), void *data) {
-    getcontext (&co->ctx);
-    co->ctx.uc_link = &co->parent;
-    co->ctx.uc_stack.ss_sp = &co->stack;
-    co->ctx.uc_stack.ss_size = sizeof (co->stack);
-    makecontext (&co->ctx, (void (*) (void)) func, 1, data);
+ssize_t t2_co_read (int fd, void *buf, size_t n) {
+    while (1) {
+        ssize_t res = read (fd, buf, n);
+        if (res >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK) || !t2_co__get_current ())
+            return res;
+        if (t2_co__wait (fd, false) < 0)
+            return -1;
+    }
 }
 
-static struct t2_co *t2_co__global;
-void t2_co_resume (struct t2_co *co) {
-    t2_co__global = co;
-    swapcontext (&co->parent, &co->ctx);
-    t2_co__global = NULL;
+ssize_t t2_co_write (int fd, const void *buf, size_t n) {
+    while (1) {
+        ssize_t res = write (fd, buf, n);
+        if (res >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK) || !t2_co__get_current ())
+            return res;
+        if (t2_co__wait (fd, true) < 0)
+            return -1;
+    }
 }
 
-void t2_co_pause (void) {
-    struct t2_co *co = t2_co__global;
-    swapcontext (&co->ctx, &co->parent);
+int t2_co_close (int fd) {
+    struct t2_co_reactor *reactor = t2_co__reactor;
+    struct t2_co__fd f = {};
+
+    if (reactor && fd < reactor->n_fds) {
+        f = reactor->fds[fd];
+        reactor->fds[fd] = (struct t2_co__fd) {};
+    }
+    int res = close (fd);
+
+    /* Anyone still waiting would never hear from epoll again. */
+    if (f.reader) {
+        *f.reader_err = EBADF;
+        reactor->n_waiting--;
+        t2_co_resume (f.reader);
+    }
+    if (f.writer) {
+        *f.writer_err = EBADF;
+        reactor->n_waiting--;
+        t2_co_resume (f.writer);
+    }
+    return res;
 }
 
-#endif /* !_WIN32 */
+#endif /* __linux__ */
 
 #endif /* T2_CO_IMPLEMENTATION */
 
@@ -159,6 +1573,13 @@ void t2_co_pause (void) {
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 static char read_char (char **S) {
     if (**S == '\0') t2_co_pause ();
@@ -231,11 +1652,860 @@ static int test_parser (void) {
     t2_t_assert (strcmp (test_parser_data.v, "c") == 0);
     t2_t_assert (test_parser_data.want == 0);
 
+    t2_co_destroy (&co);
+    return 0;
+}
+
+static void count_forever (void *data) {
+    int *n = data;
+    while (1) {
+        (*n)++;
+        t2_co_pause ();
+    }
+}
+
+static void count_once (void *data) {
+    int *n = data;
+    (*n)++;
+}
+
+static int test_return (void) {
+    struct t2_co co = {};
+    int n = 0;
+
+    /* Returning from the coroutine goes back to whoever resumed it. */
+    t2_co_create (&co, count_once, &n);
+    t2_t_assert (t2_co_get_status (&co) == T2_CO_SUSPENDED);
+    t2_co_resume (&co);
+    t2_t_assert (n == 1);
+    t2_t_assert (t2_co_get_status (&co) == T2_CO_DONE);
+
+    /* And then it stays done. */
+    t2_co_resume (&co);
+    t2_t_assert (n == 1);
+
+    t2_co_destroy (&co);
+    return 0;
+}
+
+#if T2_CO__ASM && defined(__x86_64__)
+
+/* Rounding modes are the easiest thing to tell apart: up, for both. */
+enum { FP_MXCSR_ROUND = 0x6000, FP_MXCSR_UP = 0x4000, FP_X87_ROUND = 0xC00, FP_X87_UP = 0x800 };
+
+static void fp_get (uint32_t *mxcsr, uint16_t *x87) {
+    __asm__ volatile ("stmxcsr %0\n"
+                      "fnstcw %1" : "=m" (*mxcsr), "=m" (*x87));
+}
+
+static void fp_set (uint32_t mxcsr, uint16_t x87) {
+    __asm__ volatile ("ldmxcsr %0\n"
+                      "fldcw %1" : : "m" (mxcsr), "m" (x87));
+}
+
+static void fp_round_up (void *data) {
+    uint32_t *seen = data, mxcsr;
+    uint16_t x87;
+
+    fp_get (&mxcsr, &x87);
+    fp_set ((mxcsr & ~FP_MXCSR_ROUND) | FP_MXCSR_UP, (x87 & ~FP_X87_ROUND) | FP_X87_UP);
+    t2_co_pause ();
+    fp_get (&mxcsr, &x87);
+    seen[0] = mxcsr;
+    seen[1] = x87;
+}
+
+static int test_fp_modes (void) {
+    struct t2_co co = {};
+    uint32_t seen[2], mxcsr, before_mxcsr;
+    uint16_t x87, before_x87;
+
+    /* Each coroutine has its own floating point modes, as the ABI says
+     * callers can count on them not changing under them. */
+    fp_get (&before_mxcsr, &before_x87);
+    t2_co_create (&co, fp_round_up, seen);
+    t2_co_resume (&co);
+    fp_get (&mxcsr, &x87);
+    t2_t_assert (mxcsr == before_mxcsr && x87 == before_x87);
+
+    t2_co_resume (&co);
+    t2_t_assert ((seen[0] & FP_MXCSR_ROUND) == FP_MXCSR_UP);
+    t2_t_assert ((seen[1] & FP_X87_ROUND) == FP_X87_UP);
+    fp_get (&mxcsr, &x87);
+    t2_t_assert (mxcsr == before_mxcsr && x87 == before_x87);
+
+    t2_co_destroy (&co);
+    return 0;
+}
+
+#endif
+
+struct cancel_data {
+    struct t2_co *co;
+    char *buf;
+    int depth, freed;
+};
+
+static void cancel_cleanup (void *data) {
+    struct cancel_data *d = data;
+    free (d->buf);
+    d->buf = NULL;
+    d->freed++;
+}
+
+static void cancel_deep (struct cancel_data *d, int depth) {
+    if (depth == 0) {
+        while (!d->freed)
+            t2_co_pause ();
+        return;
+    }
+    d->depth++;
+    cancel_deep (d, depth - 1);
+    /* Never reached, since we're cancelled while paused. */
+    d->depth = -1000;
+}
+
+static void cancel_func (void *data) {
+    struct cancel_data *d = data;
+    d->buf = malloc (64);
+    cancel_deep (d, 10);
+}
+
+static void cancel_self (void *data) {
+    struct cancel_data *d = data;
+    d->buf = malloc (64);
+    t2_co_cancel (d->co);
+    d->depth = -1000;
+}
+
+static int test_cancel (void) {
+    struct t2_co co = {};
+    struct cancel_data d = {};
+
+    /* Cancelling a paused coroutine unwinds it into its cleanup hook. */
+    t2_co_create (&co, cancel_func, &d);
+    t2_co_set_cleanup (&co, cancel_cleanup);
+    t2_co_resume (&co);
+    t2_co_resume (&co);
+    t2_t_assert (t2_co_get_status (&co) == T2_CO_SUSPENDED);
+    t2_t_assert (d.buf != NULL && d.depth == 10);
+    t2_co_cancel (&co);
+    t2_t_assert (t2_co_get_status (&co) == T2_CO_DONE);
+    t2_t_assert (d.buf == NULL && d.depth == 10 && d.freed == 1);
+
+    /* Cancelling a finished coroutine does nothing. */
+    t2_co_cancel (&co);
+    t2_t_assert (d.freed == 1);
+
+    /* Cancelling before it starts runs just the hook. */
+    d = (struct cancel_data) {};
+    t2_co_rearm (&co, cancel_func, &d);
+    t2_co_set_cleanup (&co, cancel_cleanup);
+    t2_co_cancel (&co);
+    t2_t_assert (t2_co_get_status (&co) == T2_CO_DONE);
+    t2_t_assert (d.depth == 0 && d.freed == 1);
+
+    /* And a coroutine can cancel itself. */
+    d = (struct cancel_data) { .co = &co };
+    t2_co_rearm (&co, cancel_self, &d);
+    t2_co_set_cleanup (&co, cancel_cleanup);
+    t2_co_resume (&co);
+    t2_t_assert (t2_co_get_status (&co) == T2_CO_DONE);
+    t2_t_assert (d.buf == NULL && d.depth == 0 && d.freed == 1);
+
+    t2_co_destroy (&co);
+    return 0;
+}
+
+/* Handles a "request" of n steps, pausing between each. */
+static void rearm_request (void *data) {
+    int *n = data;
+    while (--*n > 0)
+        t2_co_pause ();
+}
+
+static int test_rearm (void) {
+    enum { N_CO = 4, N_REQUESTS = 1000 };
+    struct t2_co pool[N_CO] = {};
+    int steps[N_CO], next = 0, served = 0;
+
+    for (int i = 0; i < N_CO; i++) {
+        steps[i] = 1 + next++ % 7;
+        t2_co_create (&pool[i], rearm_request, &steps[i]);
+    }
+
+    /* Round-robin over the pool, and give each finished coroutine the
+     * next request, until they've all been served. */
+    while (served < N_REQUESTS) {
+        for (int i = 0; i < N_CO; i++) {
+            if (t2_co_get_status (&pool[i]) == T2_CO_DONE)
+                continue;
+            t2_co_resume (&pool[i]);
+            if (t2_co_get_status (&pool[i]) == T2_CO_DONE) {
+                t2_t_assert (steps[i] == 0);
+                served++;
+                if (next < N_REQUESTS) {
+                    steps[i] = 1 + next++ % 7;
+                    t2_co_rearm (&pool[i], rearm_request, &steps[i]);
+                }
+            }
+        }
+    }
+    t2_t_assert (next == N_REQUESTS);
+
+    for (int i = 0; i < N_CO; i++)
+        t2_co_destroy (&pool[i]);
+    return 0;
+}
+
+struct nest_data {
+    struct t2_co *inner;
+    char log[16];
+    int n;
+};
+
+static void nest_inner (void *data) {
+    struct nest_data *d = data;
+    d->log[d->n++] = 'i';
+    t2_co_pause ();
+    d->log[d->n++] = 'j';
+}
+
+static void nest_outer (void *data) {
+    struct nest_data *d = data;
+    d->log[d->n++] = 'o';
+    t2_co_resume (d->inner);
+    /* inner paused back to us, not to main. */
+    d->log[d->n++] = 'p';
+    t2_co_pause ();
+    d->log[d->n++] = 'q';
+    t2_co_resume (d->inner);
+    d->log[d->n++] = 'r';
+}
+
+static int test_nested (void) {
+    struct t2_co outer = {}, inner = {};
+    struct nest_data d = { .inner = &inner };
+
+    t2_co_create (&outer, nest_outer, &d);
+    t2_co_create (&inner, nest_inner, &d);
+
+    t2_co_resume (&outer);
+    t2_t_assert (strcmp (d.log, "oip") == 0);
+    t2_co_resume (&outer);
+    t2_t_assert (strcmp (d.log, "oipqjr") == 0);
+
+    t2_co_destroy (&outer);
+    t2_co_destroy (&inner);
+    return 0;
+}
+
+static void *count_on_thread (void *data) {
+    enum { N_CO = 8, N = 10000 };
+    struct t2_co co[N_CO] = {};
+    int n[N_CO] = {};
+    int ok = 1;
+
+    for (int i = 0; i < N_CO; i++)
+        t2_co_create (&co[i], count_forever, &n[i]);
+    for (int j = 0; j < N; j++)
+        for (int i = 0; i < N_CO; i++)
+            t2_co_resume (&co[i]);
+    for (int i = 0; i < N_CO; i++) {
+        ok &= (n[i] == N);
+        t2_co_destroy (&co[i]);
+    }
+
+    *(int *) data = ok;
+    return NULL;
+}
+
+static int test_threads (void) {
+    enum { N_THREADS = 4 };
+    pthread_t threads[N_THREADS];
+    int ok[N_THREADS];
+
+    for (int i = 0; i < N_THREADS; i++)
+        pthread_create (&threads[i], NULL, count_on_thread, &ok[i]);
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join (threads[i], NULL);
+        t2_t_assert (ok[i]);
+    }
+
+    return 0;
+}
+
+static void fib_generator (void *data) {
+    long a = 0, b = 1;
+    long limit = (long) t2_co_received ();
+    while (a <= limit) {
+        /* The resumer tells us how many to skip. */
+        long skip = (long) t2_co_pause_with ((void *) a);
+        while (skip-- > 0) {
+            long t = a + b;
+            a = b;
+            b = t;
+        }
+    }
+    t2_co_pause_with ((void *) -1L);
+}
+
+static int test_generator (void) {
+    struct t2_co co = {};
+    t2_co_create (&co, fib_generator, NULL);
+
+    t2_t_assert ((long) t2_co_resume_with (&co, (void *) 100L) == 0);
+    t2_t_assert ((long) t2_co_resume_with (&co, (void *) 1L) == 1);
+    t2_t_assert ((long) t2_co_resume_with (&co, (void *) 1L) == 1);
+    t2_t_assert ((long) t2_co_resume_with (&co, (void *) 1L) == 2);
+    t2_t_assert ((long) t2_co_resume_with (&co, (void *) 5L) == 21);
+    t2_t_assert ((long) t2_co_resume_with (&co, (void *) 10L) == -1);
+
+    t2_co_destroy (&co);
+    return 0;
+}
+
+/* A three-stage pipeline: chunks of a string, upper-cased, reassembled. */
+struct pipe_stage {
+    struct t2_co co;
+    struct t2_co_chan *in, out;
+    struct t2_co_view slot;
+    uint8_t buf[8];
+};
+
+static void pipe_source (void *data) {
+    struct pipe_stage *stage = data;
+    const char *text = "the quick brown fox jumps over the lazy dog";
+    size_t len = strlen (text);
+
+    for (size_t i = 0; i < len; i += 13) {
+        /* Hands out views straight into the string, bigger than the next
+         * stage's buffer. */
+        struct t2_co_view view = { text + i, len - i < 13 ? len - i : 13 };
+        t2_co_chan_send (&stage->out, &view);
+    }
+    t2_co_chan_close (&stage->out);
+}
+
+static void pipe_upper (void *data) {
+    struct pipe_stage *stage = data;
+    struct t2_co_view view;
+
+    while (t2_co_chan_recv (stage->in, &view)) {
+        /* One buffer is enough, since the consumer is done with it by
+         * the time we're resumed. Views that don't fit go out a
+         * buffer's worth at a time. */
+        const char *p = view.data;
+        for (size_t done = 0; done < view.size; ) {
+            size_t n = view.size - done < sizeof (stage->buf) ? view.size - done : sizeof (stage->buf);
+            for (size_t i = 0; i < n; i++, done++)
+                stage->buf[i] = (p[done] >= 'a' && p[done] <= 'z') ? p[done] - 'a' + 'A' : p[done];
+            struct t2_co_view out = { stage->buf, n };
+            t2_co_chan_send (&stage->out, &out);
+        }
+    }
+    t2_co_chan_close (&stage->out);
+}
+
+static int test_channels (void) {
+    struct pipe_stage source = {}, upper = {};
+    char result[64] = {}, *e = result;
+    struct t2_co_view view;
+
+    t2_co_create (&source.co, pipe_source, &source);
+    t2_co_create (&upper.co, pipe_upper, &upper);
+    t2_co_chan_init (&source.out, &source.slot, sizeof (struct t2_co_view), 1, &source.co);
+    upper.in = &source.out;
+    t2_co_chan_init (&upper.out, &upper.slot, sizeof (struct t2_co_view), 1, &upper.co);
+
+    while (t2_co_chan_recv (&upper.out, &view)) {
+        t2_t_assert (view.data == upper.buf);
+        t2_t_assert (view.size > 0 && view.size <= sizeof (upper.buf));
+        t2_t_assert (e + view.size < result + sizeof (result));
+        memcpy (e, view.data, view.size);
+        e += view.size;
+    }
+    t2_t_assert (strcmp (result, "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG") == 0);
+
+    t2_co_destroy (&source.co);
+    t2_co_destroy (&upper.co);
+    return 0;
+}
+
+static int test_stack_pool (void) {
+    struct t2_co a = {}, b = {};
+    int n = 0;
+
+    /* Destroyed stacks get reused... */
+    t2_co_create (&a, count_once, &n);
+    uint8_t *stack = a.stack;
+    t2_co_destroy (&a);
+    t2_co_create (&b, count_once, &n);
+    t2_t_assert (b.stack == stack);
+    t2_co_resume (&b);
+    t2_t_assert (n == 1);
+
+    /* ... unless the stack size has changed since. */
+    t2_co_set_stack_size (T2_CO_DEFAULT_STACK_SIZE * 2);
+    t2_co_destroy (&b);
+    t2_co_create (&a, count_once, &n);
+    t2_t_assert (a.stack_size == T2_CO_DEFAULT_STACK_SIZE * 2);
+    t2_co_resume (&a);
+    t2_t_assert (n == 2);
+    t2_co_destroy (&a);
+    t2_co_set_stack_size (T2_CO_DEFAULT_STACK_SIZE);
+
+    return 0;
+}
+
+static int recurse (int depth) {
+    volatile char frame[256];
+    frame[0] = depth;
+    /* Way past any stack we'd hand out; keeps the compiler from
+     * complaining about infinite recursion. */
+    if (depth > (1 << 24))
+        return 0;
+    return recurse (depth + 1) + frame[0];
+}
+
+static void overflow (void *data) {
+    recurse (0);
+}
+
+static int test_stack_overflow (void) {
+    /* Overflowing the stack should hit the guard page and die with SIGSEGV,
+     * so do it in a child process. */
+    pid_t pid = fork ();
+    if (pid == 0) {
+        struct t2_co co = {};
+        t2_co_create (&co, overflow, NULL);
+        t2_co_resume (&co);
+        _exit (0);
+    }
+
+    int status;
+    t2_t_assert (waitpid (pid, &status, 0) == pid);
+    t2_t_assert (WIFSIGNALED (status) && WTERMSIG (status) == SIGSEGV);
+    return 0;
+}
+
+static void sched_count_task (void *data) {
+    atomic_int *count = data;
+    for (int i = 0; i < 10; i++) {
+        atomic_fetch_add (count, 1);
+        t2_co_yield ();
+    }
+}
+
+static atomic_int sched_parents_ok;
+
+static void sched_parent_task (void *data) {
+    struct t2_co_sched *sched = data;
+    struct t2_co_task *children[100];
+    atomic_int count = 0;
+
+    for (int i = 0; i < 100; i++)
+        children[i] = t2_co_spawn (sched, sched_count_task, &count);
+    for (int i = 0; i < 100; i++)
+        t2_co_join (children[i]);
+
+    /* Everything we spawned has run to completion. */
+    if (atomic_load (&count) == 1000)
+        atomic_fetch_add (&sched_parents_ok, 1);
+}
+
+static int test_sched (void) {
+    struct t2_co_sched *sched = t2_co_sched_new (4);
+    struct t2_co_task *tasks[1000];
+    atomic_int count = 0;
+
+    for (int i = 0; i < 1000; i++)
+        tasks[i] = t2_co_spawn (sched, sched_count_task, &count);
+    for (int i = 0; i < 1000; i++)
+        t2_co_join (tasks[i]);
+    t2_t_assert (atomic_load (&count) == 10000);
+
+    /* Tasks spawning and joining tasks. */
+    for (int i = 0; i < 10; i++)
+        t2_co_detach (t2_co_spawn (sched, sched_parent_task, sched));
+    t2_co_sched_free (sched);
+    t2_t_assert (atomic_load (&sched_parents_ok) == 10);
+
+    return 0;
+}
+
+static void sched_work_task (void *data) {
+    volatile uint64_t x = (uintptr_t) data;
+    for (int i = 0; i < 100; i++) {
+        for (int j = 0; j < 1000; j++)
+            x = x * 6364136223846793005ULL + 1;
+        t2_co_yield ();
+    }
+}
+
+/* Spawns n tasks and waits for them, with all the overhead of the
+ * scheduler starting up and shutting down spread over them. */
+static int bench_sched (size_t n, int n_workers) {
+    struct t2_co_sched *sched = t2_co_sched_new (n_workers);
+    for (uintptr_t i = 0; i < n; i++)
+        t2_co_detach (t2_co_spawn (sched, sched_work_task, (void *) i));
+    t2_co_sched_free (sched);
+    return 0;
+}
+
+static int bench_sched_one_worker (size_t n) {
+    return bench_sched (n, 1);
+}
+
+/* Compared to the above, how well the scheduler scales across cores. */
+static int bench_sched_all_workers (size_t n) {
+    return bench_sched (n, 0);
+}
+
+struct io_data {
+    int fd;
+    size_t total;
+    uint32_t sum;
+};
+
+static void io_writer (void *data) {
+    struct io_data *d = data;
+    uint8_t buf[4096];
+
+    for (size_t sent = 0; sent < d->total; ) {
+        size_t size = d->total - sent < sizeof (buf) ? d->total - sent : sizeof (buf);
+        for (size_t i = 0; i < size; i++)
+            buf[i] = sent + i;
+        ssize_t n = t2_co_write (d->fd, buf, size);
+        if (n <= 0)
+            abort ();
+        for (ssize_t i = 0; i < n; i++)
+            d->sum += buf[i];
+        /* Pick up where a short write left off. */
+        sent += n;
+    }
+    t2_co_close (d->fd);
+}
+
+static void io_reader (void *data) {
+    struct io_data *d = data;
+    uint8_t buf[1000];
+    ssize_t n;
+
+    while ((n = t2_co_read (d->fd, buf, sizeof (buf))) > 0) {
+        d->total += n;
+        for (ssize_t i = 0; i < n; i++)
+            d->sum += buf[i];
+    }
+}
+
+static int test_io (void) {
+    enum { N_PAIRS = 16 };
+    struct t2_co_reactor *reactor = t2_co_reactor_new ();
+    struct t2_co writers[N_PAIRS] = {}, readers[N_PAIRS] = {};
+    struct io_data w[N_PAIRS] = {}, r[N_PAIRS] = {};
+
+    /* Far more data than fits in a socket buffer, so both sides have to
+     * wait on each other many times over. */
+    for (int i = 0; i < N_PAIRS; i++) {
+        int fds[2];
+        t2_t_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        t2_co_set_nonblocking (fds[0]);
+        t2_co_set_nonblocking (fds[1]);
+        w[i] = (struct io_data) { .fd = fds[0], .total = 1 << 20 };
+        r[i] = (struct io_data) { .fd = fds[1] };
+        t2_co_create (&writers[i], io_writer, &w[i]);
+        t2_co_create (&readers[i], io_reader, &r[i]);
+        t2_co_resume (&writers[i]);
+        t2_co_resume (&readers[i]);
+    }
+
+    t2_co_reactor_run (reactor);
+
+    for (int i = 0; i < N_PAIRS; i++) {
+        t2_t_assert (r[i].total == w[i].total);
+        t2_t_assert (r[i].sum == w[i].sum);
+        close (r[i].fd);
+        t2_co_destroy (&writers[i]);
+        t2_co_destroy (&readers[i]);
+    }
+
+    t2_co_reactor_free (reactor);
+    return 0;
+}
+
+struct io_wait {
+    int fd;
+    ssize_t res;
+    int err;
+};
+
+static void io_wait_read (void *data) {
+    struct io_wait *d = data;
+    char c;
+    d->res = t2_co_read (d->fd, &c, 1);
+    d->err = errno;
+}
+
+static int test_io_close (void) {
+    int fds[2];
+    t2_t_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    t2_co_set_nonblocking (fds[0]);
+    t2_co_set_nonblocking (fds[1]);
+
+    /* With no reactor, there's nothing to wait with. */
+    struct t2_co co = {};
+    struct io_wait d = { .fd = fds[0] };
+    t2_co_create (&co, io_wait_read, &d);
+    t2_co_resume (&co);
+    t2_t_assert (t2_co_get_status (&co) == T2_CO_DONE);
+    t2_t_assert (d.res == -1 && d.err == EAGAIN);
+
+    /* Closing an fd wakes up whoever was waiting on it, and the reactor
+     * doesn't wait for them anymore. */
+    struct t2_co_reactor *reactor = t2_co_reactor_new ();
+    d = (struct io_wait) { .fd = fds[0] };
+    t2_co_rearm (&co, io_wait_read, &d);
+    t2_co_resume (&co);
+    t2_t_assert (t2_co_get_status (&co) != T2_CO_DONE);
+    t2_co_close (fds[0]);
+    t2_t_assert (t2_co_get_status (&co) == T2_CO_DONE);
+    t2_t_assert (d.res == -1 && d.err == EBADF);
+    t2_co_reactor_run (reactor);
+
+    t2_co_destroy (&co);
+    t2_co_reactor_free (reactor);
+    close (fds[1]);
+    return 0;
+}
+
+static int test_io_cancel (void) {
+    int fds[2];
+    t2_t_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    t2_co_set_nonblocking (fds[0]);
+    t2_co_set_nonblocking (fds[1]);
+
+    struct t2_co_reactor *reactor = t2_co_reactor_new ();
+    struct t2_co co = {};
+    struct io_wait d = { .fd = fds[0] };
+    t2_co_create (&co, io_wait_read, &d);
+    t2_co_resume (&co);
+    t2_t_assert (reactor->n_waiting == 1);
+
+    /* Once cancelled, it isn't waiting anymore, and data arriving for it
+     * doesn't resume it again. */
+    t2_co_cancel (&co);
+    t2_t_assert (t2_co_get_status (&co) == T2_CO_DONE);
+    t2_t_assert (reactor->n_waiting == 0);
+    t2_t_assert (write (fds[1], "x", 1) == 1);
+    t2_t_assert (t2_co_reactor_poll (reactor, 0) == 0);
+    t2_co_reactor_run (reactor);
+
+    /* The same for one that's rearmed while it waits. */
+    char c;
+    t2_t_assert (read (fds[0], &c, 1) == 1);
+    t2_co_rearm (&co, io_wait_read, &d);
+    t2_co_resume (&co);
+    t2_t_assert (reactor->n_waiting == 1);
+    t2_co_rearm (&co, io_wait_read, &d);
+    t2_t_assert (reactor->n_waiting == 0);
+    t2_t_assert (write (fds[1], "x", 1) == 1);
+    t2_t_assert (t2_co_reactor_poll (reactor, 0) == 0);
+    t2_co_reactor_run (reactor);
+
+    t2_co_destroy (&co);
+    t2_co_reactor_free (reactor);
+    close (fds[0]);
+    close (fds[1]);
+    return 0;
+}
+
+/* Wakes up with the writer still waiting on the same fd, closes it, and
+ * then waits on an fd high enough that the reactor has to grow. */
+struct io_race {
+    int fd, high;
+    ssize_t w_res;
+    int w_err;
+    bool r_done;
+};
+
+static void io_race_reader (void *data) {
+    struct io_race *d = data;
+    char c;
+    t2_co_read (d->fd, &c, 1);
+    t2_co_close (d->fd);
+    t2_co_read (d->high, &c, 1);
+    d->r_done = true;
+}
+
+static void io_race_writer (void *data) {
+    struct io_race *d = data;
+    char c = 0;
+    d->w_res = t2_co_write (d->fd, &c, 1);
+    d->w_err = errno;
+}
+
+static int test_io_poll_close (void) {
+    int fds[2], other[2];
+    static char buf[1 << 16];
+    t2_t_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    t2_t_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, other) == 0);
+    t2_co_set_nonblocking (fds[0]);
+    t2_co_set_nonblocking (fds[1]);
+    t2_t_assert (dup2 (other[0], 900) == 900);
+    t2_co_set_nonblocking (900);
+
+    /* Fill the socket up so the writer has to wait. */
+    while (write (fds[0], buf, sizeof (buf)) > 0)
+        ;
+
+    struct t2_co_reactor *reactor = t2_co_reactor_new ();
+    struct io_race d = { .fd = fds[0], .high = 900 };
+    struct t2_co r = {}, w = {};
+    t2_co_create (&r, io_race_reader, &d);
+    t2_co_create (&w, io_race_writer, &d);
+    t2_co_resume (&r);
+    t2_co_resume (&w);
+    t2_t_assert (reactor->n_waiting == 2);
+
+    /* Both sides become ready at once. */
+    while (read (fds[1], buf, sizeof (buf)) > 0)
+        ;
+    t2_t_assert (write (fds[1], "x", 1) == 1);
+    while (t2_co_get_status (&w) != T2_CO_DONE)
+        t2_co_reactor_poll (reactor, -1);
+
+    /* The close woke the writer, and only the reader is left. */
+    t2_t_assert (d.w_res == -1 && d.w_err == EBADF);
+    t2_t_assert (reactor->n_waiting == 1);
+    t2_t_assert (!d.r_done);
+
+    t2_t_assert (write (other[1], "x", 1) == 1);
+    t2_co_reactor_run (reactor);
+    t2_t_assert (d.r_done);
+    t2_t_assert (reactor->n_waiting == 0);
+
+    t2_co_destroy (&r);
+    t2_co_destroy (&w);
+    t2_co_reactor_free (reactor);
+    close (fds[1]);
+    close (other[0]);
+    close (other[1]);
+    close (900);
+    return 0;
+}
+
+#if T2_CO_STATS
+
+static void stats_spin (long ns) {
+    struct timespec start, now;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    do
+        clock_gettime (CLOCK_MONOTONIC, &now);
+    while ((now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec) < ns);
+}
+
+static void stats_inner (void *data) {
+    /* Deep enough to show up in the stack high-water mark. */
+    volatile char big[48 * 1024];
+    for (size_t i = 0; i < sizeof (big); i += 64)
+        big[i] = 1;
+    while (1) {
+        stats_spin (2000000);
+        t2_co_pause ();
+    }
+}
+
+static void stats_outer (void *data) {
+    struct t2_co *inner = data;
+    while (1) {
+        t2_co_resume (inner);
+        t2_co_pause ();
+    }
+}
+
+static int test_stats (void) {
+    struct t2_co outer = {}, inner = {};
+    struct t2_co_stats os, is;
+
+    t2_co_create (&outer, stats_outer, &inner);
+    t2_co_create (&inner, stats_inner, NULL);
+    t2_co_set_name (&outer, "outer");
+    t2_co_set_name (&inner, "inner");
+
+    for (int i = 0; i < 3; i++) {
+        t2_co_resume (&outer);
+        struct timespec ts = { 0, 1000000 };
+        nanosleep (&ts, NULL);
+    }
+
+    t2_co_get_stats (&outer, &os);
+    t2_co_get_stats (&inner, &is);
+    t2_t_assert (os.resumes == 3 && is.resumes == 3);
+
+    /* The inner coroutine's spinning counts against it, not its resumer. */
+    t2_t_assert (is.run_ns >= 6000000);
+    t2_t_assert (is.max_run_ns >= 2000000);
+    t2_t_assert (os.run_ns < is.run_ns);
+    t2_t_assert (os.suspended_ns >= 2000000);
+
+    t2_t_assert (is.stack_used >= sizeof (char [48 * 1024]) && is.stack_used < 64 * 1024);
+    t2_t_assert (os.stack_used < 4096);
+
+    FILE *f = tmpfile ();
+    char buf[4096] = {};
+    t2_co_stats_dump (f);
+    rewind (f);
+    size_t n = fread (buf, 1, sizeof (buf) - 1, f);
+    fclose (f);
+    t2_t_assert (n > 0 && strstr (buf, "outer") && strstr (buf, "inner"));
+
+    t2_co_destroy (&outer);
+    t2_co_destroy (&inner);
+    return 0;
+}
+
+#endif /* T2_CO_STATS */
+
+/* A resume, and the pause that comes back from it. */
+static int bench_switch (size_t n) {
+    struct t2_co co = {};
+    int count = 0;
+
+    t2_co_create (&co, count_forever, &count);
+    for (size_t i = 0; i < n; i++)
+        t2_co_resume (&co);
+    t2_t_assert (count == (int) n);
+
+    t2_co_destroy (&co);
     return 0;
 }
 
 static struct t2_t_test tests[] = {
     t2_t_test(test_parser),
+    t2_t_test(test_return),
+#if T2_CO__ASM && defined(__x86_64__)
+    t2_t_test(test_fp_modes),
+#endif
+    t2_t_test(test_cancel),
+    t2_t_test(test_rearm),
+    t2_t_test(test_nested),
+    t2_t_test(test_threads),
+    t2_t_test(test_generator),
+    t2_t_test(test_channels),
+    t2_t_test(test_stack_pool),
+    t2_t_test(test_stack_overflow),
+    t2_t_test(test_io),
+    t2_t_test(test_io_close),
+    t2_t_test(test_io_cancel),
+    t2_t_test(test_io_poll_close),
+#if T2_CO_STATS
+    t2_t_test(test_stats),
+#endif
+    t2_t_test(test_sched),
+    t2_t_bench(bench_switch, 0),
+    t2_t_bench(bench_sched_one_worker, 0),
+    t2_t_bench(bench_sched_all_workers, 0),
     {},
 };
 
@@ -0,0 +1,102 @@
+/* t2_cpu: Picking SIMD kernels at runtime. */
+
+/* Written by Jasper St. Pierre <jstpierre@mecheye.net>
+ * I license this work into the public domain. */
+
+/* The other libraries build each of their hot loops several times over,
+ * once per instruction set, using the compiler's target attribute so
+ * that the rest of the program doesn't need to be built with -mavx2 and
+ * friends. The first call checks which ones the CPU can run, and from
+ * then on goes straight to the best one. One binary then runs as well
+ * as it can on every machine.
+ *
+ * Kernels are kept in an array indexed by t2_cpu_level, with NULL for
+ * any level that wasn't built (on other architectures, everything but
+ * the scalar kernel):
+ *
+ *     static size_t (*count_kernels[T2_CPU_N_LEVELS]) (...) = {
+ *         count_scalar, T2_CPU_X86_ONLY (count_sse42, count_avx2, NULL)
+ *     };
+ *
+ *     size_t count (...) {
+ *         size_t (*fn) (...);
+ *         T2_CPU_DISPATCH (fn, count_kernels);
+ *         return fn (...);
+ *     }
+ *
+ * Setting T2_CPU in the environment to one of the level names caps the
+ * level that gets picked, which is handy for benchmarking the kernels
+ * against each other. */
+
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+
+enum t2_cpu_level {
+    T2_CPU_SCALAR,
+    T2_CPU_SSE42,
+    T2_CPU_AVX2,
+    /* AVX-512 F and BW. */
+    T2_CPU_AVX512,
+    T2_CPU_N_LEVELS,
+};
+
+static const char *const t2_cpu_level_names[T2_CPU_N_LEVELS] = { "scalar", "sse4.2", "avx2", "avx512" };
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define T2_CPU_X86 1
+#define T2_CPU_X86_ONLY(...) __VA_ARGS__
+#include <immintrin.h>
+#else
+#define T2_CPU_X86 0
+#define T2_CPU_X86_ONLY(...)
+#endif
+
+/* The best level that the CPU and OS both support, and that T2_CPU
+ * allows. */
+static enum t2_cpu_level t2_cpu_level (void) {
+    /* Threads may race to work this out, and they all get the same
+     * answer, but the accesses still have to be atomic. */
+    static int level = -1;
+    int cached = __atomic_load_n (&level, __ATOMIC_RELAXED);
+    if (cached >= 0)
+        return cached;
+
+    int best = T2_CPU_SCALAR;
+#if T2_CPU_X86
+    /* These check that the OS saves the wider registers, too. */
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("sse4.2"))
+        best = T2_CPU_SSE42;
+    if (__builtin_cpu_supports ("avx2"))
+        best = T2_CPU_AVX2;
+    if (__builtin_cpu_supports ("avx512f") && __builtin_cpu_supports ("avx512bw"))
+        best = T2_CPU_AVX512;
+#endif
+
+    const char *cap = getenv ("T2_CPU");
+    if (cap)
+        for (int i = 0; i < best; i++)
+            if (strcmp (cap, t2_cpu_level_names[i]) == 0)
+                best = i;
+
+    __atomic_store_n (&level, best, __ATOMIC_RELAXED);
+    return best;
+}
+
+/* Points fn, a local, at the best kernel out of kernels. The choice is
+ * worked out the first time through and kept in a static after that.
+ * Racing threads all store the same thing, but as with t2_cpu_level's
+ * cache, the accesses have to be atomic. */
+#define T2_CPU_DISPATCH(fn, kernels) do {                               \
+    static __typeof__ (fn) cached_;                                     \
+    (fn) = __atomic_load_n (&cached_, __ATOMIC_RELAXED);                \
+    if (!(fn)) {                                                        \
+        int level_ = t2_cpu_level ();                                   \
+        while (!(kernels)[level_])                                      \
+            level_--;                                                   \
+        (fn) = (kernels)[level_];                                       \
+        __atomic_store_n (&cached_, (fn), __ATOMIC_RELAXED);            \
+    }                                                                   \
+} while (0)
@@ -0,0 +1,2272 @@
+
+/* t2_deflate: An easy-to-read single-file implementation of DEFLATE, based on RFC 1951. */
+
+/* Written by Jasper St. Pierre <jstpierre@mecheye.net>
+ * I license this work into the public domain. */
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "t2_z_common.h"
+
+enum { T2_Z_DEFAULT_LEVEL = 6, T2_Z_MAX_LEVEL = 12 };
+
+/* Compresses buf_in, from its position to its end, into buf_out at its
+ * position. Afterwards, the positions are just past what was read and
+ * written. level goes from 0, which just stores the data, to 9, which
+ * tries as hard as zlib does; t2_z_deflate uses T2_Z_DEFAULT_LEVEL.
+ * Levels 10 to T2_Z_MAX_LEVEL are much slower again, for data that's
+ * compressed once and kept for a long time. */
+static void t2_z_deflate (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out);
+static void t2_z_deflate_level (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int level);
+
+/* The same, with a preset dictionary, which the input can refer back
+ * into as if it had come just before it. Only the last 32K of dict can
+ * be reached. The other side needs the same dictionary, passed to
+ * t2_z_inflate_dict. */
+static void t2_z_deflate_dict (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int level, const uint8_t *dict, size_t dict_size);
+
+/* Compressing a stream that's produced a piece at a time, without
+ * holding on to all of it: only the last 64K of input, and the hash
+ * chains, are kept around.
+ *
+ * Each call takes all of buf_in, and writes what it can to buf_out. It
+ * returns 1 once everything that can be written has been, and 0 if it
+ * ran out of room, in which case it needs calling again with more room
+ * in buf_out (and the rest of buf_in, if any). flush says how much has
+ * to be written:
+ *
+ *   T2_Z_NO_FLUSH: whatever's convenient. Some input stays buffered.
+ *   T2_Z_SYNC_FLUSH: everything so far, ending in an empty stored block,
+ *     so that the output so far ends on a byte, and a reader can decode
+ *     all of it. Too many of these hurt compression.
+ *   T2_Z_FULL_FLUSH: the same, and later output won't refer back to
+ *     anything before it, so a reader can start from there.
+ *   T2_Z_FINISH: everything, and the end of the stream. */
+enum t2_z_flush {
+    T2_Z_NO_FLUSH,
+    T2_Z_SYNC_FLUSH,
+    T2_Z_FULL_FLUSH,
+    T2_Z_FINISH,
+};
+
+struct t2_z_deflate_stream;
+static struct t2_z_deflate_stream *t2_z_deflate_stream_new (int level);
+static int t2_z_deflate_stream (struct t2_z_deflate_stream *stream, struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, enum t2_z_flush flush);
+static void t2_z_deflate_stream_free (struct t2_z_deflate_stream *stream);
+
+/* Starts a stream off with a preset dictionary. This has to come before
+ * any input. */
+static void t2_z_deflate_stream_set_dictionary (struct t2_z_deflate_stream *stream, const uint8_t *dict, size_t dict_size);
+
+/* Compresses buf_in into a zlib stream (RFC 1950), which is what
+ * t2_z_zlib_inflate reads. With a dict, its Adler-32 goes in the header,
+ * so that the other side can check it has the right one. dict can be
+ * NULL. */
+static void t2_z_zlib_deflate (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int level, const uint8_t *dict, size_t dict_size);
+
+/* Makes a dictionary for messages like the samples, of up to dict_size
+ * bytes, and returns how big it came out. The parts of the samples that
+ * come up in the most of them are picked, and the most useful go last,
+ * since closer matches are cheaper. A few hundred samples, and a
+ * dictionary of a few K, are plenty for small messages. */
+static size_t t2_z_train_dictionary (const struct t2_z_buffer *samples, size_t n_samples, uint8_t *dict, size_t dict_size);
+
+/* The same, but split into chunks of T2_Z_PARALLEL_CHUNK_SIZE, which are
+ * compressed on n_threads threads at once, or one per core if that's 0.
+ * Each chunk uses the 32K before it as a dictionary, and they're joined
+ * with sync flushes, so it's still one ordinary stream, and hardly any
+ * bigger. */
+#ifndef T2_Z_PARALLEL_CHUNK_SIZE
+#define T2_Z_PARALLEL_CHUNK_SIZE (256 * 1024)
+#endif
+
+static void t2_z_deflate_parallel (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int level, int n_threads);
+
+/* Or, BGZF, as used by samtools and friends: a series of gzip members
+ * of up to 64K each, that don't refer to each other, so that they can be
+ * decompressed in parallel, too, or read from the middle. It's a little
+ * bigger for that. */
+static void t2_z_deflate_bgzf (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int level, int n_threads);
+
+/* How big buf_out needs to be for size bytes of input, at worst. This
+ * doesn't cover BGZF's headers. */
+static size_t t2_z_deflate_bound (size_t size);
+
+#ifdef T2_Z_IMPLEMENTATION
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "t2_cpu.h"
+
+/* Writes a buffer a bit at a time, in DEFLATE order, the mirror image of
+ * t2_z__bitreader: values go in starting from their LSB, and fill each
+ * byte starting from its LSB. Bits pile up in an accumulator until
+ * there's a whole byte to write out. */
+struct t2_z__bitwriter {
+    struct t2_z_buffer *buffer;
+
+    uint64_t bits;
+    /* The number of bits in bits, from 0-7 between calls. */
+    int n_bits;
+};
+
+static void t2_z__bitwriter_write (struct t2_z__bitwriter *w, uint32_t value, int nbits) {
+    w->bits |= (uint64_t) value << w->n_bits;
+    w->n_bits += nbits;
+
+    while (w->n_bits >= 8) {
+        t2_d_assert (w->buffer->position < w->buffer->size);
+        w->buffer->data[w->buffer->position++] = w->bits;
+        w->bits >>= 8;
+        w->n_bits -= 8;
+    }
+}
+
+/* "Flush" means pad out the current byte with zeroes, so the next thing
+ * written starts on a byte. */
+static void t2_z__bitwriter_flush (struct t2_z__bitwriter *w) {
+    if (w->n_bits > 0)
+        t2_z__bitwriter_write (w, 0, 8 - w->n_bits);
+}
+
+/* Huffman codes. Going this way, we only need the code for each symbol,
+ * and that's much simpler than t2_inflate's tables. Codes are written
+ * starting from their MSB, unlike everything else, so they're kept
+ * bit-reversed, and then they can be written like any other value. */
+struct t2_z__huffman_codes {
+    uint16_t code[288];
+    uint8_t length[288];
+};
+
+/* The same canonical code assignment as t2_z__build_huffman_table, from
+ * RFC 3.2.2: shorter codes come first, and within a length, codes go to
+ * symbols in order. */
+static void t2_z__build_huffman_codes (struct t2_z__huffman_codes *codes, const uint8_t *sym_to_code_length, size_t num_symbols) {
+    uint16_t count[16] = {}, next_code[16] = {};
+
+    for (size_t symbol = 0; symbol < num_symbols; symbol++)
+        count[sym_to_code_length[symbol]]++;
+    count[0] = 0;
+
+    uint16_t code = 0;
+    for (int code_length = 1; code_length < 16; code_length++) {
+        code = (code + count[code_length - 1]) << 1;
+        next_code[code_length] = code;
+    }
+
+    for (size_t symbol = 0; symbol < num_symbols; symbol++) {
+        uint8_t code_length = sym_to_code_length[symbol];
+        uint16_t code = code_length ? next_code[code_length]++ : 0, reversed = 0;
+
+        for (int i = 0; i < code_length; i++)
+            reversed |= ((code >> i) & 1) << (code_length - 1 - i);
+
+        codes->code[symbol] = reversed;
+        codes->length[symbol] = code_length;
+    }
+}
+
+static void t2_z__bitwriter_write_symbol (struct t2_z__bitwriter *w, const struct t2_z__huffman_codes *codes, uint16_t symbol) {
+    t2_d_assert (codes->length[symbol] > 0);
+    t2_z__bitwriter_write (w, codes->code[symbol], codes->length[symbol]);
+}
+
+struct t2_z__huffman_codes_pair {
+    struct t2_z__huffman_codes literal;
+    struct t2_z__huffman_codes distance;
+};
+
+/* Built once, by whichever thread gets there first. */
+static struct t2_z__huffman_codes_pair t2_z__fixed_codes;
+static pthread_once_t t2_z__fixed_codes_once = PTHREAD_ONCE_INIT;
+
+static void t2_z__build_fixed_huffman_codes (void) {
+    struct t2_z__huffman_codes_pair *codes = &t2_z__fixed_codes;
+
+    /* literal */
+    {
+        uint8_t sym_to_code_length[288];
+        size_t sym;
+
+        for (sym =   0; sym <= 143; sym++) sym_to_code_length[sym] = 8;
+        for (sym = 144; sym <= 255; sym++) sym_to_code_length[sym] = 9;
+        for (sym = 256; sym <= 279; sym++) sym_to_code_length[sym] = 7;
+        for (sym = 280; sym <= 287; sym++) sym_to_code_length[sym] = 8;
+
+        t2_z__build_huffman_codes (&codes->literal, sym_to_code_length, sizeof (sym_to_code_length));
+    }
+
+    /* distance */
+    {
+        uint8_t sym_to_code_length[32];
+        memset (sym_to_code_length, 5, sizeof (sym_to_code_length));
+        t2_z__build_huffman_codes (&codes->distance, sym_to_code_length, sizeof (sym_to_code_length));
+    }
+
+}
+
+static struct t2_z__huffman_codes_pair *t2_z__fixed_huffman_codes (void) {
+    pthread_once (&t2_z__fixed_codes_once, t2_z__build_fixed_huffman_codes);
+    return &t2_z__fixed_codes;
+}
+
+/* Turning lengths and distances into symbols and extra bits; the reverse
+ * of t2_z__decode_length and t2_z__decode_distance, see RFC 3.2.5. Past
+ * the first few, every four length symbols (two distance symbols) cover
+ * twice the range of the four before, so the symbol comes out of where
+ * the value's top bit is, and the two (one) bits after it. The rest of
+ * the bits are the extra bits. */
+struct t2_z__symbol {
+    uint16_t symbol;
+    uint8_t nbits;
+    uint16_t extra;
+};
+
+static struct t2_z__symbol t2_z__encode_length (uint16_t length) {
+    uint32_t value = length - 3;
+
+    /* 258 has a symbol to itself, so it doesn't need extra bits. */
+    if (length == 258)
+        return (struct t2_z__symbol) { 285, 0, 0 };
+    if (value < 8)
+        return (struct t2_z__symbol) { 257 + value, 0, 0 };
+
+    int top = 31 - __builtin_clz (value), nbits = top - 2;
+    return (struct t2_z__symbol) { 257 + 4 * (top - 1) + ((value >> nbits) & 3), nbits, value & ((1 << nbits) - 1) };
+}
+
+static struct t2_z__symbol t2_z__encode_distance (uint16_t distance) {
+    uint32_t value = distance - 1;
+
+    if (value < 4)
+        return (struct t2_z__symbol) { value, 0, 0 };
+
+    int top = 31 - __builtin_clz (value), nbits = top - 1;
+    return (struct t2_z__symbol) { 2 * top + ((value >> nbits) & 1), nbits, value & ((1 << nbits) - 1) };
+}
+
+/* Finding matches. */
+
+enum {
+    /* How far back a match can be. */
+    T2_Z__WINDOW_SIZE = 32768,
+    T2_Z__MAX_MATCH = 258,
+
+    /* Matches are found by hashing the next 4 bytes, so they're never
+     * shorter than that. DEFLATE allows 3, but those rarely save anything
+     * once the distance is paid for. */
+    T2_Z__MIN_MATCH = 4,
+    T2_Z__HASH_BITS = 15,
+
+    /* How many literals and matches go in a block. */
+    T2_Z__BLOCK_TOKENS = 16384,
+};
+
+/* How many bytes a and b have in common, up to max. This is where a
+ * compressor spends most of its time, so there's a kernel for each level
+ * in t2_cpu.h rather than a loop comparing bytes. The scalar one compares
+ * 8 bytes at a time, and XORing them leaves the first difference in the
+ * lowest set bit; the SIMD ones compare a vector at a time, and find it
+ * in the mask of bytes that didn't match. None of them read past max. */
+static size_t t2_z__match_length_scalar (const uint8_t *a, const uint8_t *b, size_t max) {
+    size_t n = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; n + 8 <= max; n += 8) {
+        uint64_t x, y;
+        memcpy (&x, a + n, 8);
+        memcpy (&y, b + n, 8);
+        if (x != y)
+            return n + __builtin_ctzll (x ^ y) / 8;
+    }
+#endif
+
+    while (n < max && a[n] == b[n])
+        n++;
+    return n;
+}
+
+#if T2_CPU_X86
+__attribute__((target ("sse4.2")))
+static size_t t2_z__match_length_sse42 (const uint8_t *a, const uint8_t *b, size_t max) {
+    size_t n = 0;
+    for (; n + 16 <= max; n += 16) {
+        __m128i eq = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) (a + n)), _mm_loadu_si128 ((const __m128i *) (b + n)));
+        uint32_t differ = ~_mm_movemask_epi8 (eq) & 0xFFFF;
+        if (differ)
+            return n + __builtin_ctz (differ);
+    }
+    return n + t2_z__match_length_scalar (a + n, b + n, max - n);
+}
+
+__attribute__((target ("avx2")))
+static size_t t2_z__match_length_avx2 (const uint8_t *a, const uint8_t *b, size_t max) {
+    size_t n = 0;
+    for (; n + 32 <= max; n += 32) {
+        __m256i eq = _mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i *) (a + n)), _mm256_loadu_si256 ((const __m256i *) (b + n)));
+        uint32_t differ = ~(uint32_t) _mm256_movemask_epi8 (eq);
+        if (differ)
+            return n + __builtin_ctz (differ);
+    }
+    return n + t2_z__match_length_sse42 (a + n, b + n, max - n);
+}
+
+/* Masked loads take care of the last vector, so this one doesn't need
+ * to hand off the end. */
+__attribute__((target ("avx512f,avx512bw")))
+static size_t t2_z__match_length_avx512 (const uint8_t *a, const uint8_t *b, size_t max) {
+    size_t n = 0;
+    for (; n + 64 <= max; n += 64) {
+        __mmask64 differ = _mm512_cmpneq_epi8_mask (_mm512_loadu_si512 (a + n), _mm512_loadu_si512 (b + n));
+        if (differ)
+            return n + __builtin_ctzll (differ);
+    }
+    __mmask64 tail = ((__mmask64) 1 << (max - n)) - 1;
+    __mmask64 differ = _mm512_mask_cmpneq_epi8_mask (tail, _mm512_maskz_loadu_epi8 (tail, a + n), _mm512_maskz_loadu_epi8 (tail, b + n));
+    return differ ? n + __builtin_ctzll (differ) : max;
+}
+#endif /* T2_CPU_X86 */
+
+static size_t (*const t2_z__match_length_kernels[T2_CPU_N_LEVELS]) (const uint8_t *a, const uint8_t *b, size_t max) = {
+    t2_z__match_length_scalar, T2_CPU_X86_ONLY (t2_z__match_length_sse42, t2_z__match_length_avx2, t2_z__match_length_avx512)
+};
+
+/* How each level goes about it. Greedy takes the longest match at each
+ * position. Lazy, like zlib, holds on to a match for a position while it
+ * checks whether the next one has a longer one, and if it does, writes a
+ * literal instead and takes that. Optimal looks at every match at every
+ * position in the block, and picks whichever path through them is
+ * cheapest, in the zopfli style; see t2_z__deflate_optimal. */
+enum t2_z__deflate_strategy {
+    T2_Z__STORED,
+    T2_Z__GREEDY,
+    T2_Z__LAZY,
+    T2_Z__OPTIMAL,
+};
+
+/* max_chain is how many earlier positions with the same hash get
+ * compared before giving up, and once there's a match of nice_length,
+ * that's good enough to stop looking. Lazy doesn't look any further past
+ * a match of max_lazy, and only looks through a quarter of the chain
+ * past one of good_length. Optimal goes around iterations times. */
+struct t2_z__deflate_config {
+    enum t2_z__deflate_strategy strategy;
+    uint16_t good_length;
+    uint16_t max_lazy;
+    uint16_t nice_length;
+    uint16_t max_chain;
+    uint8_t iterations;
+};
+
+static const struct t2_z__deflate_config t2_z__deflate_configs[T2_Z_MAX_LEVEL + 1] = {
+    { T2_Z__STORED },
+    { T2_Z__GREEDY,   0,   0,   8,    4 },
+    { T2_Z__GREEDY,   0,   0,  16,    8 },
+    { T2_Z__GREEDY,   0,   0,  32,   32 },
+    { T2_Z__LAZY,     4,   4,  16,   16 },
+    { T2_Z__LAZY,     8,  16,  32,   32 },
+    { T2_Z__LAZY,     8,  16, 128,  128 },
+    { T2_Z__LAZY,     8,  32, 128,  256 },
+    { T2_Z__LAZY,    32, 128, 258, 1024 },
+    { T2_Z__LAZY,    32, 258, 258, 4096 },
+    { T2_Z__OPTIMAL,  0,   0, 258,  256,  4 },
+    { T2_Z__OPTIMAL,  0,   0, 258, 1024,  8 },
+    { T2_Z__OPTIMAL,  0,   0, 258, 4096, 15 },
+};
+
+/* A literal, or a match, waiting to be written out with the rest of its
+ * block. A distance of 0 means length is a literal byte. */
+struct t2_z__token {
+    uint16_t length;
+    uint16_t distance;
+};
+
+/* Everything the optimal parser needs for a block, which is only worth
+ * allocating at those levels. For each position, every match that's
+ * longer than the ones closer by, and then for each position, the
+ * cheapest way found to get there. */
+enum { T2_Z__MAX_MATCHES = 8 };
+
+struct t2_z__match {
+    uint16_t length;
+    uint16_t distance;
+};
+
+struct t2_z__optimal {
+    uint8_t n_matches[T2_Z__BLOCK_TOKENS];
+    struct t2_z__match matches[T2_Z__BLOCK_TOKENS][T2_Z__MAX_MATCHES];
+
+    uint32_t cost[T2_Z__BLOCK_TOKENS + 1];
+    struct t2_z__token arrival[T2_Z__BLOCK_TOKENS + 1];
+
+    /* The best parse so far. */
+    size_t n_best;
+    struct t2_z__token best[T2_Z__BLOCK_TOKENS];
+};
+
+struct t2_z__deflate_state {
+    /* All of the input, or for a stream, what's in its window. Only
+     * what's from start on gets compressed; what's before it is a
+     * dictionary, which matches can refer back to. position is how far
+     * the parser has got. */
+    const uint8_t *data;
+    size_t start, size, position;
+
+    struct t2_z__bitwriter bitwriter;
+    const struct t2_z__deflate_config *config;
+
+    /* The hash chains. head has the latest position for each hash, and
+     * prev, indexed by position within the window, has the one before
+     * that with the same hash, so following prev from head goes back
+     * through every earlier position with the same hash, nearest first.
+     * Positions are stored plus one, so that zero can mean there aren't
+     * any more. */
+    uint32_t head[1 << T2_Z__HASH_BITS];
+    uint32_t prev[T2_Z__WINDOW_SIZE];
+
+    /* The tokens for the block so far, and the input they cover. */
+    size_t block_start, block_length;
+    size_t n_tokens;
+    struct t2_z__token tokens[T2_Z__BLOCK_TOKENS];
+
+    /* Lazy's match for the position before, which it hasn't decided
+     * about yet. */
+    struct t2_z__match pending;
+
+    struct t2_z__optimal *optimal;
+};
+
+/* The hash only needs to spread out 4 bytes over the buckets, so it's a
+ * single multiply by a big odd constant, keeping the top bits, which
+ * depend on all of the input bits. */
+static uint32_t t2_z__deflate_hash (const uint8_t *p) {
+    uint32_t bytes;
+    memcpy (&bytes, p, 4);
+    return (bytes * 2654435761u) >> (32 - T2_Z__HASH_BITS);
+}
+
+static void t2_z__deflate_insert (struct t2_z__deflate_state *state, size_t position) {
+    if (position + T2_Z__MIN_MATCH > state->size)
+        return;
+
+    uint32_t hash = t2_z__deflate_hash (state->data + position);
+    state->prev[position & (T2_Z__WINDOW_SIZE - 1)] = state->head[hash];
+    state->head[hash] = position + 1;
+}
+
+/* Walks the chain for position, looking at up to max_chain earlier
+ * positions. Each match that's longer than the ones before it goes in
+ * matches, so they come out in order of length, and each has the
+ * nearest distance for its length. When there's no room for another,
+ * the last one gets replaced, so the longest is always last. Returns
+ * how many there are. */
+static size_t t2_z__deflate_find_matches (struct t2_z__deflate_state *state, size_t position, int max_chain,
+                                          struct t2_z__match *matches, size_t max_matches) {
+    size_t (*match_length) (const uint8_t *a, const uint8_t *b, size_t max);
+    T2_CPU_DISPATCH (match_length, t2_z__match_length_kernels);
+
+    if (position + T2_Z__MIN_MATCH > state->size)
+        return 0;
+
+    const uint8_t *here = state->data + position;
+    size_t max = state->size - position < T2_Z__MAX_MATCH ? state->size - position : T2_Z__MAX_MATCH;
+    size_t best = T2_Z__MIN_MATCH - 1, n_matches = 0;
+    uint32_t next = state->head[t2_z__deflate_hash (here)];
+
+    for (int chain = max_chain; next && chain > 0; chain--) {
+        size_t candidate = next - 1;
+
+        /* Anything further back is out of the window, and its slot in
+         * prev has been reused by something newer. */
+        if (position - candidate > T2_Z__WINDOW_SIZE)
+            break;
+
+        /* A match can only be longer than best if the byte just past
+         * best matches too, which is a quick way to skip most of them. */
+        const uint8_t *there = state->data + candidate;
+        if (there[best] == here[best]) {
+            size_t length = match_length (there, here, max);
+            if (length > best) {
+                best = length;
+                if (n_matches == max_matches)
+                    n_matches--;
+                matches[n_matches++] = (struct t2_z__match) { length, position - candidate };
+                if (length >= state->config->nice_length || length == max)
+                    break;
+            }
+        }
+
+        next = state->prev[candidate & (T2_Z__WINDOW_SIZE - 1)];
+    }
+
+    return n_matches;
+}
+
+/* The longest match at position, or a length of 0 if there isn't one. */
+static struct t2_z__match t2_z__deflate_longest_match (struct t2_z__deflate_state *state, size_t position, int max_chain) {
+    struct t2_z__match match = {};
+    t2_z__deflate_find_matches (state, position, max_chain, &match, 1);
+    return match;
+}
+
+/* Dynamic Huffman codes. */
+
+enum { T2_Z__MAX_CODE_LENGTH = 15, T2_Z__MAX_CODE_LENGTH_CODE_LENGTH = 7 };
+
+/* How often each symbol comes up in a block's tokens. */
+struct t2_z__block_stats {
+    uint32_t literal[288];
+    uint32_t distance[32];
+    /* All of the lengths' and distances' extra bits. */
+    size_t extra_bits;
+};
+
+/* Works out Huffman code lengths for some symbol frequencies, none of
+ * them longer than max_length. This is the textbook construction: keep
+ * joining the two least frequent nodes until there's only one left, and
+ * each symbol's code length is how deep it ends up. With the symbols
+ * sorted, the joined nodes come out in order too, so the two least
+ * frequent are always at the front of one of the two lists.
+ *
+ * Sometimes the tree comes out deeper than max_length. Then all of the
+ * frequencies get halved, which evens them out and makes the tree
+ * shallower, and it's built again. That gives slightly worse codes than
+ * doing it properly, with package-merge, but it doesn't happen much. */
+static void t2_z__build_code_lengths (const uint32_t *freqs, size_t num_symbols, int max_length, uint8_t *lengths) {
+    uint32_t scaled[288], node_freq[2 * 288];
+    uint16_t symbols[288], parent[2 * 288];
+    uint8_t depth[2 * 288];
+
+    t2_d_assert (num_symbols <= 288);
+    memcpy (scaled, freqs, num_symbols * sizeof (*freqs));
+
+    while (1) {
+        size_t n = 0;
+        memset (lengths, 0, num_symbols);
+
+        /* Insertion sort by frequency. There aren't many symbols. */
+        for (size_t symbol = 0; symbol < num_symbols; symbol++) {
+            if (scaled[symbol] == 0)
+                continue;
+            size_t i = n++;
+            for (; i > 0 && scaled[symbols[i - 1]] > scaled[symbol]; i--)
+                symbols[i] = symbols[i - 1];
+            symbols[i] = symbol;
+        }
+
+        if (n == 0)
+            return;
+        if (n == 1) {
+            lengths[symbols[0]] = 1;
+            return;
+        }
+
+        for (size_t i = 0; i < n; i++)
+            node_freq[i] = scaled[symbols[i]];
+
+        /* Leaves are taken from [0, n), and joined nodes from [n, ...). */
+        size_t leaf = 0, joined = n, n_nodes = n;
+        while (n_nodes < 2 * n - 1) {
+            size_t pick[2];
+            for (int k = 0; k < 2; k++) {
+                if (leaf < n && (joined == n_nodes || node_freq[leaf] <= node_freq[joined]))
+                    pick[k] = leaf++;
+                else
+                    pick[k] = joined++;
+            }
+            node_freq[n_nodes] = node_freq[pick[0]] + node_freq[pick[1]];
+            parent[pick[0]] = parent[pick[1]] = n_nodes;
+            n_nodes++;
+        }
+
+        /* Parents always come after their children, so going backwards
+         * from the root works out every depth. */
+        int max_depth = 0;
+        depth[n_nodes - 1] = 0;
+        for (size_t i = n_nodes - 1; i-- > 0; )
+            depth[i] = depth[parent[i]] + 1;
+        for (size_t i = 0; i < n; i++) {
+            lengths[symbols[i]] = depth[i];
+            if (depth[i] > max_depth)
+                max_depth = depth[i];
+        }
+
+        if (max_depth <= max_length)
+            return;
+
+        for (size_t symbol = 0; symbol < num_symbols; symbol++)
+            if (scaled[symbol])
+                scaled[symbol] = (scaled[symbol] >> 1) | 1;
+    }
+}
+
+/* A dynamic block's header, ready to be written: the code lengths of its
+ * two codes, squeezed with the runs that t2_z__read_dyn_code_lengths
+ * reads back, which are then Huffman coded themselves. */
+struct t2_z__dyn_header {
+    uint16_t hlit, hdist, hclen;
+
+    /* The runs, as ops 0 - 18, and each one's extra bits. */
+    size_t n_ops;
+    uint8_t ops[286 + 30];
+    uint8_t op_extra[286 + 30];
+
+    struct t2_z__huffman_codes code_length_codes;
+
+    /* How many bits all of the above take. */
+    size_t bits;
+};
+
+static const uint8_t t2_z__hclen_symbols[] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+static const uint8_t t2_z__op_extra_bits[19] = { [16] = 2, [17] = 3, [18] = 7 };
+
+/* Builds the codes for a block with the given stats, and the header
+ * that describes them. */
+static void t2_z__build_dyn_codes (const struct t2_z__block_stats *stats, struct t2_z__huffman_codes_pair *codes, struct t2_z__dyn_header *header) {
+    uint8_t lengths[286 + 30];
+
+    /* Trailing unused symbols don't need to be in the header. */
+    t2_z__build_code_lengths (stats->literal, 286, T2_Z__MAX_CODE_LENGTH, lengths);
+    for (header->hlit = 286; header->hlit > 257 && lengths[header->hlit - 1] == 0; header->hlit--)
+        ;
+    t2_z__build_code_lengths (stats->distance, 30, T2_Z__MAX_CODE_LENGTH, lengths + header->hlit);
+    for (header->hdist = 30; header->hdist > 1 && lengths[header->hlit + header->hdist - 1] == 0; header->hdist--)
+        ;
+
+    t2_z__build_huffman_codes (&codes->literal, lengths, header->hlit);
+    t2_z__build_huffman_codes (&codes->distance, lengths + header->hlit, header->hdist);
+    memset (codes->literal.length + header->hlit, 0, 288 - header->hlit);
+    memset (codes->distance.length + header->hdist, 0, 32 - header->hdist);
+
+    /* The two sets of lengths are squeezed as one, so runs carry on
+     * from one into the other. */
+    size_t count = header->hlit + header->hdist;
+    header->n_ops = 0;
+    for (size_t i = 0; i < count; ) {
+        uint8_t length = lengths[i];
+        size_t run = 1;
+        while (i + run < count && lengths[i + run] == length)
+            run++;
+
+        if (length == 0 && run >= 3) {
+            size_t take = run < 138 ? run : 138;
+            header->ops[header->n_ops] = take >= 11 ? 18 : 17;
+            header->op_extra[header->n_ops++] = take - (take >= 11 ? 11 : 3);
+            i += take;
+        } else if (length != 0 && run >= 4) {
+            /* The first one has to be there for 16 to repeat it. */
+            header->ops[header->n_ops] = length;
+            header->op_extra[header->n_ops++] = 0;
+            i++, run--;
+            for (; run >= 3; ) {
+                size_t take = run < 6 ? run : 6;
+                header->ops[header->n_ops] = 16;
+                header->op_extra[header->n_ops++] = take - 3;
+                i += take, run -= take;
+            }
+        } else {
+            header->ops[header->n_ops] = length;
+            header->op_extra[header->n_ops++] = 0;
+            i++;
+        }
+    }
+
+    uint32_t op_freqs[19] = {};
+    uint8_t op_lengths[19];
+    for (size_t i = 0; i < header->n_ops; i++)
+        op_freqs[header->ops[i]]++;
+    t2_z__build_code_lengths (op_freqs, 19, T2_Z__MAX_CODE_LENGTH_CODE_LENGTH, op_lengths);
+    t2_z__build_huffman_codes (&header->code_length_codes, op_lengths, 19);
+
+    for (header->hclen = 19; header->hclen > 4 && op_lengths[t2_z__hclen_symbols[header->hclen - 1]] == 0; header->hclen--)
+        ;
+
+    header->bits = 5 + 5 + 4 + 3 * header->hclen;
+    for (size_t i = 0; i < header->n_ops; i++)
+        header->bits += op_lengths[header->ops[i]] + t2_z__op_extra_bits[header->ops[i]];
+}
+
+static void t2_z__write_dyn_header (struct t2_z__bitwriter *w, const struct t2_z__dyn_header *header) {
+    t2_z__bitwriter_write (w, header->hlit - 257, 5);
+    t2_z__bitwriter_write (w, header->hdist - 1, 5);
+    t2_z__bitwriter_write (w, header->hclen - 4, 4);
+
+    for (int i = 0; i < header->hclen; i++)
+        t2_z__bitwriter_write (w, header->code_length_codes.length[t2_z__hclen_symbols[i]], 3);
+
+    for (size_t i = 0; i < header->n_ops; i++) {
+        t2_z__bitwriter_write_symbol (w, &header->code_length_codes, header->ops[i]);
+        t2_z__bitwriter_write (w, header->op_extra[i], t2_z__op_extra_bits[header->ops[i]]);
+    }
+}
+
+/* Writing blocks. */
+
+static void t2_z__count_tokens (const struct t2_z__token *tokens, size_t n_tokens, struct t2_z__block_stats *stats) {
+    memset (stats, 0, sizeof (*stats));
+
+    for (size_t i = 0; i < n_tokens; i++) {
+        if (tokens[i].distance == 0) {
+            stats->literal[tokens[i].length]++;
+            continue;
+        }
+
+        struct t2_z__symbol length = t2_z__encode_length (tokens[i].length);
+        struct t2_z__symbol distance = t2_z__encode_distance (tokens[i].distance);
+        stats->literal[length.symbol]++;
+        stats->distance[distance.symbol]++;
+        stats->extra_bits += length.nbits + distance.nbits;
+    }
+
+    /* end of block */
+    stats->literal[256]++;
+}
+
+/* How many bits the tokens take with some codes, not counting headers. */
+static size_t t2_z__tokens_bits (const struct t2_z__block_stats *stats, const struct t2_z__huffman_codes_pair *codes) {
+    size_t bits = stats->extra_bits;
+    for (int i = 0; i < 286; i++)
+        bits += (size_t) stats->literal[i] * codes->literal.length[i];
+    for (int i = 0; i < 30; i++)
+        bits += (size_t) stats->distance[i] * codes->distance.length[i];
+    return bits;
+}
+
+static void t2_z__write_tokens (struct t2_z__bitwriter *w, const struct t2_z__token *tokens, size_t n_tokens, const struct t2_z__huffman_codes_pair *codes) {
+    for (size_t i = 0; i < n_tokens; i++) {
+        struct t2_z__token token = tokens[i];
+
+        if (token.distance == 0) {
+            t2_z__bitwriter_write_symbol (w, &codes->literal, token.length);
+            continue;
+        }
+
+        struct t2_z__symbol length = t2_z__encode_length (token.length);
+        t2_z__bitwriter_write_symbol (w, &codes->literal, length.symbol);
+        t2_z__bitwriter_write (w, length.extra, length.nbits);
+
+        struct t2_z__symbol distance = t2_z__encode_distance (token.distance);
+        t2_z__bitwriter_write_symbol (w, &codes->distance, distance.symbol);
+        t2_z__bitwriter_write (w, distance.extra, distance.nbits);
+    }
+
+    /* end of block */
+    t2_z__bitwriter_write_symbol (w, &codes->literal, 256);
+}
+
+/* The input, as is, in blocks of up to 64K. */
+static void t2_z__write_stored (struct t2_z__bitwriter *w, const uint8_t *data, size_t size, int final) {
+    size_t position = 0;
+
+    do {
+        size_t length = size - position < 0xFFFF ? size - position : 0xFFFF;
+        int last = position + length == size;
+
+        t2_z__bitwriter_write (w, T2_Z__BLOCK_TYPE_UNCOMPRESSED | (final && last ? T2_Z__BLOCK_FLAG_FINAL : 0), 3);
+        t2_z__bitwriter_flush (w);
+        t2_z__bitwriter_write (w, length, 16);
+        t2_z__bitwriter_write (w, length ^ 0xFFFF, 16);
+
+        t2_d_assert (w->buffer->position + length <= w->buffer->size);
+        /* An empty block, as a flush writes, may come with no data at all. */
+        if (length)
+            memcpy (w->buffer->data + w->buffer->position, data + position, length);
+        w->buffer->position += length;
+        position += length;
+    } while (position < size);
+}
+
+/* Writes out the block's tokens in whichever of the three kinds of block
+ * comes out smallest. */
+static void t2_z__deflate_write_block (struct t2_z__deflate_state *state, int final) {
+    struct t2_z__bitwriter *w = &state->bitwriter;
+    struct t2_z__block_stats stats;
+    struct t2_z__huffman_codes_pair *fixed = t2_z__fixed_huffman_codes ();
+    struct t2_z__huffman_codes_pair dynamic;
+    struct t2_z__dyn_header header;
+
+    t2_z__count_tokens (state->tokens, state->n_tokens, &stats);
+    t2_z__build_dyn_codes (&stats, &dynamic, &header);
+
+    size_t fixed_bits = 3 + t2_z__tokens_bits (&stats, fixed);
+    size_t dynamic_bits = 3 + header.bits + t2_z__tokens_bits (&stats, &dynamic);
+    /* Roughly; each stored block is padded out to a byte, too. */
+    size_t stored_bits = (state->block_length / 0xFFFF + 1) * (3 + 32 + 7) + state->block_length * 8;
+
+    if (state->config->strategy == T2_Z__STORED || (stored_bits < fixed_bits && stored_bits < dynamic_bits)) {
+        t2_z__write_stored (w, state->data + state->block_start, state->block_length, final);
+    } else if (dynamic_bits < fixed_bits) {
+        t2_z__bitwriter_write (w, T2_Z__BLOCK_TYPE_COMPRESSED_DYN | (final ? T2_Z__BLOCK_FLAG_FINAL : 0), 3);
+        t2_z__write_dyn_header (w, &header);
+        t2_z__write_tokens (w, state->tokens, state->n_tokens, &dynamic);
+    } else {
+        t2_z__bitwriter_write (w, T2_Z__BLOCK_TYPE_COMPRESSED_FIXED | (final ? T2_Z__BLOCK_FLAG_FINAL : 0), 3);
+        t2_z__write_tokens (w, state->tokens, state->n_tokens, fixed);
+    }
+
+    state->block_start += state->block_length;
+    state->block_length = 0;
+    state->n_tokens = 0;
+}
+
+static void t2_z__deflate_emit (struct t2_z__deflate_state *state, uint16_t length, uint16_t distance) {
+    state->tokens[state->n_tokens++] = (struct t2_z__token) { length, distance };
+    state->block_length += distance ? length : 1;
+    if (state->n_tokens == T2_Z__BLOCK_TOKENS)
+        t2_z__deflate_write_block (state, 0);
+}
+
+/* Parsing: deciding which matches to use. */
+
+/* The positions inside a match go in the chains too, or later matches
+ * couldn't start from them. */
+static void t2_z__deflate_insert_range (struct t2_z__deflate_state *state, size_t start, size_t end) {
+    for (size_t position = start; position < end; position++)
+        t2_z__deflate_insert (state, position);
+}
+
+/* Each parser goes up to limit, and picks up from there next time. */
+static void t2_z__deflate_greedy (struct t2_z__deflate_state *state, size_t limit) {
+    size_t position = state->position;
+
+    while (position < limit) {
+        struct t2_z__match match = t2_z__deflate_longest_match (state, position, state->config->max_chain);
+        t2_z__deflate_insert (state, position);
+
+        if (match.length == 0) {
+            t2_z__deflate_emit (state, state->data[position], 0);
+            position++;
+        } else {
+            t2_z__deflate_emit (state, match.length, match.distance);
+            t2_z__deflate_insert_range (state, position + 1, position + match.length);
+            position += match.length;
+        }
+    }
+
+    state->position = position;
+}
+
+static void t2_z__deflate_lazy (struct t2_z__deflate_state *state, size_t limit) {
+    const struct t2_z__deflate_config *config = state->config;
+    struct t2_z__match pending = state->pending;
+    size_t position = state->position;
+
+    while (position < limit) {
+        struct t2_z__match match = {};
+
+        if (pending.length < config->max_lazy) {
+            int max_chain = pending.length >= config->good_length ? config->max_chain / 4 : config->max_chain;
+            match = t2_z__deflate_longest_match (state, position, max_chain ? max_chain : 1);
+        }
+        t2_z__deflate_insert (state, position);
+
+        if (pending.length && match.length <= pending.length) {
+            /* The one before was better, so take it. */
+            t2_z__deflate_emit (state, pending.length, pending.distance);
+            t2_z__deflate_insert_range (state, position + 1, position - 1 + pending.length);
+            position += pending.length - 1;
+            pending.length = 0;
+            continue;
+        }
+
+        /* Either there's nothing pending, or this one is better, and
+         * the byte before becomes a literal. */
+        if (pending.length)
+            t2_z__deflate_emit (state, state->data[position - 1], 0);
+
+        if (match.length) {
+            pending = match;
+        } else {
+            t2_z__deflate_emit (state, state->data[position], 0);
+        }
+        position++;
+    }
+
+    /* A match can't start on the last byte, so at the end, nothing's
+     * left pending. */
+    t2_d_assert (limit < state->size || pending.length == 0);
+    state->pending = pending;
+    state->position = position;
+}
+
+/* The cost in bits of each literal and length symbol, and each distance
+ * symbol, for the optimal parser. Extra bits are added on separately. */
+struct t2_z__symbol_costs {
+    uint8_t literal[288];
+    uint8_t distance[32];
+};
+
+/* Finds the cheapest parse of the block from start, of length bytes, with
+ * the given costs, putting its tokens in state->tokens. Every position
+ * has been looked at already, so this goes forwards through the block
+ * working out the cheapest way to get to each position -- by a literal
+ * from the one before, or by any length of any match from one earlier --
+ * and then backwards from the end, following the cheapest path. */
+static void t2_z__deflate_optimal_parse (struct t2_z__deflate_state *state, size_t start, size_t length, const struct t2_z__symbol_costs *costs) {
+    struct t2_z__optimal *optimal = state->optimal;
+    uint32_t length_cost[T2_Z__MAX_MATCH + 1];
+
+    for (int l = 3; l <= T2_Z__MAX_MATCH; l++) {
+        struct t2_z__symbol symbol = t2_z__encode_length (l);
+        length_cost[l] = costs->literal[symbol.symbol] + symbol.nbits;
+    }
+
+    optimal->cost[0] = 0;
+    for (size_t i = 1; i <= length; i++)
+        optimal->cost[i] = UINT32_MAX;
+
+    for (size_t i = 0; i < length; i++) {
+        uint32_t cost = optimal->cost[i] + costs->literal[state->data[start + i]];
+        if (cost < optimal->cost[i + 1]) {
+            optimal->cost[i + 1] = cost;
+            optimal->arrival[i + 1] = (struct t2_z__token) { state->data[start + i], 0 };
+        }
+
+        size_t n_matches = optimal->n_matches[i];
+        struct t2_z__match *matches = optimal->matches[i];
+
+        /* A really long match -- a run, most likely -- is taken whole,
+         * rather than trying every length of it at every position. */
+        size_t shortest = T2_Z__MIN_MATCH;
+        if (n_matches && matches[n_matches - 1].length >= state->config->nice_length)
+            shortest = matches[n_matches - 1].length;
+
+        for (size_t m = 0; m < n_matches; m++) {
+            struct t2_z__symbol distance = t2_z__encode_distance (matches[m].distance);
+            uint32_t distance_cost = costs->distance[distance.symbol] + distance.nbits;
+            size_t longest = matches[m].length < length - i ? matches[m].length : length - i;
+
+            for (size_t l = shortest; l <= longest; l++) {
+                cost = optimal->cost[i] + length_cost[l] + distance_cost;
+                if (cost < optimal->cost[i + l]) {
+                    optimal->cost[i + l] = cost;
+                    optimal->arrival[i + l] = (struct t2_z__token) { l, matches[m].distance };
+                }
+            }
+            /* Shorter lengths were all closer by. */
+            if (longest + 1 > shortest)
+                shortest = longest + 1;
+        }
+    }
+
+    /* Backwards, the tokens come out in reverse, so put them at the end
+     * and then move them down. */
+    size_t n_tokens = 0;
+    for (size_t i = length; i > 0; ) {
+        struct t2_z__token token = optimal->arrival[i];
+        state->tokens[T2_Z__BLOCK_TOKENS - ++n_tokens] = token;
+        i -= token.distance ? token.length : 1;
+    }
+    memmove (state->tokens, state->tokens + T2_Z__BLOCK_TOKENS - n_tokens, n_tokens * sizeof (*state->tokens));
+    state->n_tokens = n_tokens;
+    state->block_length = length;
+}
+
+/* Costs to start out with, before there are any statistics for the
+ * block: the fixed Huffman code lengths, which are roughly what any
+ * block without much of a skew costs. */
+static void t2_z__fixed_symbol_costs (struct t2_z__symbol_costs *costs) {
+    struct t2_z__huffman_codes_pair *fixed = t2_z__fixed_huffman_codes ();
+    memcpy (costs->literal, fixed->literal.length, sizeof (costs->literal));
+    memcpy (costs->distance, fixed->distance.length, sizeof (costs->distance));
+}
+
+/* Costs from a parse's statistics: the code lengths that they'd get.
+ * Symbols that weren't used still need a cost, so every count is bumped
+ * up by a little before building the codes. */
+static void t2_z__stats_symbol_costs (const struct t2_z__block_stats *stats, struct t2_z__symbol_costs *costs) {
+    uint32_t literal[286], distance[30];
+
+    for (int i = 0; i < 286; i++)
+        literal[i] = 2 * stats->literal[i] + 1;
+    for (int i = 0; i < 30; i++)
+        distance[i] = 2 * stats->distance[i] + 1;
+
+    t2_z__build_code_lengths (literal, 286, T2_Z__MAX_CODE_LENGTH, costs->literal);
+    t2_z__build_code_lengths (distance, 30, T2_Z__MAX_CODE_LENGTH, costs->distance);
+}
+
+/* The zopfli approach: parse the block with some costs, work out what
+ * the symbols would really cost with the codes from that parse, and parse
+ * again with those, keeping whichever parse comes out smallest. Where the
+ * costs come from the parse, the parse comes from the costs, so it goes
+ * around a few times before settling down. */
+static void t2_z__deflate_optimal (struct t2_z__deflate_state *state, size_t limit) {
+    struct t2_z__optimal *optimal = state->optimal;
+    size_t position = state->position;
+
+    while (position < limit) {
+        /* Short of the end, wait for a whole block. */
+        if (limit < state->size && limit - position < T2_Z__BLOCK_TOKENS)
+            break;
+
+        size_t length = limit - position < T2_Z__BLOCK_TOKENS ? limit - position : T2_Z__BLOCK_TOKENS;
+
+        for (size_t i = 0; i < length; i++) {
+            optimal->n_matches[i] = t2_z__deflate_find_matches (state, position + i, state->config->max_chain,
+                                                                optimal->matches[i], T2_Z__MAX_MATCHES);
+            t2_z__deflate_insert (state, position + i);
+        }
+
+        struct t2_z__symbol_costs costs;
+        size_t best_bits = SIZE_MAX;
+        t2_z__fixed_symbol_costs (&costs);
+
+        for (int iteration = 0; iteration < state->config->iterations; iteration++) {
+            struct t2_z__block_stats stats;
+            struct t2_z__huffman_codes_pair codes;
+            struct t2_z__dyn_header header;
+
+            t2_z__deflate_optimal_parse (state, position, length, &costs);
+            t2_z__count_tokens (state->tokens, state->n_tokens, &stats);
+            t2_z__build_dyn_codes (&stats, &codes, &header);
+
+            size_t bits = header.bits + t2_z__tokens_bits (&stats, &codes);
+            if (bits < best_bits) {
+                best_bits = bits;
+                optimal->n_best = state->n_tokens;
+                memcpy (optimal->best, state->tokens, state->n_tokens * sizeof (*state->tokens));
+            }
+
+            t2_z__stats_symbol_costs (&stats, &costs);
+        }
+
+        memcpy (state->tokens, optimal->best, optimal->n_best * sizeof (*state->tokens));
+        state->n_tokens = optimal->n_best;
+        state->block_length = length;
+        position += length;
+
+        /* The last block is up to the caller, which knows whether it's
+         * final. */
+        if (position < state->size)
+            t2_z__deflate_write_block (state, 0);
+    }
+
+    state->position = position;
+}
+
+/* Parses up to the end of the data, or if there might be more to come,
+ * up to where there's still enough after it for the longest match. */
+static void t2_z__deflate_parse (struct t2_z__deflate_state *state, int to_end) {
+    size_t limit = state->size;
+    if (!to_end)
+        limit = state->size > T2_Z__MAX_MATCH ? state->size - T2_Z__MAX_MATCH : 0;
+    if (state->position >= limit)
+        return;
+
+    switch (state->config->strategy) {
+    case T2_Z__STORED:
+        /* Just the one big block; t2_z__write_stored splits it up. */
+        state->block_length += limit - state->position;
+        state->position = limit;
+        break;
+    case T2_Z__GREEDY:
+        t2_z__deflate_greedy (state, limit);
+        break;
+    case T2_Z__LAZY:
+        t2_z__deflate_lazy (state, limit);
+        break;
+    case T2_Z__OPTIMAL:
+        t2_z__deflate_optimal (state, limit);
+        break;
+    }
+}
+
+/* Compresses data, from start to size, into out. What's before start is
+ * the dictionary. With final, this is the end of the stream. Otherwise,
+ * it ends with a sync flush: an empty stored block, which ends on a
+ * byte, so more blocks can be written straight after it. */
+static void t2_z__deflate_chunk (struct t2_z_buffer *out, const uint8_t *data, size_t start, size_t size, int level, int final) {
+    t2_d_assert (level >= 0 && level <= T2_Z_MAX_LEVEL);
+
+    /* The hash chains are a few hundred K, which is too much to put on
+     * the stack. */
+    struct t2_z__deflate_state *state = calloc (1, sizeof (*state));
+    t2_d_assert (state != NULL);
+
+    state->data = data;
+    state->start = state->position = state->block_start = start;
+    state->size = size;
+    state->bitwriter.buffer = out;
+    state->config = &t2_z__deflate_configs[level];
+
+    /* Positions have to fit in the chains. */
+    t2_d_assert (state->size < UINT32_MAX);
+
+    /* Matches can only reach the end of the dictionary. */
+    t2_z__deflate_insert_range (state, start > T2_Z__WINDOW_SIZE ? start - T2_Z__WINDOW_SIZE : 0, start);
+
+    if (state->config->strategy == T2_Z__OPTIMAL) {
+        state->optimal = malloc (sizeof (*state->optimal));
+        t2_d_assert (state->optimal != NULL);
+    }
+
+    t2_z__deflate_parse (state, 1);
+    t2_z__deflate_write_block (state, final);
+
+    if (!final)
+        t2_z__write_stored (&state->bitwriter, NULL, 0, 0);
+    t2_z__bitwriter_flush (&state->bitwriter);
+    free (state->optimal);
+    free (state);
+}
+
+static void t2_z_deflate_level (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int level) {
+    t2_z__deflate_chunk (buf_out, buf_in->data + buf_in->position, 0, buf_in->size - buf_in->position, level, 1);
+    buf_in->position = buf_in->size;
+}
+
+static void t2_z_deflate (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out) {
+    t2_z_deflate_level (buf_in, buf_out, T2_Z_DEFAULT_LEVEL);
+}
+
+/* Matches have to reach from the input back into the dictionary, so the
+ * two go in one buffer, with the dictionary before start. The messages
+ * this is for are small, so the copy doesn't cost much. */
+static void t2_z_deflate_dict (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int level, const uint8_t *dict, size_t dict_size) {
+    size_t keep = dict_size < T2_Z__WINDOW_SIZE ? dict_size : T2_Z__WINDOW_SIZE;
+    size_t size = buf_in->size - buf_in->position;
+
+    uint8_t *data = malloc (keep + size);
+    t2_d_assert (data != NULL);
+    memcpy (data, dict + dict_size - keep, keep);
+    memcpy (data + keep, buf_in->data + buf_in->position, size);
+
+    t2_z__deflate_chunk (buf_out, data, keep, keep + size, level, 1);
+    buf_in->position = buf_in->size;
+    free (data);
+}
+
+/* Streaming. */
+
+/* The window holds the last 32K, which matches can reach back into, and
+ * the 32K after that, which is being compressed. When it's full, the top
+ * half slides down, like in zlib. pending holds compressed data that
+ * hasn't been handed out yet; it only ever has what one step of the
+ * loop in t2_z_deflate_stream writes. */
+struct t2_z_deflate_stream {
+    struct t2_z__deflate_state state;
+    uint8_t window[2 * T2_Z__WINDOW_SIZE];
+
+    struct t2_z_buffer pending;
+    size_t pending_read;
+    uint8_t pending_data[T2_Z__WINDOW_SIZE * 4 + T2_Z__WINDOW_SIZE / 8];
+
+    /* Whether there's been input since the last flush, and whether the
+     * stream has been finished. */
+    int unflushed, finished;
+};
+
+static struct t2_z_deflate_stream *t2_z_deflate_stream_new (int level) {
+    t2_d_assert (level >= 0 && level <= T2_Z_MAX_LEVEL);
+
+    struct t2_z_deflate_stream *stream = calloc (1, sizeof (*stream));
+    t2_d_assert (stream != NULL);
+
+    stream->state.data = stream->window;
+    stream->state.bitwriter.buffer = &stream->pending;
+    stream->state.config = &t2_z__deflate_configs[level];
+    stream->pending = (struct t2_z_buffer) { .data = stream->pending_data, .size = sizeof (stream->pending_data) };
+
+    if (stream->state.config->strategy == T2_Z__OPTIMAL) {
+        stream->state.optimal = malloc (sizeof (*stream->state.optimal));
+        t2_d_assert (stream->state.optimal != NULL);
+    }
+
+    return stream;
+}
+
+static void t2_z_deflate_stream_free (struct t2_z_deflate_stream *stream) {
+    free (stream->state.optimal);
+    free (stream);
+}
+
+static void t2_z_deflate_stream_set_dictionary (struct t2_z_deflate_stream *stream, const uint8_t *dict, size_t dict_size) {
+    struct t2_z__deflate_state *state = &stream->state;
+    size_t keep = dict_size < T2_Z__WINDOW_SIZE ? dict_size : T2_Z__WINDOW_SIZE;
+
+    t2_d_assert (state->size == 0 && !stream->finished);
+    memcpy (stream->window, dict + dict_size - keep, keep);
+    state->size = state->position = state->block_start = keep;
+    t2_z__deflate_insert_range (state, 0, keep);
+}
+
+/* Hands out as much of pending as fits. */
+static void t2_z__stream_drain (struct t2_z_deflate_stream *stream, struct t2_z_buffer *buf_out) {
+    size_t length = stream->pending.position - stream->pending_read;
+    if (length > buf_out->size - buf_out->position)
+        length = buf_out->size - buf_out->position;
+
+    memcpy (buf_out->data + buf_out->position, stream->pending.data + stream->pending_read, length);
+    buf_out->position += length;
+    stream->pending_read += length;
+
+    if (stream->pending_read == stream->pending.position)
+        stream->pending.position = stream->pending_read = 0;
+}
+
+/* Drops the bottom half of the window, which is now out of reach. The
+ * chains are all moved down to match, and anything that was in the
+ * bottom half drops off the end of them. The block has to be written out
+ * first if any of it's down there, since it might be a stored block. */
+static void t2_z__stream_slide (struct t2_z_deflate_stream *stream) {
+    struct t2_z__deflate_state *state = &stream->state;
+
+    t2_d_assert (state->position >= T2_Z__WINDOW_SIZE);
+    if (state->block_start < T2_Z__WINDOW_SIZE)
+        t2_z__deflate_write_block (state, 0);
+
+    memmove (stream->window, stream->window + T2_Z__WINDOW_SIZE, state->size - T2_Z__WINDOW_SIZE);
+    state->size -= T2_Z__WINDOW_SIZE;
+    state->position -= T2_Z__WINDOW_SIZE;
+    state->block_start -= T2_Z__WINDOW_SIZE;
+
+    for (size_t i = 0; i < sizeof (state->head) / sizeof (*state->head); i++)
+        state->head[i] = state->head[i] > T2_Z__WINDOW_SIZE ? state->head[i] - T2_Z__WINDOW_SIZE : 0;
+    for (size_t i = 0; i < T2_Z__WINDOW_SIZE; i++)
+        state->prev[i] = state->prev[i] > T2_Z__WINDOW_SIZE ? state->prev[i] - T2_Z__WINDOW_SIZE : 0;
+}
+
+static int t2_z_deflate_stream (struct t2_z_deflate_stream *stream, struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, enum t2_z_flush flush) {
+    struct t2_z__deflate_state *state = &stream->state;
+
+    while (1) {
+        t2_z__stream_drain (stream, buf_out);
+        if (stream->pending.position)
+            return 0;
+
+        size_t in_left = buf_in->size - buf_in->position;
+        if (in_left > 0) {
+            t2_d_assert (!stream->finished);
+
+            if (state->size == sizeof (stream->window)) {
+                t2_z__stream_slide (stream);
+                continue;
+            }
+
+            size_t length = sizeof (stream->window) - state->size;
+            if (length > in_left)
+                length = in_left;
+            memcpy (stream->window + state->size, buf_in->data + buf_in->position, length);
+            buf_in->position += length;
+            state->size += length;
+            stream->unflushed = 1;
+
+            t2_z__deflate_parse (state, flush != T2_Z_NO_FLUSH && buf_in->position == buf_in->size);
+            continue;
+        }
+
+        if (flush == T2_Z_NO_FLUSH)
+            return 1;
+
+        if (flush == T2_Z_FINISH && !stream->finished) {
+            t2_z__deflate_parse (state, 1);
+            t2_z__deflate_write_block (state, 1);
+            t2_z__bitwriter_flush (&state->bitwriter);
+            stream->finished = 1;
+            continue;
+        }
+
+        if (flush != T2_Z_FINISH && stream->unflushed) {
+            t2_z__deflate_parse (state, 1);
+            if (state->n_tokens || state->block_length)
+                t2_z__deflate_write_block (state, 0);
+            t2_z__write_stored (&state->bitwriter, NULL, 0, 0);
+            stream->unflushed = 0;
+
+            /* Nothing after this can refer to anything before it. */
+            if (flush == T2_Z_FULL_FLUSH) {
+                memset (state->head, 0, sizeof (state->head));
+                memset (state->prev, 0, sizeof (state->prev));
+            }
+            continue;
+        }
+
+        return 1;
+    }
+}
+
+/* zlib's wrapper. */
+
+static void t2_z__write_be32 (struct t2_z_buffer *out, uint32_t value) {
+    t2_d_assert (out->position + 4 <= out->size);
+    for (int i = 0; i < 4; i++)
+        out->data[out->position++] = value >> (24 - 8 * i);
+}
+
+static void t2_z_zlib_deflate (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int level, const uint8_t *dict, size_t dict_size) {
+    const uint8_t *data = buf_in->data + buf_in->position;
+    size_t size = buf_in->size - buf_in->position;
+
+    /* CMF: deflate, with a 32K window. FLG: roughly how hard we tried,
+     * whether there's a dictionary, and check bits that make the two of
+     * them a multiple of 31. */
+    uint8_t cmf = 0x78;
+    uint8_t flg = (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+    if (dict)
+        flg |= 0x20;
+    flg |= (31 - ((cmf << 8) | flg) % 31) % 31;
+
+    t2_d_assert (buf_out->position + 2 <= buf_out->size);
+    buf_out->data[buf_out->position++] = cmf;
+    buf_out->data[buf_out->position++] = flg;
+
+    if (dict) {
+        t2_z__write_be32 (buf_out, t2_z_adler32 (1, dict, dict_size));
+        t2_z_deflate_dict (buf_in, buf_out, level, dict, dict_size);
+    } else {
+        t2_z_deflate_level (buf_in, buf_out, level);
+    }
+
+    t2_z__write_be32 (buf_out, t2_z_adler32 (1, data, size));
+}
+
+/* Training dictionaries. This is roughly zstd's COVER. The samples are
+ * cut up into 8-byte pieces ("d-mers"), and each is scored by how many of
+ * the samples it comes up in. Then the samples are split into as many
+ * stretches ("epochs") as there's room in the dictionary for segments,
+ * and the segment from each epoch whose d-mers score the highest goes in
+ * the dictionary. Once a d-mer is in, it doesn't score anymore, so the
+ * segments don't repeat each other. d-mers are only counted by their
+ * hash, and collisions are just put up with. */
+
+enum {
+    T2_Z__TRAIN_DMER = 8,
+    T2_Z__TRAIN_SEGMENT = 64,
+    T2_Z__TRAIN_HASH_BITS = 20,
+};
+
+static uint32_t t2_z__train_hash (const uint8_t *p) {
+    uint64_t v;
+    memcpy (&v, p, sizeof (v));
+    return (v * 0x9E3779B97F4A7C15ull) >> (64 - T2_Z__TRAIN_HASH_BITS);
+}
+
+struct t2_z__train_segment {
+    const uint8_t *data;
+    uint64_t score;
+};
+
+static int t2_z__train_compare_segments (const void *a, const void *b) {
+    uint64_t x = ((const struct t2_z__train_segment *) a)->score, y = ((const struct t2_z__train_segment *) b)->score;
+    return (x > y) - (x < y);
+}
+
+static size_t t2_z_train_dictionary (const struct t2_z_buffer *samples, size_t n_samples, uint8_t *dict, size_t dict_size) {
+    enum { D = T2_Z__TRAIN_DMER, K = T2_Z__TRAIN_SEGMENT };
+    uint32_t *counts = calloc (1 << T2_Z__TRAIN_HASH_BITS, sizeof (*counts));
+    uint32_t *seen = calloc (1 << T2_Z__TRAIN_HASH_BITS, sizeof (*seen));
+    t2_d_assert (counts != NULL && seen != NULL);
+
+    /* Each d-mer counts once per sample it's in, however many times it's
+     * in there. */
+    size_t total = 0;
+    for (size_t s = 0; s < n_samples; s++) {
+        const uint8_t *data = samples[s].data + samples[s].position;
+        size_t size = samples[s].size - samples[s].position;
+        for (size_t i = 0; i + D <= size; i++) {
+            uint32_t hash = t2_z__train_hash (data + i);
+            if (seen[hash] != s + 1) {
+                seen[hash] = s + 1;
+                counts[hash]++;
+            }
+        }
+        total += size;
+    }
+    free (seen);
+
+    size_t n_epochs = dict_size / K, n_picked = 0;
+    struct t2_z__train_segment *picked = calloc (n_epochs + 1, sizeof (*picked));
+    t2_d_assert (picked != NULL);
+    size_t epoch_size = n_epochs ? total / n_epochs : 0;
+    if (epoch_size < K)
+        epoch_size = K;
+
+    /* The samples are taken as if they were one after another, but
+     * segments don't go across from one to the next. first is the first
+     * sample that's still in the epoch, and offset is where it starts. */
+    size_t first = 0, offset = 0;
+    for (size_t epoch = 0; epoch < total && n_picked < n_epochs; epoch += epoch_size) {
+        size_t epoch_end = epoch + epoch_size < total ? epoch + epoch_size : total;
+        struct t2_z__train_segment best = { NULL, 0 };
+
+        size_t sample_offset = offset;
+        for (size_t s = first; s < n_samples && sample_offset < epoch_end; s++) {
+            const uint8_t *data = samples[s].data + samples[s].position;
+            size_t size = samples[s].size - samples[s].position;
+            size_t from = (epoch > sample_offset ? epoch : sample_offset) - sample_offset;
+            size_t to = (epoch_end < sample_offset + size ? epoch_end : sample_offset + size) - sample_offset;
+            sample_offset += size;
+
+            /* Segments that start between from and to, and fit. */
+            if (size < K)
+                continue;
+            if (to > size - K + 1)
+                to = size - K + 1;
+            if (from >= to)
+                continue;
+
+            uint64_t score = 0;
+            for (size_t i = from; i <= from + K - D; i++)
+                score += counts[t2_z__train_hash (data + i)];
+            for (size_t i = from; ; i++) {
+                if (score > best.score)
+                    best = (struct t2_z__train_segment) { data + i, score };
+                if (i + 1 >= to)
+                    break;
+                score -= counts[t2_z__train_hash (data + i)];
+                score += counts[t2_z__train_hash (data + i + K - D + 1)];
+            }
+        }
+
+        while (first < n_samples && offset + samples[first].size - samples[first].position <= epoch_end) {
+            offset += samples[first].size - samples[first].position;
+            first++;
+        }
+
+        if (best.data == NULL)
+            continue;
+        picked[n_picked++] = best;
+        for (size_t i = 0; i <= K - D; i++)
+            counts[t2_z__train_hash (best.data + i)] = 0;
+    }
+
+    qsort (picked, n_picked, sizeof (*picked), t2_z__train_compare_segments);
+    for (size_t i = 0; i < n_picked; i++)
+        memcpy (dict + i * K, picked[i].data, K);
+
+    free (picked);
+    free (counts);
+    return n_picked * K;
+}
+
+/* Parallel compression, pigz style. */
+
+/* The most that compressing size bytes can come to. Every block is at
+ * most a stored block's few bytes bigger than its input, and blocks
+ * cover at least 16K, apart from the last. */
+static size_t t2_z_deflate_bound (size_t size) {
+    return size + (size / T2_Z__BLOCK_TOKENS + 2) * 6 + 16;
+}
+
+/* Each chunk is compressed on its own, into its own buffer, and they're
+ * joined up in order at the end. */
+struct t2_z__parallel {
+    const uint8_t *data;
+    size_t size, chunk_size;
+    int level, bgzf;
+
+    size_t n_chunks;
+    /* The next chunk that nobody's taken. */
+    size_t next;
+    struct t2_z_buffer *outputs;
+};
+
+static void t2_z__put_le (uint8_t *p, uint32_t value, int n) {
+    for (int i = 0; i < n; i++)
+        p[i] = value >> (8 * i);
+}
+
+/* A BGZF member is a gzip member that says how big it is in an extra
+ * field, so a reader can find where each one starts without inflating
+ * any of them. */
+enum { T2_Z__BGZF_HEADER_SIZE = 18, T2_Z__BGZF_TRAILER_SIZE = 8, T2_Z__BGZF_CHUNK_SIZE = 0xFF00 };
+
+static void t2_z__deflate_bgzf_member (struct t2_z_buffer *out, const uint8_t *data, size_t size, int level) {
+    static const uint8_t header[T2_Z__BGZF_HEADER_SIZE] = {
+        0x1F, 0x8B, 8, 4, 0, 0, 0, 0, 0, 0xFF, /* gzip, with FEXTRA */
+        6, 0, 'B', 'C', 2, 0, 0, 0,            /* BC: the member's size, less one */
+    };
+
+    memcpy (out->data, header, sizeof (header));
+    out->position = sizeof (header);
+    t2_z__deflate_chunk (out, data, 0, size, level, 1);
+
+    t2_z__put_le (out->data + out->position, t2_z_crc32 (0, data, size), 4);
+    t2_z__put_le (out->data + out->position + 4, size, 4);
+    out->position += T2_Z__BGZF_TRAILER_SIZE;
+    t2_z__put_le (out->data + 16, out->position - 1, 2);
+}
+
+static void *t2_z__parallel_worker (void *data) {
+    struct t2_z__parallel *job = data;
+    size_t i;
+
+    while ((i = __atomic_fetch_add (&job->next, 1, __ATOMIC_RELAXED)) < job->n_chunks) {
+        size_t start = i * job->chunk_size;
+        size_t end = start + job->chunk_size < job->size ? start + job->chunk_size : job->size;
+        struct t2_z_buffer *out = &job->outputs[i];
+
+        out->size = t2_z_deflate_bound (end - start) + T2_Z__BGZF_HEADER_SIZE + T2_Z__BGZF_TRAILER_SIZE;
+        out->data = malloc (out->size);
+        t2_d_assert (out->data != NULL);
+
+        /* Matches can go back into the chunk before, so each chunk
+         * compresses about as well as it would have in one go. Only
+         * the window before it is handed over, so positions stay small
+         * however big the input is. */
+        size_t base = start - (start < T2_Z__WINDOW_SIZE ? start : T2_Z__WINDOW_SIZE);
+        if (job->bgzf)
+            t2_z__deflate_bgzf_member (out, job->data + start, end - start, job->level);
+        else
+            t2_z__deflate_chunk (out, job->data + base, start - base, end - base, job->level, i == job->n_chunks - 1);
+    }
+
+    return NULL;
+}
+
+static void t2_z__deflate_parallel (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int level, int n_threads, int bgzf) {
+    struct t2_z__parallel job = {
+        .data = buf_in->data + buf_in->position,
+        .size = buf_in->size - buf_in->position,
+        .chunk_size = bgzf ? T2_Z__BGZF_CHUNK_SIZE : T2_Z_PARALLEL_CHUNK_SIZE,
+        .level = level,
+        .bgzf = bgzf,
+    };
+
+    /* An empty stream still needs its final block, but BGZF just has
+     * the end marker. */
+    job.n_chunks = (job.size + job.chunk_size - 1) / job.chunk_size;
+    if (job.n_chunks == 0 && !bgzf)
+        job.n_chunks = 1;
+    job.outputs = calloc (job.n_chunks, sizeof (*job.outputs));
+
+    if (n_threads <= 0)
+        n_threads = sysconf (_SC_NPROCESSORS_ONLN);
+    if (n_threads > (int) job.n_chunks)
+        n_threads = job.n_chunks;
+
+    if (n_threads <= 1) {
+        t2_z__parallel_worker (&job);
+    } else {
+        pthread_t threads[n_threads];
+        for (int i = 0; i < n_threads; i++)
+            pthread_create (&threads[i], NULL, t2_z__parallel_worker, &job);
+        for (int i = 0; i < n_threads; i++)
+            pthread_join (threads[i], NULL);
+    }
+
+    for (size_t i = 0; i < job.n_chunks; i++) {
+        t2_d_assert (buf_out->position + job.outputs[i].position <= buf_out->size);
+        memcpy (buf_out->data + buf_out->position, job.outputs[i].data, job.outputs[i].position);
+        buf_out->position += job.outputs[i].position;
+        free (job.outputs[i].data);
+    }
+    free (job.outputs);
+
+    if (bgzf) {
+        /* The end marker is an empty member. */
+        static const uint8_t eof[] = {
+            0x1F, 0x8B, 8, 4, 0, 0, 0, 0, 0, 0xFF, 6, 0, 'B', 'C', 2, 0, 27, 0,
+            3, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        };
+        t2_d_assert (buf_out->position + sizeof (eof) <= buf_out->size);
+        memcpy (buf_out->data + buf_out->position, eof, sizeof (eof));
+        buf_out->position += sizeof (eof);
+    }
+
+    buf_in->position = buf_in->size;
+}
+
+static void t2_z_deflate_parallel (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int level, int n_threads) {
+    t2_z__deflate_parallel (buf_in, buf_out, level, n_threads, 0);
+}
+
+static void t2_z_deflate_bgzf (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int level, int n_threads) {
+    t2_z__deflate_parallel (buf_in, buf_out, level, n_threads, 1);
+}
+
+#ifdef T2_RUN_TESTS
+
+/* Everything gets checked by inflating it again. That brings in
+ * t2_inflate's implementation, but not its tests. */
+#undef T2_RUN_TESTS
+#include "t2_inflate.h"
+#define T2_RUN_TESTS
+
+#include "t2_tests.h"
+
+/* Something like text: words from a small vocabulary, with the odd
+ * number thrown in. */
+static void make_text (uint8_t *buf, size_t size, uint32_t seed) {
+    static const char *const words[] = {
+        "the", "of", "and", "to", "in", "is", "that", "for", "it", "as",
+        "was", "with", "be", "by", "on", "not", "he", "this", "are", "or",
+        "compress", "window", "match", "huffman", "literal", "distance",
+    };
+    size_t n = 0;
+
+    while (n < size) {
+        seed = seed * 1103515245 + 12345;
+        char word[16];
+        const char *w = word;
+        if ((seed >> 16) % 17 == 0)
+            snprintf (word, sizeof (word), "%u", (seed >> 8) % 10000);
+        else
+            w = words[(seed >> 16) % (sizeof (words) / sizeof (*words))];
+        while (*w && n < size)
+            buf[n++] = *w++;
+        if (n < size)
+            buf[n++] = (seed >> 24) % 11 == 0 ? '\n' : ' ';
+    }
+}
+
+static int check_roundtrip (const uint8_t *data, size_t size, int level, size_t *compressed_size) {
+    size_t max_size = size + size / 8 + 64;
+    uint8_t *compressed = malloc (max_size), *decompressed = malloc (size + 1);
+
+    struct t2_z_buffer in = { (uint8_t *) data, size, 0 }, out = { compressed, max_size, 0 };
+    t2_z_deflate_level (&in, &out, level);
+    t2_t_assert (in.position == size);
+
+    struct t2_z_buffer c = { compressed, out.position, 0 }, d = { decompressed, size + 1, 0 };
+    t2_z_inflate (&c, &d);
+    t2_t_assert (c.position == out.position);
+    t2_t_assert (d.position == size);
+    t2_t_assert (memcmp (data, decompressed, size) == 0);
+
+    if (compressed_size)
+        *compressed_size = out.position;
+    free (compressed);
+    free (decompressed);
+    return 0;
+}
+
+static int test_roundtrip (void) {
+    enum { SIZE = 200 * 1024 };
+    uint8_t *data = malloc (SIZE);
+    size_t sizes[T2_Z_MAX_LEVEL + 1];
+
+    for (int level = 0; level <= T2_Z_MAX_LEVEL; level++) {
+        t2_t_assert (check_roundtrip ((const uint8_t *) "", 0, level, NULL) == 0);
+        t2_t_assert (check_roundtrip ((const uint8_t *) "a", 1, level, NULL) == 0);
+        t2_t_assert (check_roundtrip ((const uint8_t *) "abcabcabcabcabcabcabc", 21, level, NULL) == 0);
+
+        /* Much more than the window. */
+        make_text (data, SIZE, 1);
+        t2_t_assert (check_roundtrip (data, SIZE, level, &sizes[level]) == 0);
+
+        /* Runs, with distance 1 and the longest matches. */
+        memset (data, 'a', SIZE);
+        t2_t_assert (check_roundtrip (data, SIZE, level, NULL) == 0);
+
+        /* Only a few different bytes, so the codes get short. */
+        for (size_t i = 0; i < SIZE; i++)
+            data[i] = "aab"[(i * i) % 3];
+        t2_t_assert (check_roundtrip (data, 5000, level, NULL) == 0);
+
+        /* Noise, with nothing to find. */
+        uint32_t seed = 1;
+        for (size_t i = 0; i < SIZE; i++)
+            data[i] = (seed = seed * 1103515245 + 12345) >> 24;
+        t2_t_assert (check_roundtrip (data, SIZE, level, NULL) == 0);
+    }
+
+    fprintf (stderr, "text: %d bytes, level 1: %zu, level 6: %zu, level 9: %zu, level 12: %zu\n",
+             SIZE, sizes[1], sizes[6], sizes[9], sizes[12]);
+    t2_t_assert (sizes[1] < SIZE / 2);
+    t2_t_assert (sizes[12] <= sizes[9] && sizes[9] <= sizes[6] && sizes[6] <= sizes[1]);
+
+    free (data);
+    return 0;
+}
+
+/* The other half of t2_inflate's test_inflate. */
+static int test_deflate (void) {
+    uint8_t buf_in[] = { 'f', 'o', 'o' };
+    uint8_t buf_out[16] = {};
+    struct t2_z_buffer *out = T2_Z_BUFFER_FROM_STATIC (buf_out);
+
+    t2_z_deflate (T2_Z_BUFFER_FROM_STATIC (buf_in), out);
+
+    t2_t_assert (out->position == 5);
+    t2_t_assert (memcmp (buf_out, (uint8_t[]) { 75, 203, 207, 7, 0 }, 5) == 0);
+
+    return 0;
+}
+
+/* Every length and distance comes back out of t2_inflate's decoding as
+ * what went in. */
+static int check_symbol (struct t2_z__symbol symbol, int is_distance, uint16_t expect) {
+    uint8_t buf[8] = {};
+    struct t2_z__state state = { .buffer_in = { buf, sizeof (buf), 0 } };
+    struct t2_z__bitwriter w = { .buffer = &state.buffer_in };
+
+    t2_z__bitwriter_write (&w, symbol.extra, symbol.nbits);
+    t2_z__bitwriter_flush (&w);
+    state.buffer_in.position = 0;
+    state.bitreader.buffer = &state.buffer_in;
+
+    uint16_t got = is_distance ? t2_z__decode_distance (&state, symbol.symbol) : t2_z__decode_length (&state, symbol.symbol);
+    t2_t_assert (got == expect);
+    return 0;
+}
+
+static int test_lengths_and_distances (void) {
+    for (int length = 3; length <= T2_Z__MAX_MATCH; length++)
+        t2_t_assert (check_symbol (t2_z__encode_length (length), 0, length) == 0);
+    for (int distance = 1; distance <= T2_Z__WINDOW_SIZE; distance++)
+        t2_t_assert (check_symbol (t2_z__encode_distance (distance), 1, distance) == 0);
+    return 0;
+}
+
+static int test_match_length (void) {
+    uint8_t a[300], b[300];
+
+    for (size_t i = 0; i < sizeof (a); i++)
+        a[i] = b[i] = i * 37 + 11;
+
+    /* Every kernel has to agree with a byte at a time, wherever the
+     * first difference is, and wherever max cuts it off. */
+    for (int level = T2_CPU_SCALAR; level <= t2_cpu_level (); level++) {
+        if (!t2_z__match_length_kernels[level])
+            continue;
+        for (size_t differ = 0; differ <= 260; differ++) {
+            if (differ < 260)
+                b[differ] ^= 0x10;
+            for (size_t max = 0; max <= 258; max += (max < 70 ? 1 : 13)) {
+                size_t expect = differ < max ? differ : max;
+                t2_t_assert (t2_z__match_length_kernels[level] (a, b, max) == expect);
+            }
+            if (differ < 260)
+                b[differ] ^= 0x10;
+        }
+    }
+
+    return 0;
+}
+
+/* Streams through out a little at a time. */
+static int stream_some (struct t2_z_deflate_stream *stream, const uint8_t *data, size_t size, struct t2_z_buffer *out, enum t2_z_flush flush) {
+    struct t2_z_buffer in = { (uint8_t *) data, size, 0 };
+
+    while (1) {
+        struct t2_z_buffer some = { out->data + out->position, out->size - out->position < 1000 ? out->size - out->position : 1000, 0 };
+        int done = t2_z_deflate_stream (stream, &in, &some, flush);
+        out->position += some.position;
+        if (done) {
+            t2_t_assert (in.position == size);
+            return 0;
+        }
+        t2_t_assert (out->position < out->size);
+    }
+}
+
+static int test_stream (void) {
+    enum { SIZE = 300 * 1000 };
+    uint8_t *data = malloc (SIZE), *compressed = malloc (2 * SIZE), *decompressed = malloc (SIZE);
+
+    make_text (data, SIZE / 2, 6);
+    for (size_t i = SIZE / 2; i < SIZE; i++)
+        data[i] = (i * i) >> 7;
+
+    for (int level = 0; level <= T2_Z_MAX_LEVEL; level += (level < 9 ? 3 : 1)) {
+        struct t2_z_deflate_stream *stream = t2_z_deflate_stream_new (level);
+        struct t2_z_buffer out = { compressed, 2 * SIZE, 0 };
+        size_t position = 0, piece = 1;
+
+        /* Pieces of all sizes, with a sync flush every so often. */
+        while (position < SIZE / 2) {
+            size_t length = piece < SIZE / 2 - position ? piece : SIZE / 2 - position;
+            enum t2_z_flush flush = (piece % 7 == 0) ? T2_Z_SYNC_FLUSH : T2_Z_NO_FLUSH;
+            t2_t_assert (stream_some (stream, data + position, length, &out, flush) == 0);
+            if (flush == T2_Z_SYNC_FLUSH)
+                t2_t_assert (out.position >= 4 && memcmp (compressed + out.position - 4, "\x00\x00\xFF\xFF", 4) == 0);
+            position += length;
+            piece = piece * 3 + 1;
+            if (piece > 70000)
+                piece = 1;
+        }
+
+        /* After a full flush, the rest can be inflated on its own. */
+        t2_t_assert (stream_some (stream, NULL, 0, &out, T2_Z_FULL_FLUSH) == 0);
+        size_t second_half = out.position;
+        t2_t_assert (stream_some (stream, data + SIZE / 2, SIZE / 2, &out, T2_Z_FINISH) == 0);
+        t2_z_deflate_stream_free (stream);
+
+        struct t2_z_buffer c = { compressed + second_half, out.position - second_half, 0 }, d = { decompressed, SIZE, 0 };
+        t2_z_inflate (&c, &d);
+        t2_t_assert (d.position == SIZE / 2 && memcmp (decompressed, data + SIZE / 2, SIZE / 2) == 0);
+
+        c = (struct t2_z_buffer) { compressed, out.position, 0 };
+        d = (struct t2_z_buffer) { decompressed, SIZE, 0 };
+        t2_z_inflate (&c, &d);
+        t2_t_assert (c.position == out.position);
+        t2_t_assert (d.position == SIZE && memcmp (decompressed, data, SIZE) == 0);
+    }
+
+    free (data);
+    free (compressed);
+    free (decompressed);
+    return 0;
+}
+
+/* Something like an RPC message: the same few shapes, with different
+ * values in them. */
+static size_t make_message (uint8_t *buf, size_t size, uint32_t seed) {
+    static const char *methods[] = { "getUser", "listOrders", "updateCart", "search", "getInventory" };
+    static const char *fields[] = { "name", "email", "quantity", "price", "status", "createdAt", "tags" };
+    int n = snprintf ((char *) buf, size, "{\"jsonrpc\": \"2.0\", \"id\": %u, \"method\": \"%s\", \"params\": {",
+                      seed * 7919 % 100000, methods[seed % 5]);
+    for (int i = 0; i < 3 + (int) (seed % 5); i++) {
+        seed = seed * 1103515245 + 12345;
+        n += snprintf ((char *) buf + n, size - n, "%s\"%s\": \"%08x\"", i ? ", " : "", fields[(seed >> 16) % 7], seed);
+    }
+    n += snprintf ((char *) buf + n, size - n, "}, \"meta\": {\"client\": \"t2-rpc/1.4\", \"region\": \"us-east-1\"}}");
+    return n;
+}
+
+static int test_dictionary (void) {
+    enum { N_SAMPLES = 300, N_MESSAGES = 50, MESSAGE_SIZE = 1024 };
+    static uint8_t samples_data[N_SAMPLES][MESSAGE_SIZE], message[MESSAGE_SIZE], compressed[2 * MESSAGE_SIZE], decompressed[MESSAGE_SIZE];
+    struct t2_z_buffer samples[N_SAMPLES];
+    uint8_t dict[4096];
+
+    for (size_t i = 0; i < N_SAMPLES; i++)
+        samples[i] = (struct t2_z_buffer) { samples_data[i], make_message (samples_data[i], MESSAGE_SIZE, i), 0 };
+    size_t dict_size = t2_z_train_dictionary (samples, N_SAMPLES, dict, sizeof (dict));
+    t2_t_assert (dict_size > 0 && dict_size <= sizeof (dict));
+
+    size_t total = 0, plain = 0, with_dict = 0;
+    for (uint32_t seed = 1000; seed < 1000 + N_MESSAGES; seed++) {
+        size_t size = make_message (message, sizeof (message), seed);
+        total += size;
+
+        for (int use_dict = 0; use_dict <= 1; use_dict++) {
+            struct t2_z_buffer in = { message, size, 0 }, out = (struct t2_z_buffer) { compressed, sizeof (compressed), 0 };
+            t2_z_zlib_deflate (&in, &out, T2_Z_DEFAULT_LEVEL, use_dict ? dict : NULL, dict_size);
+            *(use_dict ? &with_dict : &plain) += out.position;
+
+            struct t2_z_buffer c = { compressed, out.position, 0 }, d = (struct t2_z_buffer) { decompressed, sizeof (decompressed), 0 };
+            t2_z_zlib_inflate (&c, &d, dict, dict_size);
+            t2_t_assert (c.position == out.position);
+            t2_t_assert (d.position == size && memcmp (decompressed, message, size) == 0);
+        }
+    }
+
+    /* And the samples, compressed without the dictionary, and inflated
+     * all at once. */
+    static uint8_t compressed_samples[N_SAMPLES][MESSAGE_SIZE];
+    struct t2_z_buffer c[N_SAMPLES], d[N_SAMPLES];
+    for (size_t i = 0; i < N_SAMPLES; i++) {
+        struct t2_z_buffer in = samples[i];
+        c[i] = (struct t2_z_buffer) { compressed_samples[i], MESSAGE_SIZE, 0 };
+        t2_z_deflate (&in, &c[i]);
+        c[i].size = c[i].position;
+        c[i].position = 0;
+        d[i] = (struct t2_z_buffer) { decompressed, sizeof (decompressed), 0 };
+    }
+    struct t2_z_inflate_context *context = t2_z_inflate_context_new ();
+    t2_z_inflate_batch (context, c, d, N_SAMPLES);
+    t2_z_inflate_context_free (context);
+    t2_t_assert (d[N_SAMPLES - 1].position == samples[N_SAMPLES - 1].size);
+    t2_t_assert (memcmp (decompressed, samples_data[N_SAMPLES - 1], samples[N_SAMPLES - 1].size) == 0);
+
+    fprintf (stderr, "%d messages: %zu bytes, %zu compressed, %zu with a %zu byte dictionary\n",
+             N_MESSAGES, total, plain, with_dict, dict_size);
+    t2_t_assert (with_dict < plain * 2 / 3);
+
+    /* Every level, and the stream, with matches that start in the
+     * dictionary and run on into the message. */
+    size_t size = make_message (message, sizeof (message), 5);
+    memcpy (message + size, message, size);
+    size *= 2;
+    for (int level = 0; level <= T2_Z_MAX_LEVEL; level++) {
+        struct t2_z_buffer in = { message, size, 0 }, out = (struct t2_z_buffer) { compressed, sizeof (compressed), 0 };
+        t2_z_deflate_dict (&in, &out, level, message, size / 2);
+
+        struct t2_z_buffer c = { compressed, out.position, 0 }, d = (struct t2_z_buffer) { decompressed, sizeof (decompressed), 0 };
+        t2_z_inflate_dict (&c, &d, message, size / 2);
+        t2_t_assert (d.position == size && memcmp (decompressed, message, size) == 0);
+        if (level > 0)
+            t2_t_assert (out.position < 32);
+
+        struct t2_z_deflate_stream *stream = t2_z_deflate_stream_new (level);
+        t2_z_deflate_stream_set_dictionary (stream, dict, dict_size);
+        in = (struct t2_z_buffer) { message, size, 0 };
+        out = (struct t2_z_buffer) { compressed, sizeof (compressed), 0 };
+        t2_t_assert (t2_z_deflate_stream (stream, &in, &out, T2_Z_FINISH));
+        t2_z_deflate_stream_free (stream);
+
+        c = (struct t2_z_buffer) { compressed, out.position, 0 };
+        d = (struct t2_z_buffer) { decompressed, sizeof (decompressed), 0 };
+        t2_z_inflate_dict (&c, &d, dict, dict_size);
+        t2_t_assert (d.position == size && memcmp (decompressed, message, size) == 0);
+    }
+
+    return 0;
+}
+
+/* A gzip file with one member, as gzip itself would write. */
+static size_t make_gzip (uint8_t *out, size_t out_size, const uint8_t *data, size_t size, int level) {
+    static const uint8_t header[] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF };
+    memcpy (out, header, sizeof (header));
+
+    struct t2_z_buffer in = { (uint8_t *) data, size, 0 }, o = { out, out_size, sizeof (header) };
+    t2_z_deflate_level (&in, &o, level);
+
+    uint32_t trailer[2] = { t2_z_crc32 (0, data, size), size };
+    for (int i = 0; i < 8; i++)
+        out[o.position++] = trailer[i / 4] >> (8 * (i % 4));
+    return o.position;
+}
+
+static int test_gzip_parallel (void) {
+    enum { SIZE = 1024 * 1024 };
+    uint8_t *data = malloc (SIZE), *compressed = malloc (t2_z_deflate_bound (SIZE) + 1024), *decompressed = malloc (SIZE);
+
+    /* Text, then noise, which is stored blocks, then runs. */
+    make_text (data, SIZE / 2, 7);
+    uint32_t seed = 1;
+    for (size_t i = SIZE / 2; i < SIZE * 3 / 4; i++)
+        data[i] = (seed = seed * 1103515245 + 12345) >> 24;
+    for (size_t i = SIZE * 3 / 4; i < SIZE; i++)
+        data[i] = "aaaaaaab"[(i / 1000) % 8];
+
+    static const int levels[] = { 0, 1, 6 };
+    for (size_t l = 0; l < sizeof (levels) / sizeof (*levels); l++) {
+        size_t size = make_gzip (compressed, t2_z_deflate_bound (SIZE) + 1024, data, SIZE, levels[l]);
+
+        /* Small chunks, so that there are plenty of them, and plenty of
+         * guesses, right and wrong. */
+        for (int n_threads = 2; n_threads <= 4; n_threads += 2) {
+            struct t2_z_buffer in = { compressed, size, 0 }, out = { decompressed, SIZE, 0 };
+            memset (decompressed, 0, SIZE);
+            t2_z__gzip_inflate (&in, &out, n_threads, 16 * 1024);
+            t2_t_assert (in.position == size);
+            t2_t_assert (out.position == SIZE && memcmp (decompressed, data, SIZE) == 0);
+        }
+    }
+
+    /* BGZF is several members. */
+    struct t2_z_buffer in = { data, SIZE, 0 }, out = { compressed, t2_z_deflate_bound (SIZE) + 1024, 0 };
+    t2_z_deflate_bgzf (&in, &out, 6, 0);
+    in = (struct t2_z_buffer) { compressed, out.position, 0 };
+    out = (struct t2_z_buffer) { decompressed, SIZE, 0 };
+    t2_z_gzip_inflate_parallel (&in, &out, 4);
+    t2_t_assert (out.position == SIZE && memcmp (decompressed, data, SIZE) == 0);
+    in = (struct t2_z_buffer) { compressed, in.size, 0 };
+    out = (struct t2_z_buffer) { decompressed, SIZE, 0 };
+    t2_z_gzip_inflate (&in, &out);
+    t2_t_assert (out.position == SIZE && memcmp (decompressed, data, SIZE) == 0);
+
+    /* Members that don't say how big they are, as from cat a.gz b.gz.
+     * Some are smaller than a chunk, one is empty, and some span many. */
+    static const size_t ends[] = { 1000, 1000, 300000, 310000, 700000, 700100, SIZE };
+    size_t size = 0;
+    for (size_t i = 0, start = 0; i < sizeof (ends) / sizeof (*ends); start = ends[i++])
+        size += make_gzip (compressed + size, t2_z_deflate_bound (SIZE) + 1024 - size, data + start, ends[i] - start, i % 2 ? 6 : 1);
+    for (int n_threads = 2; n_threads <= 4; n_threads += 2) {
+        in = (struct t2_z_buffer) { compressed, size, 0 };
+        out = (struct t2_z_buffer) { decompressed, SIZE, 0 };
+        memset (decompressed, 0, SIZE);
+        t2_z__gzip_inflate (&in, &out, n_threads, 16 * 1024);
+        t2_t_assert (in.position == size);
+        t2_t_assert (out.position == SIZE && memcmp (decompressed, data, SIZE) == 0);
+    }
+
+    free (data);
+    free (compressed);
+    free (decompressed);
+    return 0;
+}
+
+/* Chunks, with the window sliding along many times, and stored blocks
+ * bigger than the window. Each chunk is checked as it comes. */
+struct chunks {
+    const uint8_t *expected;
+    size_t position, n_chunks, max_chunk;
+    int bad;
+};
+
+static void check_chunk (void *data, const uint8_t *chunk, size_t size) {
+    struct chunks *chunks = data;
+    chunks->bad |= memcmp (chunks->expected + chunks->position, chunk, size) != 0;
+    chunks->position += size;
+    chunks->n_chunks++;
+    if (size > chunks->max_chunk)
+        chunks->max_chunk = size;
+}
+
+static int test_inflate_chunked (void) {
+    enum { SIZE = 1024 * 1024 };
+    uint8_t *data = malloc (SIZE), *compressed = malloc (t2_z_deflate_bound (SIZE) + 1024);
+    static uint8_t window[T2_Z_INFLATE_WINDOW_SIZE];
+
+    make_text (data, SIZE / 2, 3);
+    uint32_t seed = 1;
+    for (size_t i = SIZE / 2; i < SIZE; i++)
+        data[i] = (seed = seed * 1103515245 + 12345) >> 24;
+
+    static const int levels[] = { 0, 1, 6 };
+    for (size_t l = 0; l < sizeof (levels) / sizeof (*levels); l++) {
+        size_t size = make_gzip (compressed, t2_z_deflate_bound (SIZE) + 1024, data, SIZE, levels[l]);
+        struct chunks chunks = { .expected = data };
+        struct t2_z_buffer in = { compressed, size, 0 }, w = { window, sizeof (window), 0 };
+        t2_z_gzip_inflate_chunked (&in, &w, check_chunk, &chunks);
+
+        t2_t_assert (in.position == size);
+        t2_t_assert (chunks.position == SIZE && !chunks.bad);
+        /* The first one can be the whole window, as there was nothing to keep. */
+        t2_t_assert (chunks.n_chunks >= SIZE / sizeof (window) && chunks.max_chunk <= sizeof (window));
+
+        /* And the raw deflate data in the middle, without the gzip. */
+        chunks = (struct chunks) { .expected = data };
+        in = (struct t2_z_buffer) { compressed + 10, size - 18, 0 };
+        t2_z_inflate_chunked (&in, &w, check_chunk, &chunks);
+        t2_t_assert (chunks.position == SIZE && !chunks.bad);
+    }
+
+    free (data);
+    free (compressed);
+    return 0;
+}
+
+static int test_crc32 (void) {
+    t2_t_assert (t2_z_crc32 (0, (const uint8_t *) "123456789", 9) == 0xCBF43926);
+    t2_t_assert (t2_z_crc32 (t2_z_crc32 (0, (const uint8_t *) "1234", 4), (const uint8_t *) "56789", 5) == 0xCBF43926);
+    return 0;
+}
+
+static int test_parallel (void) {
+    size_t size = 5 * T2_Z_PARALLEL_CHUNK_SIZE / 2;
+    uint8_t *data = malloc (size), *compressed = malloc (t2_z_deflate_bound (size)), *decompressed = malloc (size);
+
+    make_text (data, size, 4);
+
+    /* Serially, to compare against. */
+    struct t2_z_buffer in = { data, size, 0 }, out = { compressed, t2_z_deflate_bound (size), 0 };
+    t2_z_deflate_level (&in, &out, 6);
+    size_t serial_size = out.position;
+
+    for (int n_threads = 0; n_threads <= 4; n_threads += 2) {
+        in = (struct t2_z_buffer) { data, size, 0 };
+        out = (struct t2_z_buffer) { compressed, t2_z_deflate_bound (size), 0 };
+        t2_z_deflate_parallel (&in, &out, 6, n_threads);
+        t2_t_assert (in.position == size);
+
+        /* With the dictionaries, it's hardly any bigger. */
+        t2_t_assert (out.position < serial_size + serial_size / 100);
+
+        struct t2_z_buffer c = { compressed, out.position, 0 }, d = { decompressed, size, 0 };
+        t2_z_inflate (&c, &d);
+        t2_t_assert (c.position == out.position && d.position == size);
+        t2_t_assert (memcmp (data, decompressed, size) == 0);
+    }
+
+    /* And nothing at all. */
+    in = (struct t2_z_buffer) { data, 0, 0 };
+    out = (struct t2_z_buffer) { compressed, t2_z_deflate_bound (0), 0 };
+    t2_z_deflate_parallel (&in, &out, 6, 0);
+    struct t2_z_buffer c = { compressed, out.position, 0 }, d = { decompressed, size, 0 };
+    t2_z_inflate (&c, &d);
+    t2_t_assert (d.position == 0);
+
+    free (data);
+    free (compressed);
+    free (decompressed);
+    return 0;
+}
+
+static uint32_t get_le (const uint8_t *p, int n) {
+    uint32_t value = 0;
+    for (int i = 0; i < n; i++)
+        value |= (uint32_t) p[i] << (8 * i);
+    return value;
+}
+
+static int test_bgzf (void) {
+    size_t size = 300 * 1000, max_size = 2 * size;
+    uint8_t *data = malloc (size), *compressed = malloc (max_size), *decompressed = malloc (size);
+
+    make_text (data, size, 5);
+    struct t2_z_buffer in = { data, size, 0 }, out = { compressed, max_size, 0 };
+    t2_z_deflate_bgzf (&in, &out, 6, 0);
+
+    /* Walk the members by their sizes alone, and check each one. */
+    size_t position = 0, total = 0;
+    while (position < out.position) {
+        const uint8_t *member = compressed + position;
+        t2_t_assert (member[0] == 0x1F && member[1] == 0x8B && member[3] == 4);
+        t2_t_assert (member[12] == 'B' && member[13] == 'C');
+        size_t member_size = get_le (member + 16, 2) + 1;
+        t2_t_assert (position + member_size <= out.position);
+
+        struct t2_z_buffer c = { (uint8_t *) member + 18, member_size - 8 - 18, 0 };
+        struct t2_z_buffer d = { decompressed + total, size - total, 0 };
+        t2_z_inflate (&c, &d);
+        t2_t_assert (c.position == c.size);
+        t2_t_assert (get_le (member + member_size - 4, 4) == d.position);
+        t2_t_assert (get_le (member + member_size - 8, 4) == t2_z_crc32 (0, decompressed + total, d.position));
+
+        total += d.position;
+        position += member_size;
+        /* The last one is the empty end marker. */
+        if (d.position == 0)
+            break;
+    }
+    t2_t_assert (position == out.position);
+    t2_t_assert (total == size);
+    t2_t_assert (memcmp (data, decompressed, size) == 0);
+
+    free (data);
+    free (compressed);
+    free (decompressed);
+    return 0;
+}
+
+static int test_inflate_iov (void) {
+    enum { SIZE = 400 * 1000 };
+    /* Stored and compressed, back and forth. Each chunk sees all of the
+     * ones before it, so the compressed ones have matches that go back
+     * into stored ones. */
+    static const size_t ends[] = { 100000, 150000, 300000, 310000, 320000, SIZE };
+    static const int levels[] = { 0, 6, 0, 1, 0, 6 };
+    uint8_t *data = malloc (SIZE), *compressed = malloc (2 * SIZE), *scratch = malloc (SIZE);
+    struct iovec iov[32];
+
+    make_text (data, SIZE, 7);
+    struct t2_z_buffer out = { compressed, 2 * SIZE, 0 };
+    for (int i = 0, start = 0; i < 6; start = ends[i++])
+        t2_z__deflate_chunk (&out, data, start, ends[i], levels[i], i == 5);
+
+    struct t2_z_buffer in = { compressed, out.position, 0 }, o = { scratch, SIZE, 0 };
+    size_t n_iov = t2_z_inflate_iov (&in, &o, iov, 32);
+    t2_t_assert (in.position == in.size);
+
+    size_t position = 0, stored = 0;
+    for (size_t i = 0; i < n_iov; i++) {
+        t2_t_assert (position + iov[i].iov_len <= SIZE);
+        t2_t_assert (memcmp (data + position, iov[i].iov_base, iov[i].iov_len) == 0);
+        if ((uint8_t *) iov[i].iov_base >= compressed && (uint8_t *) iov[i].iov_base < compressed + in.size)
+            stored += iov[i].iov_len;
+        position += iov[i].iov_len;
+    }
+    t2_t_assert (position == SIZE);
+    t2_t_assert (stored == 100000 + 150000 + 10000);
+    /* Only the compressed chunks, and what they can see of the stored
+     * ones before them, went into scratch. */
+    t2_t_assert (o.position == SIZE - stored + 32768 + 32768 + 10000);
+
+    free (data);
+    free (compressed);
+    free (scratch);
+    return 0;
+}
+
+enum { BENCH_SIZE = 256 * 1024 };
+static uint8_t bench_text[BENCH_SIZE], bench_out[BENCH_SIZE + BENCH_SIZE / 8 + 64];
+
+static int bench_deflate (size_t n, int level) {
+    if (!bench_text[0])
+        make_text (bench_text, BENCH_SIZE, 3);
+    for (size_t i = 0; i < n; i++)
+        t2_z_deflate_level (T2_Z_BUFFER_FROM_STATIC (bench_text), T2_Z_BUFFER_FROM_STATIC (bench_out), level);
+    return 0;
+}
+
+static int bench_deflate_1 (size_t n) { return bench_deflate (n, 1); }
+static int bench_deflate_6 (size_t n) { return bench_deflate (n, 6); }
+static int bench_deflate_9 (size_t n) { return bench_deflate (n, 9); }
+static int bench_deflate_12 (size_t n) { return bench_deflate (n, 12); }
+
+enum { BENCH_PARALLEL_SIZE = 16 * 1024 * 1024 };
+
+static int bench_deflate_parallel_6 (size_t n) {
+    static uint8_t *text, *out;
+    if (!text) {
+        text = malloc (BENCH_PARALLEL_SIZE);
+        out = malloc (t2_z_deflate_bound (BENCH_PARALLEL_SIZE));
+        make_text (text, BENCH_PARALLEL_SIZE, 3);
+    }
+    for (size_t i = 0; i < n; i++) {
+        struct t2_z_buffer in = { text, BENCH_PARALLEL_SIZE, 0 }, o = { out, t2_z_deflate_bound (BENCH_PARALLEL_SIZE), 0 };
+        t2_z_deflate_parallel (&in, &o, 6, 0);
+    }
+    return 0;
+}
+
+/* Inflating many members: BGZF, which says where each one is, and the
+ * same members with that taken out, which have to be found by decoding. */
+static uint8_t *bench_members, *bench_members_out;
+static size_t bench_members_size, bench_bgzf_size;
+
+static void make_bench_members (void) {
+    if (bench_members)
+        return;
+    uint8_t *text = malloc (BENCH_PARALLEL_SIZE);
+    size_t bound = t2_z_deflate_bound (BENCH_PARALLEL_SIZE) + BENCH_PARALLEL_SIZE / 1024;
+    bench_members = malloc (2 * bound);
+    bench_members_out = malloc (BENCH_PARALLEL_SIZE);
+    make_text (text, BENCH_PARALLEL_SIZE, 3);
+
+    struct t2_z_buffer in = { text, BENCH_PARALLEL_SIZE, 0 }, out = { bench_members, bound, 0 };
+    t2_z_deflate_bgzf (&in, &out, 6, 0);
+    bench_bgzf_size = out.position;
+
+    /* Clear FEXTRA, and drop the BC field. */
+    uint8_t *p = bench_members + bench_bgzf_size, *q = bench_members;
+    while (q < bench_members + bench_bgzf_size) {
+        size_t member_size = (q[16] | q[17] << 8) + 1;
+        memcpy (p, q, 10);
+        p[3] = 0;
+        memcpy (p + 10, q + T2_Z__BGZF_HEADER_SIZE, member_size - T2_Z__BGZF_HEADER_SIZE);
+        p += member_size - (T2_Z__BGZF_HEADER_SIZE - 10);
+        q += member_size;
+    }
+    bench_members_size = p - (bench_members + bench_bgzf_size);
+    free (text);
+}
+
+static int bench_members_inflate (size_t n, int bgzf, int n_threads) {
+    make_bench_members ();
+    for (size_t i = 0; i < n; i++) {
+        struct t2_z_buffer in = { bench_members, bench_bgzf_size, 0 }, out = { bench_members_out, BENCH_PARALLEL_SIZE, 0 };
+        if (!bgzf)
+            in = (struct t2_z_buffer) { bench_members + bench_bgzf_size, bench_members_size, 0 };
+        t2_z__gzip_inflate (&in, &out, n_threads, T2_Z_INFLATE_CHUNK_SIZE);
+        t2_d_assert (out.position == BENCH_PARALLEL_SIZE);
+    }
+    return 0;
+}
+
+static int bench_gzip_inflate_bgzf (size_t n) { return bench_members_inflate (n, 1, 1); }
+static int bench_gzip_inflate_parallel_bgzf (size_t n) { return bench_members_inflate (n, 1, 0); }
+static int bench_gzip_inflate_members (size_t n) { return bench_members_inflate (n, 0, 1); }
+static int bench_gzip_inflate_parallel_members (size_t n) { return bench_members_inflate (n, 0, 0); }
+
+static struct t2_t_test tests[] = {
+    t2_t_test(test_deflate),
+    t2_t_test(test_match_length),
+    t2_t_test(test_lengths_and_distances),
+    t2_t_test(test_roundtrip),
+    t2_t_test(test_stream),
+    t2_t_test(test_dictionary),
+    t2_t_test(test_crc32),
+    t2_t_test(test_parallel),
+    t2_t_test(test_bgzf),
+    t2_t_test(test_inflate_iov),
+    t2_t_test(test_gzip_parallel),
+    t2_t_test(test_inflate_chunked),
+    t2_t_bench(bench_deflate_1, BENCH_SIZE),
+    t2_t_bench(bench_deflate_6, BENCH_SIZE),
+    t2_t_bench(bench_deflate_9, BENCH_SIZE),
+    t2_t_bench(bench_deflate_12, BENCH_SIZE),
+    t2_t_bench(bench_deflate_parallel_6, BENCH_PARALLEL_SIZE),
+    t2_t_bench(bench_gzip_inflate_bgzf, BENCH_PARALLEL_SIZE),
+    t2_t_bench(bench_gzip_inflate_parallel_bgzf, BENCH_PARALLEL_SIZE),
+    t2_t_bench(bench_gzip_inflate_members, BENCH_PARALLEL_SIZE),
+    t2_t_bench(bench_gzip_inflate_parallel_members, BENCH_PARALLEL_SIZE),
+    {},
+};
+
+#endif /* T2_RUN_TESTS */
+
+#endif /* T2_Z_IMPLEMENTATION */
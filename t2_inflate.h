@@ -8,37 +8,175 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
-struct t2_z_buffer {
-    uint8_t *data;
-    size_t size;
-    size_t position;
-};
-
-#define T2_Z_BUFFER_FROM_STATIC(buf) (&((struct t2_z_buffer) { .data = buf, .size = sizeof(buf) }))
+#include "t2_z_common.h"
 
+/* Decompresses buf_in into buf_out, from their positions on. Afterwards,
+ * the positions are just past what was read and written. */
 static void t2_z_inflate (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out);
 
+/* The same, with a preset dictionary: the output can refer back into the
+ * end of dict, as if it had been decompressed just before it. It has to
+ * be the dictionary the data was compressed with. Small messages that
+ * look like each other compress far better this way. */
+static void t2_z_inflate_dict (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, const uint8_t *dict, size_t dict_size);
+
+/* Decompresses a zlib stream (RFC 1950): a header, the deflate data, and
+ * an Adler-32 of what it decompresses to, which is checked. If the header
+ * says there's a dictionary, dict has to be it, which is checked against
+ * its Adler-32 in the header; otherwise, dict is ignored. */
+static void t2_z_zlib_inflate (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, const uint8_t *dict, size_t dict_size);
+
+/* Decompresses like t2_z_inflate, but for writev: the output is a list of
+ * up to max_iov segments, and the number of them is returned. Stored
+ * blocks' data isn't copied, and their segments point straight into
+ * buf_in. Everything else is written to buf_out, which needs room for
+ * it, and the segments point there. Back-references need what's
+ * before them in one piece, though, so the last 32K of a run of stored
+ * blocks is copied into buf_out if a compressed block comes after it.
+ * Mostly stored streams, like already compressed media that's been
+ * gzipped anyway, mostly don't get copied. */
+static size_t t2_z_inflate_iov (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, struct iovec *iov, size_t max_iov);
+
+/* Decompressing lots of small messages. The context holds the scratch
+ * space for the Huffman tables, which is 30K or so, so that it isn't
+ * set up again for each one, and so that none of it goes on the stack,
+ * which might be a small coroutine stack. Each of the n messages is
+ * decompressed from buf_in[i] into buf_out[i], as if by t2_z_inflate. A
+ * context can be used for as many batches as you like, but only by one
+ * thread at a time. */
+struct t2_z_inflate_context;
+static struct t2_z_inflate_context *t2_z_inflate_context_new (void);
+static void t2_z_inflate_batch (struct t2_z_inflate_context *context, struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, size_t n);
+static void t2_z_inflate_context_free (struct t2_z_inflate_context *context);
+
+/* Decompresses a gzip file (RFC 1952), and checks its CRC-32. If there
+ * are several members one after another, as in BGZF, it's all of them. */
+static void t2_z_gzip_inflate (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out);
+
+/* The same, on n_threads threads, or one per core if that's 0. This works
+ * on ordinary gzip files, which are one long deflate stream, by guessing
+ * where blocks start; see below. Each thread takes on chunks of about
+ * T2_Z_INFLATE_CHUNK_SIZE bytes of compressed data, so it's only worth
+ * it for files that are a good few times that. BGZF files say where each
+ * member is, so those are just shared out between the threads a member
+ * at a time. */
+#ifndef T2_Z_INFLATE_CHUNK_SIZE
+#define T2_Z_INFLATE_CHUNK_SIZE (1024 * 1024)
+#endif
+
+static void t2_z_gzip_inflate_parallel (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int n_threads);
+
+/* Decompressing without ever holding all of the output. buf_out is a
+ * sliding window: each time it fills up, what's new in it is given to
+ * emit, and everything but the last 32K, which matches can still reach
+ * back into, is dropped. So buf_out has to be bigger than 32K, and what
+ * it is beyond that is how big the chunks are. T2_Z_INFLATE_WINDOW_SIZE
+ * makes them 64K, which stay in L2 for whatever emit does with them,
+ * rather than going out to memory and coming back.
+ *
+ * To have the other side be a loop that pulls chunks instead, run this
+ * in a t2_co, and have emit send each chunk on a channel as a
+ * t2_co_view; t2_z_json.h does that for gzip'd JSON. A chunk is only
+ * good until emit returns. */
+#define T2_Z_INFLATE_WINDOW_SIZE (32 * 1024 + 64 * 1024)
+
+typedef void (*t2_z_emit_func) (void *data, const uint8_t *chunk, size_t size);
+
+static void t2_z_inflate_chunked (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, t2_z_emit_func emit, void *data);
+
+/* The same for a gzip file, checking its CRC-32 as it goes. */
+static void t2_z_gzip_inflate_chunked (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, t2_z_emit_func emit, void *data);
+
 #ifdef T2_Z_IMPLEMENTATION
 
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
-#define t2_d_die(msg) do { fprintf(stderr, "%s, %s:%d\n", msg, __FILE__, __LINE__); asm("int3"); exit(1); } while (0)
-#define t2_d_assert(condition) do { if (!(condition)) { fprintf(stderr, "Assertion failed: %s, %s:%d\n", #condition, __FILE__, __LINE__); asm("int3"); exit(1); } } while (0);
+#include "t2_cpu.h"
 
 /* A buffer to read / write from. */
 
 static void t2_z__buffer_copy (struct t2_z_buffer *out, struct t2_z_buffer *in, ssize_t in_offset, size_t length) {
-    t2_d_assert (in->position + in_offset + length < in->size);
-    t2_d_assert (out->position + length < out->size);
+    t2_d_assert (in->position + in_offset + length <= in->size);
+    t2_d_assert (out->position + length <= out->size);
     memmove (out->data + out->position, in->data + in->position + in_offset, length);
     out->position += length;
     in->position += length;
 }
 
+/* Copying a back-reference. The source is distance bytes back in the
+ * output, and the two can overlap, in which case the copied bytes repeat,
+ * like LZ77 wants; memmove would get that wrong. There's a kernel for each
+ * level in t2_cpu.h. The SIMD ones copy a vector at a time when distance
+ * is at least a vector, and may write up to a vector past the end, so
+ * they're only used when there's that much room left after it. */
+static void t2_z__copy_match_scalar (uint8_t *out, size_t distance, size_t length, size_t room) {
+    if (distance == 1) {
+        memset (out, out[-1], length);
+        return;
+    }
+    for (size_t i = 0; i < length; i++)
+        out[i] = out[i - distance];
+}
+
+#if T2_CPU_X86
+__attribute__((target ("sse4.2")))
+static void t2_z__copy_match_sse42 (uint8_t *out, size_t distance, size_t length, size_t room) {
+    if (distance < 16 || room < 16) {
+        t2_z__copy_match_scalar (out, distance, length, room);
+        return;
+    }
+    for (size_t i = 0; i < length; i += 16)
+        _mm_storeu_si128 ((__m128i *) (out + i), _mm_loadu_si128 ((const __m128i *) (out + i - distance)));
+}
+
+__attribute__((target ("avx2")))
+static void t2_z__copy_match_avx2 (uint8_t *out, size_t distance, size_t length, size_t room) {
+    if (distance < 32 || room < 32) {
+        t2_z__copy_match_sse42 (out, distance, length, room);
+        return;
+    }
+    for (size_t i = 0; i < length; i += 32)
+        _mm256_storeu_si256 ((__m256i *) (out + i), _mm256_loadu_si256 ((const __m256i *) (out + i - distance)));
+}
+
+/* Masked stores let the last vector stop exactly at the end, so this one
+ * never needs any room. */
+__attribute__((target ("avx512f,avx512bw")))
+static void t2_z__copy_match_avx512 (uint8_t *out, size_t distance, size_t length, size_t room) {
+    if (distance < 64) {
+        t2_z__copy_match_avx2 (out, distance, length, room);
+        return;
+    }
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64)
+        _mm512_storeu_si512 (out + i, _mm512_loadu_si512 (out + i - distance));
+    __mmask64 tail = ((__mmask64) 1 << (length - i)) - 1;
+    _mm512_mask_storeu_epi8 (out + i, tail, _mm512_maskz_loadu_epi8 (tail, out + i - distance));
+}
+#endif /* T2_CPU_X86 */
+
+static void (*const t2_z__copy_match_kernels[T2_CPU_N_LEVELS]) (uint8_t *out, size_t distance, size_t length, size_t room) = {
+    t2_z__copy_match_scalar, T2_CPU_X86_ONLY (t2_z__copy_match_sse42, t2_z__copy_match_avx2, t2_z__copy_match_avx512)
+};
+
+static void t2_z__buffer_copy_match (struct t2_z_buffer *out, size_t distance, size_t length) {
+    void (*copy_match) (uint8_t *out, size_t distance, size_t length, size_t room);
+    T2_CPU_DISPATCH (copy_match, t2_z__copy_match_kernels);
+
+    t2_d_assert (distance > 0 && distance <= out->position);
+    t2_d_assert (out->position + length <= out->size);
+    copy_match (out->data + out->position, distance, length, out->size - out->position - length);
+    out->position += length;
+}
+
 static void t2_z__buffer_write_byte (struct t2_z_buffer *out, uint8_t byte) {
-    t2_d_assert (out->position + 1 < out->size);
+    t2_d_assert (out->position < out->size);
     out->data[out->position++] = byte;
 }
 
@@ -48,8 +186,9 @@ static uint8_t t2_z__buffer_read_byte (struct t2_z_buffer *in) {
 }
 
 /* Reads a buffer a bit at a time, in DEFLATE order. That is, we read
- * starting from the LSB of each byte, and having that bit define the
- * MSB of an N-bit value. */
+ * starting from the LSB of each byte, and the first bit read is the LSB
+ * of an N-bit value, so a value that spans bytes has its low bits in the
+ * first one. Huffman codes are the odd one out, see below. */
 struct t2_z__bitreader {
     struct t2_z_buffer *buffer;
 
@@ -65,8 +204,22 @@ static void t2_z__bitreader_flush (struct t2_z__bitreader *b) {
     b->bits_left = 0;
 }
 
+static uint64_t t2_z__bitreader_read (struct t2_z__bitreader *b, int nbits);
+
+/* Where we're at, in bits from the start of the buffer. */
+static size_t t2_z__bitreader_offset (struct t2_z__bitreader *b) {
+    return b->buffer->position * 8 - b->bits_left;
+}
+
+static void t2_z__bitreader_seek (struct t2_z__bitreader *b, size_t offset) {
+    b->buffer->position = offset / 8;
+    b->bits_left = 0;
+    t2_z__bitreader_read (b, offset % 8);
+}
+
 static uint64_t t2_z__bitreader_read (struct t2_z__bitreader *b, int nbits) {
     uint64_t output = 0;
+    int shift = 0;
 
     t2_d_assert (nbits <= 64);
 
@@ -79,8 +232,9 @@ static uint64_t t2_z__bitreader_read (struct t2_z__bitreader *b, int nbits) {
         uint8_t bits_to_read = (nbits < b->bits_left) ? nbits : b->bits_left;
 
         uint8_t mask = (1 << bits_to_read) - 1;
-        output = (output << bits_to_read) | (b->byte & mask);
+        output |= (uint64_t) (b->byte & mask) << shift;
 
+        shift += bits_to_read;
         nbits -= bits_to_read;
         b->bits_left -= bits_to_read;
         b->byte >>= bits_to_read;
@@ -97,8 +251,36 @@ struct t2_z__state {
     struct t2_z_buffer buffer_in;
     struct t2_z_buffer buffer_out;
     struct t2_z__bitreader bitreader;
+
+    /* The preset dictionary, which comes before buffer_out. */
+    const uint8_t *dict;
+    size_t dict_size;
+
+    /* Where dynamic blocks' tables get built. */
+    struct t2_z_inflate_context *context;
+
+    /* When decoding without knowing what the 32K before buffer_out was,
+     * the bytes that come from it can't be written. Instead, unknown
+     * says which byte of it each one is, plus one, or 0 for the ones
+     * that are known. Nothing from unknown_end on comes from it. */
+    uint16_t *unknown;
+    size_t unknown_end;
+
+    /* For t2_z_inflate_iov: the segments so far, and how many of the
+     * ones at the end are stored blocks. */
+    struct iovec *iov;
+    size_t n_iov, max_iov, n_stored;
+
+    /* For t2_z_inflate_chunked: where to send the output, how much of
+     * the window is already sent, and how full it can get before it has
+     * to be sent and slid along. */
+    t2_z_emit_func emit;
+    void *emit_data;
+    size_t emitted, emit_at;
 };
 
+enum { T2_Z__MAX_DISTANCE = 32768 };
+
 /* Huffman tables. */
 
 /* This is intentionally slow for readability. A faster system would
@@ -117,13 +299,15 @@ struct t2_z__huffman_table {
     uint8_t min_length, max_length;
 
     /* We use a statically defined huffman table with space for all
-     * possible code lengths and all possible codes. This should not
-     * take that much space. Some, admittedly, incredibly stupid
-     * metaprogramming is used to define each length, since we need
-     * the length to be a compile-time constant. */
+     * possible code lengths and all possible codes. There can't be more
+     * codes of one length than there are symbols, so past 8 bits, there's
+     * only room for 288 of them, and the whole table is about 10K. Some,
+     * admittedly, incredibly stupid metaprogramming is used to define
+     * each length, since we need the length to be a compile-time
+     * constant. */
 
     /* XXX: This is incredibly stupid metaprogramming. */
-#define HUFFMAN_LENGTH(n) struct { uint32_t first_code; uint32_t num_codes; uint32_t code_idx_to_symbol[(1 << n) - 1]; } length_##n;
+#define HUFFMAN_LENGTH(n) struct { uint32_t first_code; uint32_t num_codes; uint32_t code_idx_to_symbol[(1 << n) < 288 ? (1 << n) : 288]; } length_##n;
     HUFFMAN_LENGTH(1);
     HUFFMAN_LENGTH(2);
     HUFFMAN_LENGTH(3);
@@ -168,9 +352,9 @@ static uint64_t t2_z__huffman_table_read (struct t2_z__bitreader *bitreader, str
      * read at least that many bits. */
     uint8_t code_length = table->min_length;
 
-    /* Huffman codes are stored in LSB-first order, rather than
-     * MSB-first, which is how the rest of the values in DEFLATE
-     * are stored. As such, we read this a bit at a time. */
+    /* Huffman codes are stored starting from their MSB, rather than
+     * their LSB, which is how the rest of the values in DEFLATE are
+     * stored. As such, we read this a bit at a time. */
 
     /* XXX: This feels "slow" and looks bad but is probably fine
      * since it's likely to be in a register / L1 cache. I still
@@ -199,12 +383,16 @@ struct t2_z__huffman_tables {
 };
 
 /* Builds a Huffman table given a map of symbols to a code length, using
- * a similar, equivalent algorithm to RFC 3.2.2. */
-static struct t2_z__huffman_table t2_z__build_huffman_table (uint8_t *sym_to_code_length, size_t num_symbols) {
-    struct t2_z__huffman_table table = {};
+ * a similar, equivalent algorithm to RFC 3.2.2. Only the counts need
+ * clearing first: nothing past num_codes in each length is ever read. */
+static void t2_z__build_huffman_table (struct t2_z__huffman_table *table, uint8_t *sym_to_code_length, size_t num_symbols) {
+    table->min_length = 16;
+    table->max_length = 0;
 
-    table.min_length = 16;
-    table.max_length = 0;
+    for (uint8_t code_length = 1; code_length <= T2_Z__HUFFMAN_TABLE_MAX_LEN; code_length++) {
+        struct t2_z__huffman_table_length *len_table = t2_z__huffman_table_select_length (table, code_length);
+        len_table->first_code = len_table->num_codes = 0;
+    }
 
     /* First, count up how many codes we have for each length. */
     for (size_t symbol = 0; symbol < num_symbols; symbol++) {
@@ -216,37 +404,40 @@ static struct t2_z__huffman_table t2_z__build_huffman_table (uint8_t *sym_to_cod
             continue;
 
         /* Assign our symbol. */
-        struct t2_z__huffman_table_length *len_table = t2_z__huffman_table_select_length (&table, code_length);
+        struct t2_z__huffman_table_length *len_table = t2_z__huffman_table_select_length (table, code_length);
         len_table->code_idx_to_symbol[len_table->num_codes] = symbol;
         len_table->num_codes++;
 
-        if (code_length < table.min_length)
-            table.min_length = code_length;
-        if (code_length > table.max_length)
-            table.max_length = code_length;
+        if (code_length < table->min_length)
+            table->min_length = code_length;
+        if (code_length > table->max_length)
+            table->max_length = code_length;
     }
 
     /* Now create the first code for each code length. */
-    for (uint8_t code_length = table.min_length + 1; code_length < table.max_length; code_length++) {
-        struct t2_z__huffman_table_length *len_table = t2_z__huffman_table_select_length (&table, code_length);
-        struct t2_z__huffman_table_length *len_table_prev = t2_z__huffman_table_select_length (&table, code_length - 1);
+    for (uint8_t code_length = table->min_length + 1; code_length <= table->max_length; code_length++) {
+        struct t2_z__huffman_table_length *len_table = t2_z__huffman_table_select_length (table, code_length);
+        struct t2_z__huffman_table_length *len_table_prev = t2_z__huffman_table_select_length (table, code_length - 1);
         len_table->first_code = (len_table_prev->first_code + len_table_prev->num_codes) << 1;
     }
-
-    return table;
 }
 
+/* Scratch space for decompressing. */
+struct t2_z_inflate_context {
+    struct t2_z__huffman_table hclen;
+    struct t2_z__huffman_tables tables;
+};
+
 /* Dynamic huffman tables are stored in an interesting format that
  * is itself specified in Huffman codes and has some minimal compression.
  *
  * To construct a literal / distance distance Huffman table, a Huffman
  * table called HCLEN specifies an alphabet of symbols which specifies
  * some simple RLE and ZLE. */
-static struct t2_z__huffman_table t2_z__read_dyn_huffman_table (struct t2_z__state *state, struct t2_z__huffman_table *hclen, size_t count) {
-    uint8_t sym_to_code_length[count];
-    memset (&sym_to_code_length, 0, count);
+static void t2_z__read_dyn_code_lengths (struct t2_z__state *state, struct t2_z__huffman_table *hclen, uint8_t *sym_to_code_length, size_t count) {
+    size_t i = 0;
 
-    for (uint8_t i = 0; i < count; i++) {
+    while (i < count) {
         /* Figuring out what to call variable is confusing. It's not
          * a code length -- that's the output after ZLE / RLE. "symbol"
          * is confusing since we're building a map of symbols to code
@@ -255,48 +446,52 @@ static struct t2_z__huffman_table t2_z__read_dyn_huffman_table (struct t2_z__sta
          * Building a Huffman table by reading a Huffman table is confusing.
          */
         uint8_t op = t2_z__huffman_table_read (&state->bitreader, hclen);
+        uint8_t code_length = 0, repeat_length;
 
         /* op 0 - 15: literal code length.
          * op 16, NN: Copy the last code length N+3 times.
          * op 17, NNN: Zero the next N+3 code lengths.
          * op 18, NNNNNNN: Zero the next N+11 code lengths. */
         if (op <= 15) {
-            sym_to_code_length[i] = op;
+            code_length = op;
+            repeat_length = 1;
         } else if (op == 16) {
-            uint8_t repeat_length = 3 + t2_z__bitreader_read (&state->bitreader, 2);
-            uint8_t code_length = sym_to_code_length[i - 1];
-            for (uint8_t j = 0; j < repeat_length; j++)
-                sym_to_code_length[i++] = code_length;
+            t2_d_assert (i > 0);
+            code_length = sym_to_code_length[i - 1];
+            repeat_length = 3 + t2_z__bitreader_read (&state->bitreader, 2);
         } else if (op == 17) {
-            uint8_t repeat_length = 3 + t2_z__bitreader_read (&state->bitreader, 3);
-            for (uint8_t j = 0; j < repeat_length; j++)
-                sym_to_code_length[i++] = 0;
+            repeat_length = 3 + t2_z__bitreader_read (&state->bitreader, 3);
         } else if (op == 18) {
-            uint8_t repeat_length = 11 + t2_z__bitreader_read (&state->bitreader, 7);
-            for (uint8_t j = 0; j < repeat_length; j++)
-                sym_to_code_length[i++] = 0;
+            repeat_length = 11 + t2_z__bitreader_read (&state->bitreader, 7);
         } else {
             t2_d_die ("Invalid dyn table code length");
         }
-    }
 
-    return t2_z__build_huffman_table (sym_to_code_length, count);
+        t2_d_assert (i + repeat_length <= count);
+        for (uint8_t j = 0; j < repeat_length; j++)
+            sym_to_code_length[i++] = code_length;
+    }
 }
 
-static struct t2_z__huffman_tables t2_z__read_dyn_huffman_tables (struct t2_z__state *state) {
-    struct t2_z__huffman_tables tables = {};
+static struct t2_z__huffman_tables *t2_z__read_dyn_huffman_tables (struct t2_z__state *state) {
+    struct t2_z__huffman_tables *tables = &state->context->tables;
 
     uint8_t hlit  = t2_z__bitreader_read (&state->bitreader, 5);
     uint8_t hdist = t2_z__bitreader_read (&state->bitreader, 5);
     uint8_t hclen = t2_z__bitreader_read (&state->bitreader, 4);
 
+    /* 5 bits go up to 288 literal and 32 distance codes, but only 286 and
+     * 30 of them mean anything. */
+    if (hlit > 29 || hdist > 29)
+        t2_d_die ("Invalid HLIT or HDIST");
+
     /* First, craft the HCLEN table, which helps us construct the symbol
      * to code length mapping for the literal / distance tables. */
 
     /* The symbols of the HCLEN table are laid out in this order... */
     const uint8_t hclen_symbols[] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
 
-    uint8_t hclen_sym_to_code_lengths[18] = {};
+    uint8_t hclen_sym_to_code_lengths[19] = {};
 
     for (uint8_t i = 0; i < hclen + 4; i++) {
         /* Each code length for HCLEN is specified directly as a 3-bit value */
@@ -309,21 +504,27 @@ static struct t2_z__huffman_tables t2_z__read_dyn_huffman_tables (struct t2_z__s
         hclen_sym_to_code_lengths[hclen_symbol] = hclen_code_length;
     }
 
-    struct t2_z__huffman_table hclen_table = t2_z__build_huffman_table (hclen_sym_to_code_lengths, sizeof (hclen_sym_to_code_lengths));
+    struct t2_z__huffman_table *hclen_table = &state->context->hclen;
+    t2_z__build_huffman_table (hclen_table, hclen_sym_to_code_lengths, sizeof (hclen_sym_to_code_lengths));
+
+    /* Now we read the literal / distance tables using our constructed HCLEN
+     * table. The two are read as one run of code lengths, and a repeat can
+     * carry on from the end of one into the start of the other. */
+    uint8_t sym_to_code_length[288 + 32];
+    t2_z__read_dyn_code_lengths (state, hclen_table, sym_to_code_length, hlit + 257 + hdist + 1);
 
-    /* Now we read the literal / distance tables using our constructed HCLEN table. */
-    tables.literal = t2_z__read_dyn_huffman_table (state, &hclen_table, hlit + 257);
-    tables.distance = t2_z__read_dyn_huffman_table (state, &hclen_table, hdist + 1);
+    t2_z__build_huffman_table (&tables->literal, sym_to_code_length, hlit + 257);
+    t2_z__build_huffman_table (&tables->distance, sym_to_code_length + hlit + 257, hdist + 1);
 
     return tables;
 }
 
-static struct t2_z__huffman_tables *t2_z__fixed_huffman_tables (void) {
-    static struct t2_z__huffman_tables tables;
-    static int init = 0;
+/* Built once, by whichever thread gets there first. */
+static struct t2_z__huffman_tables t2_z__fixed_tables;
+static pthread_once_t t2_z__fixed_tables_once = PTHREAD_ONCE_INIT;
 
-    if (init)
-        return &tables;
+static void t2_z__build_fixed_huffman_tables (void) {
+    struct t2_z__huffman_tables *tables = &t2_z__fixed_tables;
 
     /* literal */
     {
@@ -335,7 +536,7 @@ static struct t2_z__huffman_tables *t2_z__fixed_huffman_tables (void) {
         for (sym = 256; sym <= 279; sym++) sym_to_code_length[sym] = 7;
         for (sym = 280; sym <= 287; sym++) sym_to_code_length[sym] = 8;
 
-        tables.literal = t2_z__build_huffman_table (sym_to_code_length, sizeof (sym_to_code_length));
+        t2_z__build_huffman_table (&tables->literal, sym_to_code_length, sizeof (sym_to_code_length));
     }
 
     /* distance */
@@ -345,11 +546,14 @@ static struct t2_z__huffman_tables *t2_z__fixed_huffman_tables (void) {
 
         for (sym = 0; sym < 32; sym++) sym_to_code_length[sym] = 5;
 
-        tables.distance = t2_z__build_huffman_table (sym_to_code_length, sizeof (sym_to_code_length));
+        t2_z__build_huffman_table (&tables->distance, sym_to_code_length, sizeof (sym_to_code_length));
     }
 
-    init = 1;
-    return &tables;
+}
+
+static struct t2_z__huffman_tables *t2_z__fixed_huffman_tables (void) {
+    pthread_once (&t2_z__fixed_tables_once, t2_z__build_fixed_huffman_tables);
+    return &t2_z__fixed_tables;
 }
 
 /* The symbols out of the length / distance tables aren't used directly
@@ -358,21 +562,20 @@ static struct t2_z__huffman_tables *t2_z__fixed_huffman_tables (void) {
  * RFC 3.2.5 has these tables.
  */
 static uint16_t t2_z__decode_length (struct t2_z__state *state, uint16_t code) {
-    uint16_t base, ebit;
+    static const uint16_t base[] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+    };
+    static const uint8_t ebits[] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+    };
 
-    if (code <= 256) t2_d_die ("Invalid code.");
-    else if (code <= 264) code -= 264, base =   3, ebit = 0;
-    else if (code <= 268) code -= 268, base =  11, ebit = 1;
-    else if (code <= 273) code -= 273, base =  19, ebit = 2;
-    else if (code <= 276) code -= 276, base =  35, ebit = 3;
-    else if (code <= 280) code -= 280, base =  67, ebit = 4;
-    else if (code <= 284) code -= 284, base = 131, ebit = 5;
-    else t2_d_die ("Invalid code.");
+    if (code < 257 || code > 285)
+        t2_d_die ("Invalid code.");
 
-    uint16_t res = base + code * ((1 << ebit) - 1);
-    if (ebit)
-        res += t2_z__bitreader_read (&state->bitreader, ebit);
-    return res;
+    code -= 257;
+    return base[code] + t2_z__bitreader_read (&state->bitreader, ebits[code]);
 }
 
 static uint16_t t2_z__decode_distance (struct t2_z__state *state, uint16_t code) {
@@ -411,9 +614,46 @@ static uint16_t t2_z__decode_distance (struct t2_z__state *state, uint16_t code)
     }
 }
 
+/* A back-reference from before the start of the output reaches into the
+ * dictionary. The match can run on from the end of the dictionary into
+ * the output, and what's left of it, which is returned, is then copied
+ * like any other. */
+static uint16_t t2_z__copy_dict_match (struct t2_z__state *state, size_t distance, uint16_t length) {
+    struct t2_z_buffer *out = &state->buffer_out;
+    size_t back = distance - out->position;
+    size_t n = back < length ? back : length;
+
+    t2_d_assert (back <= state->dict_size);
+    t2_d_assert (out->position + n <= out->size);
+    if (state->unknown) {
+        for (size_t i = 0; i < n; i++)
+            state->unknown[out->position + i] = T2_Z__MAX_DISTANCE - back + i + 1;
+        state->unknown_end = out->position + n;
+    } else {
+        memcpy (out->data + out->position, state->dict + state->dict_size - back, n);
+    }
+    out->position += n;
+    return length - n;
+}
+
+/* Sends what's new in the window, and keeps the last 32K of it. */
+static void t2_z__emit (struct t2_z__state *state) {
+    struct t2_z_buffer *out = &state->buffer_out;
+    if (out->position > state->emitted)
+        state->emit (state->emit_data, out->data + state->emitted, out->position - state->emitted);
+
+    size_t keep = out->position < T2_Z__MAX_DISTANCE ? out->position : T2_Z__MAX_DISTANCE;
+    memmove (out->data, out->data + out->position - keep, keep);
+    out->position = state->emitted = keep;
+}
+
 static void t2_z__read_compressed_block (struct t2_z__state *state, struct t2_z__huffman_tables *tables) {
     /* The format of a Huffman-compressed block is specified in RFC 3.2.3. */
     while (1) {
+        /* There's always room for the longest match after this. */
+        if (state->emit && state->buffer_out.position > state->emit_at)
+            t2_z__emit (state);
+
         uint16_t op = t2_z__huffman_table_read (&state->bitreader, &tables->literal);
 
         /* op 0 - 255: literal byte output.
@@ -426,69 +666,842 @@ static void t2_z__read_compressed_block (struct t2_z__state *state, struct t2_z_
         } else if (op <= 285) {
             uint16_t length, distance;
 
-            distance = t2_z__bitreader_read (&state->bitreader, 5);
+            /* The length's extra bits come before the distance. */
+            length = t2_z__decode_length (state, op);
+
+            distance = t2_z__huffman_table_read (&state->bitreader, &tables->distance);
             distance = t2_z__decode_distance (state, distance);
 
-            length = t2_z__decode_length (state, op);
-            t2_z__buffer_copy (&state->buffer_out, &state->buffer_out, -distance, length);
+            if (distance > state->buffer_out.position)
+                length = t2_z__copy_dict_match (state, distance, length);
+            if (length > 0) {
+                size_t to = state->buffer_out.position;
+                t2_z__buffer_copy_match (&state->buffer_out, distance, length);
+
+                /* Unknown bytes that get copied are just as unknown. They
+                 * get copied less and less, until there are none. */
+                if (state->unknown && to - distance < state->unknown_end) {
+                    uint16_t any = 0;
+                    for (size_t i = 0; i < length; i++)
+                        any |= state->unknown[to + i] = state->unknown[to - distance + i];
+                    if (any)
+                        state->unknown_end = to + length;
+                }
+            }
         } else {
             t2_d_die ("Illegal code");
         }
     }
 }
 
-/* Each block starts with a 3-bit header. */
-enum t2_z__block_flags {
-    /* Two bits for the block type -- BTYPE. */
-    T2_Z__BLOCK_TYPE_MASK             = 0x06,
+/* Segments, for t2_z_inflate_iov. */
 
-    /* Block is uncompressed. */
-    T2_Z__BLOCK_TYPE_UNCOMPRESSED     = 0x00,
-    /* Block is compressed with fixed Huffman tables. */
-    T2_Z__BLOCK_TYPE_COMPRESSED_FIXED = 0x02,
-    /* Block is compressed with in-band Huffman tables. */
-    T2_Z__BLOCK_TYPE_COMPRESSED_DYN   = 0x04,
+static void t2_z__segment_add (struct t2_z__state *state, uint8_t *data, size_t size) {
+    t2_d_assert (state->n_iov < state->max_iov);
+    state->iov[state->n_iov++] = (struct iovec) { .iov_base = data, .iov_len = size };
+}
 
-    /* A flag for whether the block is the final in its series or not... */
-    T2_Z__BLOCK_FLAG_FINAL            = 0x01,
-};
+/* A stored block just gets pointed at. */
+static void t2_z__segment_stored (struct t2_z__state *state, size_t length) {
+    struct t2_z_buffer *in = &state->buffer_in;
+    t2_d_assert (in->position + length <= in->size);
+    if (length > 0) {
+        t2_z__segment_add (state, in->data + in->position, length);
+        state->n_stored++;
+    }
+    in->position += length;
+}
 
-static void t2_z__inflate (struct t2_z__state *state) {
-    struct t2_z__bitreader *bitreader = &state->bitreader;
+/* Before a compressed block, the stored blocks just before it have to be
+ * in buf_out, as far back as a match can reach, so that it's all one
+ * piece. These bytes aren't output themselves. */
+static void t2_z__segment_window (struct t2_z__state *state) {
+    size_t first = state->n_iov, size = 0, skip = 0;
+
+    while (first > state->n_iov - state->n_stored && size < T2_Z__MAX_DISTANCE)
+        size += state->iov[--first].iov_len;
+    if (size > T2_Z__MAX_DISTANCE)
+        skip = size - T2_Z__MAX_DISTANCE;
+
+    struct t2_z_buffer *out = &state->buffer_out;
+    t2_d_assert (out->position + size - skip <= out->size);
+    for (size_t i = first; i < state->n_iov; i++) {
+        memcpy (out->data + out->position, (uint8_t *) state->iov[i].iov_base + skip, state->iov[i].iov_len - skip);
+        out->position += state->iov[i].iov_len - skip;
+        skip = 0;
+    }
+    state->n_stored = 0;
+}
 
-    while (1) {
-        uint8_t block_header = t2_z__bitreader_read (bitreader, 3);
-        uint8_t block_type = block_header & T2_Z__BLOCK_TYPE_MASK;
-
-        if (block_type == T2_Z__BLOCK_TYPE_UNCOMPRESSED) {
-            /* The data in an uncompressed block is byte-aligned, so we flush the bitreader here. */
-            t2_z__bitreader_flush (bitreader);
-            uint16_t length = t2_z__bitreader_read (bitreader, 16);
-            uint16_t nlength = t2_z__bitreader_read (bitreader, 16);
-            t2_d_assert (length == (nlength ^ 0xFFFF));
-            /* Just a copy -- easy. */
-            t2_z__buffer_copy (&state->buffer_out, &state->buffer_in, 0, length);
-        } else if (block_type == T2_Z__BLOCK_TYPE_COMPRESSED_FIXED) {
-            t2_z__read_compressed_block (state, t2_z__fixed_huffman_tables ());
-        } else if (block_type == T2_Z__BLOCK_TYPE_COMPRESSED_DYN) {
-            struct t2_z__huffman_tables tables = t2_z__read_dyn_huffman_tables (state);
-            t2_z__read_compressed_block (state, &tables);
+/* What a compressed block wrote goes on the end of the last segment, if
+ * that was the one before it in buf_out. */
+static void t2_z__segment_compressed (struct t2_z__state *state, size_t start) {
+    struct t2_z_buffer *out = &state->buffer_out;
+    struct iovec *last = state->n_iov ? &state->iov[state->n_iov - 1] : NULL;
+
+    if (out->position == start)
+        return;
+    if (last && (uint8_t *) last->iov_base + last->iov_len == out->data + start)
+        last->iov_len += out->position - start;
+    else
+        t2_z__segment_add (state, out->data + start, out->position - start);
+}
+
+/* Reads one block, and returns whether it was the last. */
+static int t2_z__inflate_block (struct t2_z__state *state) {
+    struct t2_z__bitreader *bitreader = &state->bitreader;
+    uint8_t block_header = t2_z__bitreader_read (bitreader, 3);
+    uint8_t block_type = block_header & T2_Z__BLOCK_TYPE_MASK;
+
+    if (block_type == T2_Z__BLOCK_TYPE_UNCOMPRESSED) {
+        /* The data in an uncompressed block is byte-aligned, so we flush the bitreader here. */
+        t2_z__bitreader_flush (bitreader);
+        uint16_t length = t2_z__bitreader_read (bitreader, 16);
+        uint16_t nlength = t2_z__bitreader_read (bitreader, 16);
+        t2_d_assert (length == (nlength ^ 0xFFFF));
+        /* Just a copy -- easy. Or not even that. */
+        if (state->iov) {
+            t2_z__segment_stored (state, length);
+        } else if (state->emit) {
+            /* Bigger than what's left of the window, maybe. */
+            while (length > 0) {
+                size_t room = state->buffer_out.size - state->buffer_out.position;
+                size_t n = length < room ? length : room;
+                t2_z__buffer_copy (&state->buffer_out, &state->buffer_in, 0, n);
+                length -= n;
+                if (state->buffer_out.position == state->buffer_out.size)
+                    t2_z__emit (state);
+            }
         } else {
-            t2_d_die ("Invalid block type");
+            t2_z__buffer_copy (&state->buffer_out, &state->buffer_in, 0, length);
         }
+        return block_header & T2_Z__BLOCK_FLAG_FINAL;
+    }
 
-        if (block_header & T2_Z__BLOCK_FLAG_FINAL)
-            break;
+    if (state->iov && state->n_stored)
+        t2_z__segment_window (state);
+    size_t start = state->buffer_out.position;
+
+    if (block_type == T2_Z__BLOCK_TYPE_COMPRESSED_FIXED) {
+        t2_z__read_compressed_block (state, t2_z__fixed_huffman_tables ());
+    } else if (block_type == T2_Z__BLOCK_TYPE_COMPRESSED_DYN) {
+        t2_z__read_compressed_block (state, t2_z__read_dyn_huffman_tables (state));
+    } else {
+        t2_d_die ("Invalid block type");
     }
+
+    if (state->iov)
+        t2_z__segment_compressed (state, start);
+    return block_header & T2_Z__BLOCK_FLAG_FINAL;
+}
+
+static void t2_z__inflate (struct t2_z__state *state) {
+    while (!t2_z__inflate_block (state))
+        ;
+}
+
+static void t2_z__inflate_buffers (struct t2_z_inflate_context *context, struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, const uint8_t *dict, size_t dict_size) {
+    struct t2_z__state state = {
+        .buffer_in = *buf_in,
+        .buffer_out = *buf_out,
+        .dict = dict,
+        .dict_size = dict_size,
+        .context = context,
+    };
+    state.bitreader = ((struct t2_z__bitreader) { .buffer = &state.buffer_in });
+    t2_z__inflate (&state);
+
+    buf_in->position = state.buffer_in.position;
+    buf_out->position = state.buffer_out.position;
+}
+
+static void t2_z_inflate_dict (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, const uint8_t *dict, size_t dict_size) {
+    /* Nothing in here needs to start off zeroed. */
+    struct t2_z_inflate_context context;
+    t2_z__inflate_buffers (&context, buf_in, buf_out, dict, dict_size);
 }
 
 static void t2_z_inflate (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out) {
+    t2_z_inflate_dict (buf_in, buf_out, NULL, 0);
+}
+
+static size_t t2_z_inflate_iov (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, struct iovec *iov, size_t max_iov) {
+    struct t2_z_inflate_context context;
     struct t2_z__state state = {
         .buffer_in = *buf_in,
         .buffer_out = *buf_out,
+        .context = &context,
+        .iov = iov,
+        .max_iov = max_iov,
+    };
+    state.bitreader = ((struct t2_z__bitreader) { .buffer = &state.buffer_in });
+    t2_z__inflate (&state);
+
+    buf_in->position = state.buffer_in.position;
+    buf_out->position = state.buffer_out.position;
+    return state.n_iov;
+}
+
+static void t2_z_inflate_chunked (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, t2_z_emit_func emit, void *data) {
+    enum { MAX_MATCH = 258 };
+    t2_d_assert (buf_out->size > T2_Z__MAX_DISTANCE + MAX_MATCH);
+
+    struct t2_z_inflate_context context;
+    struct t2_z__state state = {
+        .buffer_in = *buf_in,
+        .buffer_out = { buf_out->data, buf_out->size, 0 },
+        .context = &context,
+        .emit = emit,
+        .emit_data = data,
+        .emit_at = buf_out->size - MAX_MATCH,
     };
     state.bitreader = ((struct t2_z__bitreader) { .buffer = &state.buffer_in });
     t2_z__inflate (&state);
+    t2_z__emit (&state);
+
+    buf_in->position = state.buffer_in.position;
+}
+
+static struct t2_z_inflate_context *t2_z_inflate_context_new (void) {
+    struct t2_z_inflate_context *context = malloc (sizeof (*context));
+    t2_d_assert (context != NULL);
+    return context;
+}
+
+static void t2_z_inflate_batch (struct t2_z_inflate_context *context, struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        t2_z__inflate_buffers (context, &buf_in[i], &buf_out[i], NULL, 0);
+}
+
+static void t2_z_inflate_context_free (struct t2_z_inflate_context *context) {
+    free (context);
+}
+
+/* zlib's wrapper. */
+
+static uint32_t t2_z__read_be32 (struct t2_z_buffer *in) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+        value = (value << 8) | t2_z__buffer_read_byte (in);
+    return value;
+}
+
+static void t2_z_zlib_inflate (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, const uint8_t *dict, size_t dict_size) {
+    /* CMF: the method, which has to be deflate, and the window size. FLG:
+     * whether there's a dictionary, and check bits that make the two of
+     * them a multiple of 31. */
+    uint8_t cmf = t2_z__buffer_read_byte (buf_in);
+    uint8_t flg = t2_z__buffer_read_byte (buf_in);
+    if ((cmf & 0x0F) != 8 || (cmf >> 4) > 7 || ((cmf << 8) | flg) % 31 != 0)
+        t2_d_die ("Not a zlib stream");
+
+    if (flg & 0x20) {
+        uint32_t dict_id = t2_z__read_be32 (buf_in);
+        if (dict == NULL || t2_z_adler32 (1, dict, dict_size) != dict_id)
+            t2_d_die ("Wrong dictionary");
+    } else {
+        dict = NULL;
+        dict_size = 0;
+    }
+
+    size_t start = buf_out->position;
+    t2_z_inflate_dict (buf_in, buf_out, dict, dict_size);
+
+    /* The checksum is byte-aligned, after the last block. */
+    uint32_t adler = t2_z__read_be32 (buf_in);
+    if (t2_z_adler32 (1, buf_out->data + start, buf_out->position - start) != adler)
+        t2_d_die ("Bad Adler-32");
+}
+
+/* gzip's wrapper (RFC 1952). */
+
+enum {
+    T2_Z__GZIP_FHCRC    = 0x02,
+    T2_Z__GZIP_FEXTRA   = 0x04,
+    T2_Z__GZIP_FNAME    = 0x08,
+    T2_Z__GZIP_FCOMMENT = 0x10,
+};
+
+static uint32_t t2_z__read_le (struct t2_z_buffer *in, int n) {
+    uint32_t value = 0;
+    for (int i = 0; i < n; i++)
+        value |= (uint32_t) t2_z__buffer_read_byte (in) << (8 * i);
+    return value;
+}
+
+/* Skips over a member's header, and everything optional in it. */
+static void t2_z__read_gzip_header (struct t2_z_buffer *in) {
+    uint8_t id1 = t2_z__buffer_read_byte (in), id2 = t2_z__buffer_read_byte (in);
+    uint8_t method = t2_z__buffer_read_byte (in), flags = t2_z__buffer_read_byte (in);
+    if (id1 != 0x1F || id2 != 0x8B || method != 8)
+        t2_d_die ("Not a gzip stream");
+
+    /* MTIME, XFL and OS. */
+    t2_d_assert (in->position + 6 <= in->size);
+    in->position += 6;
+
+    if (flags & T2_Z__GZIP_FEXTRA) {
+        size_t length = t2_z__read_le (in, 2);
+        t2_d_assert (in->position + length <= in->size);
+        in->position += length;
+    }
+    if (flags & T2_Z__GZIP_FNAME)
+        while (t2_z__buffer_read_byte (in))
+            ;
+    if (flags & T2_Z__GZIP_FCOMMENT)
+        while (t2_z__buffer_read_byte (in))
+            ;
+    if (flags & T2_Z__GZIP_FHCRC)
+        t2_z__read_le (in, 2);
+}
+
+static void t2_z__read_gzip_trailer (struct t2_z_buffer *in, const uint8_t *data, size_t size) {
+    uint32_t crc = t2_z__read_le (in, 4), isize = t2_z__read_le (in, 4);
+    if (crc != t2_z_crc32 (0, data, size) || isize != (uint32_t) size)
+        t2_d_die ("Bad gzip trailer");
+}
+
+/* Parallel decompression, rapidgzip style.
+ *
+ * A plain gzip file is one long deflate stream, and there's no telling
+ * where a block starts without decoding everything before it. So we
+ * guess. The compressed data is cut into chunks, and for each one, a
+ * thread looks for the first place in it that could be the start of a
+ * dynamic block: the header has to read, and its codes all have to be
+ * complete, like a real encoder's are, which garbage hardly ever manages.
+ * Then each chunk is decoded from its guess, until it gets to a block
+ * that starts where some later chunk's guess is, or the end.
+ *
+ * Without knowing what the 32K before a guess decompressed to, the bytes
+ * that come from back there can't be written, so they're marked with
+ * which byte of it they want (see t2_z__state's unknown). Once the chunk
+ * before has been filled in, so has the window, and so can they be.
+ *
+ * Guesses can be wrong. Decoding from a wrong one almost always fails
+ * soon enough, which is caught with t2_z__catch. And only the chunks that
+ * the first one leads to are used: the first starts at a real block, and
+ * if it stops at a later chunk's guess, that guess was a real block too,
+ * and so on. When a chunk goes past the next chunk's guess without
+ * stopping there, it carries on to the one after that, and the skipped
+ * chunk's work is thrown away.
+ *
+ * A file of several members is done in one go too, rather than starting
+ * over on everything left for each one. Where a member ends, the next
+ * one's first block is somewhere no chunk would have guessed, so it's
+ * decoded from there, like the first chunk is, as far as the next guess,
+ * and the chain carries on from that. */
+
+struct t2_z__speculative_chunk {
+    /* Where the guess is, in bits, or SIZE_MAX if there isn't one. */
+    size_t start;
+
+    /* Where decoding stopped, and whether that's the end of the stream,
+     * or whether it failed. */
+    size_t end;
+    int final, failed;
+
+    /* Everything t2_z__inflate_block needs. This isn't on the stack,
+     * since it has to be looked at after a longjmp. */
+    struct t2_z__state state;
+
+    /* Where its output goes, if it's used. */
+    size_t offset;
+
+    /* Whether this is the start of a member after the first, rather
+     * than one of chunks. */
+    int bridge;
+};
+
+struct t2_z__speculative {
+    struct t2_z_buffer in, out;
+    size_t chunk_size, n_chunks;
+    struct t2_z__speculative_chunk *chunks;
+
+    /* The chunks that get used, in order. */
+    size_t n_chain, max_chain;
+    struct t2_z__speculative_chunk **chain;
+
+    /* Which phase we're in: guessing, decoding, or filling in. And the
+     * next chunk to do in it. */
+    int phase;
+    size_t next;
+};
+
+/* Whether a table's codes add up to exactly all of them, as measured by
+ * the longest length. A lone code is fine too, since that's how an
+ * encoder says there's only one distance. */
+static int t2_z__huffman_table_is_complete (struct t2_z__huffman_table *table) {
+    uint32_t total = 0, n = 0;
+    for (uint8_t code_length = 1; code_length <= T2_Z__HUFFMAN_TABLE_MAX_LEN; code_length++) {
+        struct t2_z__huffman_table_length *len_table = t2_z__huffman_table_select_length (table, code_length);
+        total += len_table->num_codes << (T2_Z__HUFFMAN_TABLE_MAX_LEN - code_length);
+        n += len_table->num_codes;
+    }
+    return total == (1 << T2_Z__HUFFMAN_TABLE_MAX_LEN) || n == 1;
+}
+
+/* Up to 57 bits from offset on, without a bitreader, and so without
+ * any fuss about running off the end, where they're 0. */
+static uint64_t t2_z__peek_bits (struct t2_z_buffer *in, size_t offset, int nbits) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < 8 && offset / 8 + i < in->size; i++)
+        bits |= (uint64_t) in->data[offset / 8 + i] << (8 * i);
+    return (bits >> (offset % 8)) & (((uint64_t) 1 << nbits) - 1);
+}
+
+/* Whether there's what looks like a dynamic block's header at offset. */
+static int t2_z__looks_like_block (struct t2_z__speculative *job, struct t2_z__state *state, size_t offset) {
+    jmp_buf catch;
+
+    /* This gets asked of every bit, so most places are ruled out first
+     * straight from the bits: it has to be dynamic and not the last
+     * block, HLIT and HDIST have to be in range, and the code lengths'
+     * code has to be complete. */
+    uint64_t header = t2_z__peek_bits (&job->in, offset, 17);
+    if ((header & 7) != T2_Z__BLOCK_TYPE_COMPRESSED_DYN || ((header >> 3) & 31) > 29 || ((header >> 8) & 31) > 29)
+        return 0;
+
+    int hclen = (header >> 13) + 4;
+    uint64_t hclen_lengths = t2_z__peek_bits (&job->in, offset + 17, hclen * 3);
+    uint32_t total = 0;
+    for (int i = 0; i < hclen; i++) {
+        int code_length = (hclen_lengths >> (3 * i)) & 7;
+        if (code_length)
+            total += 128 >> code_length;
+    }
+    if (total != 128)
+        return 0;
+
+    /* Then it's read properly, which might go wrong in all sorts of
+     * ways, including running off the end. */
+    if (setjmp (catch)) {
+        t2_z__catch = NULL;
+        return 0;
+    }
+    t2_z__catch = &catch;
+
+    state->buffer_in = job->in;
+    state->bitreader = (struct t2_z__bitreader) { .buffer = &state->buffer_in };
+    t2_z__bitreader_seek (&state->bitreader, offset + 3);
+    struct t2_z__huffman_tables *tables = t2_z__read_dyn_huffman_tables (state);
+    t2_z__catch = NULL;
+
+    int has_end_of_block = 0;
+    for (uint8_t code_length = 1; code_length <= T2_Z__HUFFMAN_TABLE_MAX_LEN; code_length++) {
+        struct t2_z__huffman_table_length *len_table = t2_z__huffman_table_select_length (&tables->literal, code_length);
+        for (uint32_t i = 0; i < len_table->num_codes; i++)
+            has_end_of_block |= len_table->code_idx_to_symbol[i] == 256;
+    }
+
+    return has_end_of_block &&
+        t2_z__huffman_table_is_complete (&state->context->hclen) &&
+        t2_z__huffman_table_is_complete (&tables->literal) &&
+        t2_z__huffman_table_is_complete (&tables->distance);
+}
+
+/* Whether some chunk guessed that a block starts at offset. Guesses go
+ * up from one chunk to the next, so this is always a later one. */
+static int t2_z__is_guess (struct t2_z__speculative *job, size_t offset) {
+    for (size_t j = 0; j < job->n_chunks; j++)
+        if (job->chunks[j].start == offset)
+            return 1;
+    return 0;
+}
+
+/* Decodes from chunk's guess. If fresh, that's the start of a member,
+ * and nothing's before it. */
+static void t2_z__speculative_decode (struct t2_z__speculative *job, struct t2_z__speculative_chunk *chunk, int fresh, struct t2_z_inflate_context *context) {
+    struct t2_z__state *state = &chunk->state;
+    size_t size = job->chunk_size * 4 + 65536;
+    jmp_buf catch;
+
+    while (1) {
+        *state = (struct t2_z__state) {
+            .buffer_in = job->in,
+            .buffer_out = { malloc (size), size, 0 },
+            .context = context,
+        };
+        t2_d_assert (state->buffer_out.data != NULL);
+        state->bitreader = (struct t2_z__bitreader) { .buffer = &state->buffer_in };
+        t2_z__bitreader_seek (&state->bitreader, chunk->start);
+
+        if (!fresh) {
+            state->unknown = calloc (size, sizeof (*state->unknown));
+            t2_d_assert (state->unknown != NULL);
+            state->dict_size = T2_Z__MAX_DISTANCE;
+        }
+
+        if (setjmp (catch) == 0) {
+            t2_z__catch = &catch;
+            while (1) {
+                chunk->final = t2_z__inflate_block (state);
+                chunk->end = t2_z__bitreader_offset (&state->bitreader);
+                if (chunk->final || t2_z__is_guess (job, chunk->end))
+                    break;
+            }
+            t2_z__catch = NULL;
+            return;
+        }
+        t2_z__catch = NULL;
+
+        /* Either the guess was wrong, or it ran out of room. It might
+         * have run out of room if it's less than a stored block from the
+         * end, in which case it goes again with more. There can't be more
+         * than 1032 bytes of output per byte of input, though. */
+        free (state->buffer_out.data);
+        free (state->unknown);
+        state->unknown = NULL;
+        if (size - state->buffer_out.position > 65536 + 258 || size > (job->in.size - chunk->start / 8) * 1032 + 65536) {
+            chunk->failed = 1;
+            return;
+        }
+        size *= 2;
+    }
+}
+
+/* Copies from .. to of a chunk's output into place, and fills in the
+ * unknown bytes there from the 32K before it, which has to be in place
+ * already. */
+static void t2_z__speculative_place (struct t2_z__speculative *job, struct t2_z__speculative_chunk *chunk, size_t from, size_t to) {
+    uint8_t *data = job->out.data + chunk->offset;
+    memcpy (data + from, chunk->state.buffer_out.data + from, to - from);
+
+    size_t end = to < chunk->state.unknown_end ? to : chunk->state.unknown_end;
+    for (size_t i = from; i < end; i++) {
+        uint16_t unknown = chunk->state.unknown[i];
+        if (unknown == 0)
+            continue;
+        t2_d_assert (chunk->offset >= T2_Z__MAX_DISTANCE - (unknown - 1));
+        data[i] = data[(ptrdiff_t) (unknown - 1) - T2_Z__MAX_DISTANCE];
+    }
+}
+
+/* Where the last 32K of a chunk's output starts, or 0. */
+static size_t t2_z__speculative_tail (struct t2_z__speculative_chunk *chunk) {
+    size_t size = chunk->state.buffer_out.position;
+    return size > T2_Z__MAX_DISTANCE ? size - T2_Z__MAX_DISTANCE : 0;
+}
+
+static void *t2_z__speculative_worker (void *data) {
+    struct t2_z__speculative *job = data;
+    struct t2_z_inflate_context *context = t2_z_inflate_context_new ();
+    struct t2_z__state state = { .context = context };
+    size_t n = job->phase == 2 ? job->n_chain : job->n_chunks;
+    size_t i;
+
+    while ((i = __atomic_fetch_add (&job->next, 1, __ATOMIC_RELAXED)) < n) {
+        struct t2_z__speculative_chunk *chunk = &job->chunks[i];
+
+        if (job->phase == 0) {
+            size_t from = (job->in.position + i * job->chunk_size) * 8;
+            size_t to = (job->in.position + (i + 1) * job->chunk_size) * 8;
+            if (to > job->in.size * 8)
+                to = job->in.size * 8;
+
+            chunk->start = SIZE_MAX;
+            if (i == 0)
+                chunk->start = from;
+            for (size_t offset = from; i > 0 && offset < to; offset++) {
+                if (t2_z__looks_like_block (job, &state, offset)) {
+                    chunk->start = offset;
+                    break;
+                }
+            }
+        } else if (job->phase == 1) {
+            /* The first chunk starts at the start. */
+            if (chunk->start != SIZE_MAX)
+                t2_z__speculative_decode (job, chunk, i == 0, context);
+        } else {
+            chunk = job->chain[i];
+            t2_z__speculative_place (job, chunk, 0, t2_z__speculative_tail (chunk));
+        }
+    }
+
+    t2_z_inflate_context_free (context);
+    return NULL;
+}
+
+static void t2_z__speculative_run (struct t2_z__speculative *job, int phase, int n_threads) {
+    job->phase = phase;
+    job->next = 0;
+    if (n_threads <= 1) {
+        t2_z__speculative_worker (job);
+    } else {
+        pthread_t threads[n_threads];
+        for (int i = 0; i < n_threads; i++)
+            pthread_create (&threads[i], NULL, t2_z__speculative_worker, job);
+        for (int i = 0; i < n_threads; i++)
+            pthread_join (threads[i], NULL);
+    }
+}
+
+static void t2_z__speculative_chain (struct t2_z__speculative *job, struct t2_z__speculative_chunk *chunk) {
+    if (job->n_chain == job->max_chain) {
+        job->max_chain = job->max_chain ? job->max_chain * 2 : 16;
+        job->chain = realloc (job->chain, job->max_chain * sizeof (*job->chain));
+        t2_d_assert (job->chain != NULL);
+    }
+    job->chain[job->n_chain++] = chunk;
+}
+
+/* Where a member's output is, and what its trailer says about it, to be
+ * checked once it's all been filled in. */
+struct t2_z__gzip_member {
+    size_t start, size;
+    uint32_t crc, isize;
+};
+
+/* All of the members from buf_in's position on, whose first header has
+ * been read already. */
+static void t2_z__gzip_inflate_speculative (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int n_threads, size_t chunk_size) {
+    struct t2_z__speculative job = {
+        .in = *buf_in,
+        .out = *buf_out,
+        .chunk_size = chunk_size,
+    };
+
+    job.n_chunks = (buf_in->size - buf_in->position + chunk_size - 1) / chunk_size;
+    if (job.n_chunks == 0)
+        job.n_chunks = 1;
+    job.chunks = calloc (job.n_chunks, sizeof (*job.chunks));
+    t2_d_assert (job.chunks != NULL);
+
+    if (n_threads > (int) job.n_chunks)
+        n_threads = job.n_chunks;
+
+    /* First every chunk's guess, since each chunk needs to know where
+     * all of the later ones are to know where to stop, and then the
+     * decoding. */
+    t2_z__speculative_run (&job, 0, n_threads);
+    t2_z__speculative_run (&job, 1, n_threads);
+
+    /* Follow the chain from the first chunk. The chunk after each one
+     * only needs its last 32K, so that's filled in now, in order, and
+     * the rest of all of them at once after. */
+    struct t2_z_inflate_context *context = NULL;
+    struct t2_z__gzip_member *members = NULL;
+    size_t n_members = 0, max_members = 0;
+    struct t2_z_buffer in = job.in;
+    struct t2_z__speculative_chunk *chunk = &job.chunks[0];
+    size_t i = 0, offset = buf_out->position, member_start = offset;
+    while (1) {
+        if (chunk->failed)
+            t2_d_die ("Corrupt deflate stream");
+
+        chunk->offset = offset;
+        offset += chunk->state.buffer_out.position;
+        t2_d_assert (offset <= buf_out->size);
+        t2_z__speculative_place (&job, chunk, t2_z__speculative_tail (chunk), chunk->state.buffer_out.position);
+        t2_z__speculative_chain (&job, chunk);
+
+        if (!chunk->final) {
+            /* Bridges stop at a guess in the chunk they're in, or after. */
+            if (!chunk->bridge)
+                i++;
+            while (job.chunks[i].start != chunk->end)
+                i++;
+            chunk = &job.chunks[i];
+            continue;
+        }
+
+        if (n_members == max_members) {
+            max_members = max_members ? max_members * 2 : 16;
+            members = realloc (members, max_members * sizeof (*members));
+            t2_d_assert (members != NULL);
+        }
+        in.position = (chunk->end + 7) / 8;
+        members[n_members].start = member_start;
+        members[n_members].size = offset - member_start;
+        members[n_members].crc = t2_z__read_le (&in, 4);
+        members[n_members].isize = t2_z__read_le (&in, 4);
+        n_members++;
+        if (in.position >= in.size)
+            break;
+
+        t2_z__read_gzip_header (&in);
+        member_start = offset;
+        if (!context)
+            context = t2_z_inflate_context_new ();
+        chunk = calloc (1, sizeof (*chunk));
+        t2_d_assert (chunk != NULL);
+        chunk->start = in.position * 8;
+        chunk->bridge = 1;
+        t2_z__speculative_decode (&job, chunk, 1, context);
+        i = (in.position - job.in.position) / chunk_size;
+    }
+    buf_in->position = in.position;
+    buf_out->position = offset;
+
+    t2_z__speculative_run (&job, 2, n_threads);
+
+    for (i = 0; i < n_members; i++) {
+        struct t2_z__gzip_member *m = &members[i];
+        if (m->crc != t2_z_crc32 (0, buf_out->data + m->start, m->size) || m->isize != (uint32_t) m->size)
+            t2_d_die ("Bad gzip trailer");
+    }
+
+    for (i = 0; i < job.n_chain; i++) {
+        if (job.chain[i]->bridge) {
+            free (job.chain[i]->state.buffer_out.data);
+            free (job.chain[i]->state.unknown);
+            free (job.chain[i]);
+        }
+    }
+    for (i = 0; i < job.n_chunks; i++) {
+        free (job.chunks[i].state.buffer_out.data);
+        free (job.chunks[i].state.unknown);
+    }
+    if (context)
+        t2_z_inflate_context_free (context);
+    free (members);
+    free (job.chunks);
+    free (job.chain);
+}
+
+/* BGZF says how big each member is, in a BC field in its header, and
+ * how big it decompresses to is in its trailer. So a file that's all
+ * BGZF can be split up without decoding anything, and its members done
+ * one per thread. This is how big the member at position is, or 0 if it
+ * doesn't say. */
+static size_t t2_z__bgzf_member_size (struct t2_z_buffer *in, size_t position) {
+    const uint8_t *p = in->data + position;
+    size_t left = in->size - position;
+    if (left < 12 || p[0] != 0x1F || p[1] != 0x8B || p[2] != 8 || !(p[3] & T2_Z__GZIP_FEXTRA))
+        return 0;
+
+    size_t xlen = p[10] | p[11] << 8;
+    if (left < 12 + xlen)
+        return 0;
+    for (size_t x = 12; x + 4 <= 12 + xlen; x += 4 + (p[x + 2] | p[x + 3] << 8)) {
+        if (p[x] == 'B' && p[x + 1] == 'C' && (p[x + 2] | p[x + 3] << 8) == 2 && x + 6 <= 12 + xlen) {
+            size_t size = (p[x + 4] | p[x + 5] << 8) + 1;
+            return size >= 12 + xlen + 8 && size <= left ? size : 0;
+        }
+    }
+    return 0;
+}
+
+struct t2_z__bgzf {
+    struct t2_z_buffer in, out;
+    size_t n_members;
+    /* Where each member starts, in and out, with one more for the end. */
+    size_t *in_offsets, *out_offsets;
+    size_t next;
+};
+
+static void *t2_z__bgzf_worker (void *data) {
+    struct t2_z__bgzf *job = data;
+    size_t i;
+
+    while ((i = __atomic_fetch_add (&job->next, 1, __ATOMIC_RELAXED)) < job->n_members) {
+        struct t2_z_buffer in = { job->in.data, job->in_offsets[i + 1], job->in_offsets[i] };
+        struct t2_z_buffer out = {
+            job->out.data + job->out_offsets[i],
+            job->out_offsets[i + 1] - job->out_offsets[i],
+            0,
+        };
+        t2_z__read_gzip_header (&in);
+        t2_z_inflate (&in, &out);
+        t2_z__read_gzip_trailer (&in, out.data, out.position);
+        if (in.position != in.size)
+            t2_d_die ("Bad BGZF member size");
+    }
+    return NULL;
+}
+
+/* Returns 0, having done nothing, unless every member is BGZF. */
+static int t2_z__bgzf_inflate (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int n_threads) {
+    size_t n_members = 0, position = buf_in->position, size;
+    while (position < buf_in->size) {
+        if (!(size = t2_z__bgzf_member_size (buf_in, position)))
+            return 0;
+        position += size;
+        n_members++;
+    }
+
+    struct t2_z__bgzf job = { .in = *buf_in, .out = *buf_out, .n_members = n_members };
+    job.in_offsets = malloc ((n_members + 1) * sizeof (size_t));
+    job.out_offsets = malloc ((n_members + 1) * sizeof (size_t));
+    t2_d_assert (job.in_offsets != NULL && job.out_offsets != NULL);
+
+    job.in_offsets[0] = buf_in->position;
+    job.out_offsets[0] = buf_out->position;
+    for (size_t i = 0; i < n_members; i++) {
+        size_t end = job.in_offsets[i] + t2_z__bgzf_member_size (buf_in, job.in_offsets[i]);
+        const uint8_t *isize = buf_in->data + end - 4;
+        job.in_offsets[i + 1] = end;
+        job.out_offsets[i + 1] = job.out_offsets[i] + (isize[0] | isize[1] << 8 | isize[2] << 16 | (uint32_t) isize[3] << 24);
+        t2_d_assert (job.out_offsets[i + 1] <= buf_out->size);
+    }
+
+    if (n_threads > (int) n_members)
+        n_threads = n_members;
+    if (n_threads <= 1) {
+        t2_z__bgzf_worker (&job);
+    } else {
+        pthread_t threads[n_threads];
+        for (int i = 0; i < n_threads; i++)
+            pthread_create (&threads[i], NULL, t2_z__bgzf_worker, &job);
+        for (int i = 0; i < n_threads; i++)
+            pthread_join (threads[i], NULL);
+    }
+
+    buf_in->position = buf_in->size;
+    buf_out->position = job.out_offsets[n_members];
+    free (job.in_offsets);
+    free (job.out_offsets);
+    return 1;
+}
+
+static void t2_z__gzip_inflate (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int n_threads, size_t chunk_size) {
+    if (n_threads <= 0)
+        n_threads = sysconf (_SC_NPROCESSORS_ONLN);
+    if (n_threads <= 1) {
+        while (buf_in->position < buf_in->size) {
+            size_t start = buf_out->position;
+            t2_z__read_gzip_header (buf_in);
+            t2_z_inflate (buf_in, buf_out);
+            t2_z__read_gzip_trailer (buf_in, buf_out->data + start, buf_out->position - start);
+        }
+    } else if (buf_in->position < buf_in->size && !t2_z__bgzf_inflate (buf_in, buf_out, n_threads)) {
+        t2_z__read_gzip_header (buf_in);
+        t2_z__gzip_inflate_speculative (buf_in, buf_out, n_threads, chunk_size);
+    }
+}
+
+static void t2_z_gzip_inflate (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out) {
+    t2_z__gzip_inflate (buf_in, buf_out, 1, 0);
+}
+
+static void t2_z_gzip_inflate_parallel (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, int n_threads) {
+    t2_z__gzip_inflate (buf_in, buf_out, n_threads, T2_Z_INFLATE_CHUNK_SIZE);
+}
+
+/* The CRC-32 is worked out on each chunk on its way through. */
+struct t2_z__gzip_chunked {
+    t2_z_emit_func emit;
+    void *data;
+    uint32_t crc;
+    size_t size;
+};
+
+static void t2_z__gzip_emit (void *data, const uint8_t *chunk, size_t size) {
+    struct t2_z__gzip_chunked *gzip = data;
+    gzip->crc = t2_z_crc32 (gzip->crc, chunk, size);
+    gzip->size += size;
+    gzip->emit (gzip->data, chunk, size);
+}
+
+static void t2_z_gzip_inflate_chunked (struct t2_z_buffer *buf_in, struct t2_z_buffer *buf_out, t2_z_emit_func emit, void *data) {
+    while (buf_in->position < buf_in->size) {
+        struct t2_z__gzip_chunked gzip = { .emit = emit, .data = data };
+        t2_z__read_gzip_header (buf_in);
+        t2_z_inflate_chunked (buf_in, buf_out, t2_z__gzip_emit, &gzip);
+
+        uint32_t crc = t2_z__read_le (buf_in, 4), isize = t2_z__read_le (buf_in, 4);
+        if (crc != gzip.crc || isize != (uint32_t) gzip.size)
+            t2_d_die ("Bad gzip trailer");
+    }
 }
 
 #ifdef T2_RUN_TESTS
@@ -519,10 +1532,11 @@ static int test_bitreader (void) {
     t2_t_assert (bits == '\x07'); /* '0111' */
     bits = t2_z__bitreader_read (&b, 4);
     t2_t_assert (bits == '\x0F'); /* '1111' */
+    /* The first byte has the low bits. */
     bits = t2_z__bitreader_read (&b, 16);
-    t2_t_assert (bits == 0x1234);
+    t2_t_assert (bits == 0x3412);
     bits = t2_z__bitreader_read (&b, 12);
-    t2_t_assert (bits == 0x0568);
+    t2_t_assert (bits == 0x0856);
     bits = t2_z__bitreader_read (&b, 4);
     t2_t_assert (bits == 0x7);
 
@@ -540,9 +1554,311 @@ static int test_inflate (void) {
     return 0;
 }
 
+/* Until there's a compressor to make test data with, a single fixed
+ * Huffman block holding nothing but literals, which is easy enough to
+ * write by hand. */
+enum { BENCH_SIZE = 64 * 1024 };
+static uint8_t bench_in[BENCH_SIZE + 16], bench_out[BENCH_SIZE + 1];
+
+static void bench_put_bits (size_t *bit, uint32_t value, int nbits) {
+    for (int i = 0; i < nbits; i++, (*bit)++)
+        bench_in[*bit / 8] |= ((value >> i) & 1) << (*bit % 8);
+}
+
+/* Huffman codes go in starting from their MSB. */
+static void bench_put_code (size_t *bit, uint32_t code, int nbits) {
+    while (nbits--)
+        bench_put_bits (bit, code >> nbits, 1);
+}
+
+static void bench_make_input (void) {
+    size_t bit = 0;
+    if (bench_in[0])
+        return;
+
+    bench_put_bits (&bit, 1, 1); /* BFINAL */
+    bench_put_bits (&bit, 1, 2); /* BTYPE = fixed */
+    for (size_t i = 0; i < BENCH_SIZE; i++) {
+        /* Text, so every literal has an 8-bit code. */
+        uint8_t c = " etaoinshrdlu"[(i * 7) % 13];
+        bench_put_code (&bit, 0x30 + c, 8);
+    }
+    bench_put_code (&bit, 0, 7); /* end of block */
+}
+
+static int bench_inflate_literals (size_t n) {
+    bench_make_input ();
+    for (size_t i = 0; i < n; i++)
+        t2_z_inflate (T2_Z_BUFFER_FROM_STATIC (bench_in), T2_Z_BUFFER_FROM_STATIC (bench_out));
+    for (size_t i = 0; i < BENCH_SIZE; i++)
+        t2_t_assert (bench_out[i] == " etaoinshrdlu"[(i * 7) % 13]);
+    return 0;
+}
+
+static int test_adler32 (void) {
+    t2_t_assert (t2_z_adler32 (1, NULL, 0) == 1);
+    t2_t_assert (t2_z_adler32 (1, (const uint8_t *) "Wikipedia", 9) == 0x11E60398);
+
+    /* Long enough for the sums to need reducing a few times over. */
+    static uint8_t ff[100000];
+    memset (ff, 0xFF, sizeof (ff));
+    uint32_t adler = t2_z_adler32 (1, ff, 30000);
+    t2_t_assert (t2_z_adler32 (adler, ff + 30000, sizeof (ff) - 30000) == t2_z_adler32 (1, ff, sizeof (ff)));
+
+    return 0;
+}
+
+static int test_zlib_dict (void) {
+    /* From Python's zlib, with zdict set: the start of the message is
+     * all one match, from the dictionary. */
+    static const char dict[] = "{\"method\": \"getUser\", \"params\": {\"id\": ";
+    static const char message[] = "{\"method\": \"getUser\", \"params\": {\"id\": 42}}";
+    uint8_t buf_in[] = { 120, 249, 254, 219, 12, 18, 171, 38, 78, 153, 137, 81, 109, 45, 0, 50, 15, 13, 114 };
+    uint8_t buf_out[256];
+
+    struct t2_z_buffer in = { buf_in, sizeof (buf_in), 0 }, out = { buf_out, sizeof (buf_out), 0 };
+    t2_z_zlib_inflate (&in, &out, (const uint8_t *) dict, strlen (dict));
+    t2_t_assert (in.position == sizeof (buf_in));
+    t2_t_assert (out.position == strlen (message) && memcmp (buf_out, message, out.position) == 0);
+
+    /* The deflate data on its own, with the dictionary passed directly. */
+    in = (struct t2_z_buffer) { buf_in, sizeof (buf_in) - 4, 6 };
+    out = (struct t2_z_buffer) { buf_out, sizeof (buf_out), 0 };
+    t2_z_inflate_dict (&in, &out, (const uint8_t *) dict, strlen (dict));
+    t2_t_assert (out.position == strlen (message) && memcmp (buf_out, message, out.position) == 0);
+
+    return 0;
+}
+
+/* A 343 byte JSON message, compressed by Python's zlib into one dynamic
+ * block, like the ones that go over a message bus. */
+static uint8_t small_message[] = {
+    77, 144, 205, 142, 195, 32, 12, 132, 95, 165, 226, 220, 100, 67, 154, 170, 63, 183, 62, 199, 170, 7, 23, 220,
+    214, 43, 2, 200, 152, 195, 170, 202, 187, 47, 16, 173, 218, 219, 204, 240, 89, 30, 243, 82, 63, 41, 120, 142,
+    70, 157, 55, 106, 236, 7, 181, 221, 40, 178, 197, 76, 7, 173, 139, 158, 81, 158, 161, 122, 21, 216, 34, 167,
+    222, 81, 146, 10, 69, 96, 152, 83, 121, 120, 41, 147, 147, 132, 25, 185, 82, 166, 59, 30, 71, 189, 171, 68,
+    18, 144, 92, 137, 111, 21, 34, 250, 22, 61, 41, 70, 180, 85, 50, 74, 102, 95, 244, 181, 24, 71, 51, 73,
+    33, 247, 67, 49, 119, 66, 103, 215, 57, 106, 168, 4, 1, 87, 133, 201, 204, 232, 205, 111, 211, 140, 32, 104,
+    47, 173, 76, 142, 246, 109, 72, 176, 20, 251, 223, 70, 254, 113, 177, 150, 49, 181, 232, 70, 206, 125, 36, 215,
+    101, 61, 17, 214, 59, 28, 161, 175, 53, 148, 140, 93, 249, 146, 47, 221, 79, 107, 213, 7, 5, 95, 243, 156,
+    58, 132, 36, 157, 110, 181, 24, 12, 214, 244, 116, 215, 102, 132, 219, 1, 247, 118, 55, 153, 1, 212, 178, 252,
+    1,
+};
+enum { SMALL_MESSAGE_SIZE = 343, SMALL_MESSAGE_ADLER32 = 0x2FAA67D4 };
+
+static int bench_inflate_small (size_t n) {
+    uint8_t out[SMALL_MESSAGE_SIZE];
+    for (size_t i = 0; i < n; i++) {
+        struct t2_z_buffer in = { small_message, sizeof (small_message), 0 }, o = { out, sizeof (out), 0 };
+        t2_z_inflate (&in, &o);
+        t2_t_assert (o.position == SMALL_MESSAGE_SIZE);
+    }
+    t2_t_assert (t2_z_adler32 (1, out, sizeof (out)) == SMALL_MESSAGE_ADLER32);
+    return 0;
+}
+
+enum { BATCH_SIZE = 64 };
+
+static int bench_inflate_small_batch (size_t n) {
+    static uint8_t out[BATCH_SIZE][SMALL_MESSAGE_SIZE];
+    struct t2_z_buffer in[BATCH_SIZE], o[BATCH_SIZE];
+    struct t2_z_inflate_context *context = t2_z_inflate_context_new ();
+
+    for (size_t i = 0; i < n; i += BATCH_SIZE) {
+        size_t batch = n - i < BATCH_SIZE ? n - i : BATCH_SIZE;
+        for (size_t j = 0; j < batch; j++) {
+            in[j] = (struct t2_z_buffer) { small_message, sizeof (small_message), 0 };
+            o[j] = (struct t2_z_buffer) { out[j], SMALL_MESSAGE_SIZE, 0 };
+        }
+        t2_z_inflate_batch (context, in, o, batch);
+    }
+
+    t2_z_inflate_context_free (context);
+    t2_t_assert (t2_z_adler32 (1, out[0], SMALL_MESSAGE_SIZE) == SMALL_MESSAGE_ADLER32);
+    return 0;
+}
+
+static int test_inflate_batch (void) {
+    uint8_t out[3][SMALL_MESSAGE_SIZE + 1] = {};
+    uint8_t foo[] = { 75, 203, 207, 7, 0 };
+    struct t2_z_buffer in[3] = {
+        { small_message, sizeof (small_message), 0 },
+        { foo, sizeof (foo), 0 },
+        { small_message, sizeof (small_message), 0 },
+    };
+    struct t2_z_buffer o[3] = {
+        { out[0], sizeof (out[0]), 0 },
+        { out[1], sizeof (out[1]), 0 },
+        { out[2], sizeof (out[2]), 0 },
+    };
+
+    /* Dynamic, fixed, and dynamic again, with the tables left over from
+     * the first message in the context. */
+    struct t2_z_inflate_context *context = t2_z_inflate_context_new ();
+    t2_z_inflate_batch (context, in, o, 3);
+    t2_z_inflate_context_free (context);
+
+    for (int i = 0; i < 3; i++)
+        t2_t_assert (in[i].position == in[i].size);
+    t2_t_assert (o[0].position == SMALL_MESSAGE_SIZE && t2_z_adler32 (1, out[0], SMALL_MESSAGE_SIZE) == SMALL_MESSAGE_ADLER32);
+    t2_t_assert (o[1].position == 3 && memcmp (out[1], "foo", 3) == 0);
+    t2_t_assert (o[2].position == SMALL_MESSAGE_SIZE && memcmp (out[0], out[2], SMALL_MESSAGE_SIZE) == 0);
+
+    return 0;
+}
+
+static void append_chunk (void *data, const uint8_t *chunk, size_t size) {
+    struct t2_z_buffer *out = data;
+    if (out->position + size <= out->size)
+        memcpy (out->data + out->position, chunk, size);
+    out->position += size;
+}
+
+static int test_gzip (void) {
+    /* From Python's gzip: one member with a file name, and another one
+     * after it. */
+    uint8_t buf_in[] = {
+        31, 139, 8, 8, 0, 0, 0, 0, 2, 255, 102, 111, 111, 46, 116, 120, 116, 0, 203, 72, 205, 201, 201, 87, 200, 64,
+        144, 58, 10, 0, 57, 47, 102, 155, 19, 0, 0, 0, 31, 139, 8, 0, 0, 0, 0, 0, 2, 255, 43, 207, 47, 202, 73, 1,
+        0, 67, 17, 119, 58, 5, 0, 0, 0,
+    };
+    const char *expected = "hello hello hello, world";
+    uint8_t buf_out[64];
+    static uint8_t window[T2_Z_INFLATE_WINDOW_SIZE];
+
+    for (int how = 0; how <= 2; how++) {
+        struct t2_z_buffer in = { buf_in, sizeof (buf_in), 0 }, out = { buf_out, sizeof (buf_out), 0 };
+        if (how == 0) {
+            t2_z_gzip_inflate (&in, &out);
+        } else if (how == 1) {
+            t2_z_gzip_inflate_parallel (&in, &out, 0);
+        } else {
+            struct t2_z_buffer w = { window, sizeof (window), 0 };
+            t2_z_gzip_inflate_chunked (&in, &w, append_chunk, &out);
+        }
+        t2_t_assert (in.position == sizeof (buf_in));
+        t2_t_assert (out.position == strlen (expected) && memcmp (buf_out, expected, out.position) == 0);
+    }
+
+    return 0;
+}
+
+static int test_bad_dyn_header (void) {
+    /* A dynamic block with HLIT and HDIST both 31, which is 320 code
+     * lengths, and then runs of op 18 to fill them in. That's past the
+     * end of any table, and has to be turned down. */
+    uint8_t buf_in[] = { 253, 31, 128, 192, 223, 95, 8, 0, 0, 0 };
+    uint8_t buf_out[16];
+    jmp_buf catch;
+
+    struct t2_z_buffer in = { buf_in, sizeof (buf_in), 0 }, out = { buf_out, sizeof (buf_out), 0 };
+    if (setjmp (catch) == 0) {
+        t2_z__catch = &catch;
+        t2_z_inflate (&in, &out);
+        t2_z__catch = NULL;
+        t2_t_assert (!"inflated a bad header");
+    }
+    t2_z__catch = NULL;
+
+    return 0;
+}
+
+static int test_inflate_iov (void) {
+    /* A stored block with "hello ", then the fixed block with "foo" from
+     * test_inflate_batch. */
+    uint8_t buf_in[] = { 0, 6, 0, 0xF9, 0xFF, 'h', 'e', 'l', 'l', 'o', ' ', 75, 203, 207, 7, 0 };
+    uint8_t buf_out[16];
+    struct iovec iov[4];
+
+    struct t2_z_buffer in = { buf_in, sizeof (buf_in), 0 }, out = { buf_out, sizeof (buf_out), 0 };
+    size_t n_iov = t2_z_inflate_iov (&in, &out, iov, 4);
+
+    t2_t_assert (in.position == sizeof (buf_in));
+    t2_t_assert (n_iov == 2);
+    t2_t_assert (iov[0].iov_base == buf_in + 5 && iov[0].iov_len == 6);
+    /* "hello " went into buf_out too, in front of "foo", for matches to
+     * look back at. */
+    t2_t_assert (out.position == 9 && memcmp (buf_out, "hello foo", 9) == 0);
+    t2_t_assert (iov[1].iov_base == buf_out + 6 && iov[1].iov_len == 3);
+
+    return 0;
+}
+
+/* Already compressed data, gzipped anyway: all stored blocks. */
+enum { STORED_BLOCKS = 16, STORED_SIZE = STORED_BLOCKS * 65535 };
+static uint8_t stored_stream[STORED_BLOCKS * (5 + 65535)];
+
+static void make_stored_stream (void) {
+    uint8_t *p = stored_stream;
+    uint32_t x = 1;
+    for (int i = 0; i < STORED_BLOCKS; i++) {
+        *p++ = i == STORED_BLOCKS - 1;
+        *p++ = 0xFF, *p++ = 0xFF, *p++ = 0, *p++ = 0;
+        for (int j = 0; j < 65535; j++)
+            *p++ = (x = x * 1103515245 + 12345) >> 24;
+    }
+}
+
+static int bench_inflate_stored (size_t n) {
+    static uint8_t out[STORED_SIZE];
+    make_stored_stream ();
+    for (size_t i = 0; i < n; i++) {
+        struct t2_z_buffer in = { stored_stream, sizeof (stored_stream), 0 }, o = { out, sizeof (out), 0 };
+        t2_z_inflate (&in, &o);
+        t2_t_assert (o.position == STORED_SIZE);
+    }
+    return 0;
+}
+
+static int bench_inflate_stored_iov (size_t n) {
+    uint8_t out[1];
+    struct iovec iov[STORED_BLOCKS];
+    make_stored_stream ();
+    for (size_t i = 0; i < n; i++) {
+        struct t2_z_buffer in = { stored_stream, sizeof (stored_stream), 0 }, o = { out, sizeof (out), 0 };
+        t2_t_assert (t2_z_inflate_iov (&in, &o, iov, STORED_BLOCKS) == STORED_BLOCKS);
+        t2_t_assert (o.position == 0);
+    }
+    return 0;
+}
+
+static int test_copy_match (void) {
+    uint8_t expect[512], got[512 + 64];
+
+    /* Every kernel this machine can run has to agree with the scalar one,
+     * including when the copy overlaps itself. */
+    for (int level = T2_CPU_SSE42; level <= t2_cpu_level (); level++) {
+        if (!t2_z__copy_match_kernels[level])
+            continue;
+        for (size_t distance = 1; distance < 200; distance += 3) {
+            for (size_t length = 0; length < 300; length += 7) {
+                for (size_t i = 0; i < 200; i++)
+                    expect[i] = got[i] = i * 37 + 11;
+                t2_z__copy_match_scalar (expect + 200, distance, length, 0);
+                t2_z__copy_match_kernels[level] (got + 200, distance, length, sizeof (got) - 200 - length);
+                t2_t_assert (memcmp (expect + 200, got + 200, length) == 0);
+            }
+        }
+    }
+
+    return 0;
+}
+
 static struct t2_t_test tests[] = {
     t2_t_test(test_bitreader),
     t2_t_test(test_inflate),
+    t2_t_test(test_copy_match),
+    t2_t_test(test_adler32),
+    t2_t_test(test_zlib_dict),
+    t2_t_test(test_inflate_batch),
+    t2_t_test(test_gzip),
+    t2_t_test(test_inflate_iov),
+    t2_t_test(test_bad_dyn_header),
+    t2_t_bench(bench_inflate_literals, BENCH_SIZE),
+    t2_t_bench(bench_inflate_small, SMALL_MESSAGE_SIZE),
+    t2_t_bench(bench_inflate_small_batch, SMALL_MESSAGE_SIZE),
+    t2_t_bench(bench_inflate_stored, STORED_SIZE),
+    t2_t_bench(bench_inflate_stored_iov, STORED_SIZE),
     {},
 };
 
@@ -5,47 +5,224 @@
  * I license this work into the public domain. */
 
 #include "t2_json.h"
+#include "t2_cpu.h"
 
 #include <assert.h>
-#include <ctype.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 
-/* Write code-point cp in CESU-8 form into p */
-static int cesu8_write(char *p, uint16_t cp) {
+/* Write code-point cp in UTF-8 form into p */
+static int utf8_write(char *p, uint32_t cp) {
     if      (cp <= 0x007f) { *p++ = cp; return 1; }
     else if (cp <= 0x07ff) { *p++ = (0xc0 | (cp >>  6)); *p++ = (0x80 | (cp & 0x3f)); return 2; }
-    else                   { *p++ = (0xe0 | (cp >> 12)); *p++ = (0x80 | ((cp >> 6) & 0x3f)); *p++ = (0x80 | (cp & 0x3f)); return 3; }
+    else if (cp <= 0xffff) { *p++ = (0xe0 | (cp >> 12)); *p++ = (0x80 | ((cp >> 6) & 0x3f)); *p++ = (0x80 | (cp & 0x3f)); return 3; }
+    else                   { *p++ = (0xf0 | (cp >> 18)); *p++ = (0x80 | ((cp >> 12) & 0x3f)); *p++ = (0x80 | ((cp >> 6) & 0x3f)); *p++ = (0x80 | (cp & 0x3f)); return 4; }
 }
 
-/* Parse a hex digit */
+/* UTF-8 validation, using the lookup tables from Keiser and Lemire's
+ * "Validating UTF-8 In Less Than One Instruction Per Byte". Every byte
+ * is classified by three nibbles: the high and low nibble of the byte
+ * before it, and its own high nibble. Each nibble looks up a set of
+ * errors that it could be part of, and if all three agree, we have an
+ * error. The only thing that can't be seen from a pair of bytes is whether
+ * the third and fourth bytes of a long sequence are continuations, which
+ * is what the TWO_CONTS bit is checked against. */
+enum {
+    U8_TOO_SHORT  = 1 << 0, /* 11______ 0_______, 11______ 11______ */
+    U8_TOO_LONG   = 1 << 1, /* 0_______ 10______ */
+    U8_OVERLONG_3 = 1 << 2, /* 11100000 100_____ */
+    U8_TOO_LARGE  = 1 << 3, /* 11110100 1001____, 11110101+ 1001____ */
+    U8_SURROGATE  = 1 << 4, /* 11101101 101_____ */
+    U8_OVERLONG_2 = 1 << 5, /* 1100000_ 10______ */
+    U8_TOO_LARGE_1000 = 1 << 6, /* 11110101+ 1000____ */
+    U8_OVERLONG_4 = 1 << 6, /* 11110000 1000____ */
+    U8_TWO_CONTS  = 1 << 7, /* 10______ 10______ */
+    U8_CARRY      = U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS,
+};
+
+static const uint8_t utf8_byte_1_high[16] = {
+    U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+    U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+    U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+    U8_TOO_SHORT | U8_OVERLONG_2,
+    U8_TOO_SHORT,
+    U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+    U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+};
+
+static const uint8_t utf8_byte_1_low[16] = {
+    U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+    U8_CARRY | U8_OVERLONG_2,
+    U8_CARRY,
+    U8_CARRY,
+    U8_CARRY | U8_TOO_LARGE,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+    U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+};
+
+static const uint8_t utf8_byte_2_high[16] = {
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE,
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE  | U8_TOO_LARGE,
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE  | U8_TOO_LARGE,
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+};
+
+/* Push byte c through the validator. prev holds the last three bytes seen,
+ * most recent in the low byte. Returns non-zero if c makes the input invalid.
+ * The closing quote needs to be pushed through as well, since that's how
+ * we find out about sequences that are cut short. */
+static inline uint8_t utf8_check(uint32_t *prev, uint8_t c) {
+    uint32_t p = *prev;
+    uint8_t p1 = p, p2 = p >> 8, p3 = p >> 16;
+    *prev = (p << 8) | c;
+
+    /* ASCII following ASCII is always fine. */
+    if ((p1 | c) < 0x80)
+        return 0;
+
+    uint8_t sc = utf8_byte_1_high[p1 >> 4] & utf8_byte_1_low[p1 & 0x0f] & utf8_byte_2_high[c >> 4];
+    uint8_t must23 = (p2 >= 0xe0 || p3 >= 0xf0) ? U8_TWO_CONTS : 0;
+    return sc ^ must23;
+}
+
+/* Parse a hex digit, or return 0xFF if it isn't one */
 static uint8_t dhexd(char c)
 {
     if (c >= '0' && c <= '9') return c - '0';
     if (c >= 'a' && c <= 'f') return c - 'a' + 0x0A;
     if (c >= 'A' && c <= 'F') return c - 'A' + 0x0A;
-    assert(false);
+    return 0xFF;
 }
 
-/* Parse a four-digit hex sequence */
-static uint16_t dhex(char *p)
+/* Parse a four-digit hex sequence, or return -1 if it isn't one */
+static int32_t dhex(char *p)
 {
-    return (dhexd(p[0]) << 12) | (dhexd(p[1]) << 8) | (dhexd(p[2]) << 4) | dhexd(p[3]);
+    uint8_t d0 = dhexd(p[0]), d1 = dhexd(p[1]), d2 = dhexd(p[2]), d3 = dhexd(p[3]);
+    if ((d0 | d1 | d2 | d3) == 0xFF) return -1;
+    return (d0 << 12) | (d1 << 8) | (d2 << 4) | d3;
 }
 
 /* Scanner */
 
-static inline void t2_json__scanner_init(struct t2_json__scanner *j, char *S) { j->S = S; }
+/* Character classes, for the scanner's inner loops. */
+enum {
+    /* JSON whitespace. */
+    CC_SPACE = 1 << 0,
+    /* ASCII that can appear in a string with no special handling;
+     * anything but the quotes, backslash and NUL. */
+    CC_PLAIN = 1 << 1,
+};
+static const uint8_t char_class[256] = {
+    [0x01 ... 0x7f] = CC_PLAIN,
+    [' '] = CC_SPACE | CC_PLAIN, ['\t'] = CC_SPACE | CC_PLAIN,
+    ['\n'] = CC_SPACE | CC_PLAIN, ['\r'] = CC_SPACE | CC_PLAIN,
+    ['"'] = 0, ['\''] = 0, ['\\'] = 0,
+};
+
+/* Finds the end of a run of CC_PLAIN chars starting at S, which is where
+ * a string scanner has to stop and look. This is where most of the time
+ * goes in string-heavy documents, so there's a kernel for each level in
+ * t2_cpu.h. The SIMD ones only ever load whole vectors inside [S, E), and
+ * finish off the tail with the scalar loop. */
+static const char *plain_run_scalar(const char *S, const char *E)
+{
+    while (S < E && (char_class[(uint8_t) *S] & CC_PLAIN))
+        S++;
+    return S;
+}
+
+#if T2_CPU_X86
+__attribute__((target("sse4.2")))
+static const char *plain_run_sse42(const char *S, const char *E)
+{
+    /* Pairs of inclusive ranges: NUL, the quotes, the backslash, and
+     * everything with the high bit set. */
+    const __m128i ranges = _mm_setr_epi8(0, 0, '"', '"', '\'', '\'', '\\', '\\', (char) 0x80, (char) 0xff, 0, 0, 0, 0, 0, 0);
+    for (; E - S >= 16; S += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) S);
+        int i = _mm_cmpestri(ranges, 10, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (i < 16)
+            return S + i;
+    }
+    return plain_run_scalar(S, E);
+}
 
-static inline char  pk    (struct t2_json__scanner *j, int L) { return j->S[L]; }
-static inline char  hd    (struct t2_json__scanner *j) { return j->S[0]; }
+__attribute__((target("avx2")))
+static const char *plain_run_avx2(const char *S, const char *E)
+{
+    for (; E - S >= 32; S += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) S);
+        __m256i special = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\''))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')), _mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+        /* The sign bit catches everything non-ASCII. */
+        uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(special, v));
+        if (mask)
+            return S + __builtin_ctz(mask);
+    }
+    return plain_run_scalar(S, E);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static const char *plain_run_avx512(const char *S, const char *E)
+{
+    while (S < E) {
+        /* Masked loads don't fault past the mask, so the tail needs no
+         * special handling. Masked-off bytes load as NUL, which stops us. */
+        size_t n = E - S;
+        __mmask64 valid = n >= 64 ? ~(__mmask64) 0 : ((__mmask64) 1 << n) - 1;
+        __m512i v = _mm512_maskz_loadu_epi8(valid, S);
+        __mmask64 mask = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('"'))
+                       | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\''))
+                       | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\\'))
+                       | _mm512_cmpeq_epi8_mask(v, _mm512_setzero_si512())
+                       | _mm512_movepi8_mask(v);
+        if (mask) {
+            const char *P = S + __builtin_ctzll(mask);
+            return P < E ? P : E;
+        }
+        S += 64;
+    }
+    return E;
+}
+#endif /* T2_CPU_X86 */
+
+static const char *(*const plain_run_kernels[T2_CPU_N_LEVELS])(const char *S, const char *E) = {
+    plain_run_scalar, T2_CPU_X86_ONLY(plain_run_sse42, plain_run_avx2, plain_run_avx512)
+};
+
+static const char *plain_run(const char *S, const char *E)
+{
+    const char *(*fn)(const char *S, const char *E);
+    T2_CPU_DISPATCH(fn, plain_run_kernels);
+    return fn(S, E);
+}
+
+static inline void t2_json__scanner_init(struct t2_json__scanner *j, char *S, size_t n) { j->S = S; j->E = S + n; }
+
+/* Reading past the end of the input reads NUL. */
+static inline size_t left  (struct t2_json__scanner *j) { return j->E - j->S; }
+static inline char  pk    (struct t2_json__scanner *j, int L) { return j->S + L < j->E ? j->S[L] : '\0'; }
+static inline char  hd    (struct t2_json__scanner *j) { return j->S < j->E ? j->S[0] : '\0'; }
 static inline void  adv   (struct t2_json__scanner *j) { ++j->S; }
 static inline void  advn  (struct t2_json__scanner *j, int n) { j->S += n; }
-static inline void  sync  (struct t2_json__scanner *j) { while (isblank(hd(j))) adv(j); }
-static inline bool  match (struct t2_json__scanner *j, char *S) { return strcmp(j->S, S); }
+static inline void  skip_ws(struct t2_json__scanner *j) { while (char_class[(uint8_t) hd(j)] & CC_SPACE) adv(j); }
 static inline bool  breq  (struct t2_json__scanner *j, char c) {
-    sync(j);
+    skip_ws(j);
     if (hd(j) == c) {
         adv(j);
         return true;
@@ -57,127 +234,294 @@ static inline bool  breq  (struct t2_json__scanner *j, char c) {
     }
 }
 
-/* t2_json_type, with the addition of the chars }]:, is our collection of tokens */
+/* t2_json_type, with the addition of the chars }]:, is our collection of tokens.
+ * Every token but the keywords can be told from its first char. */
+enum { TOK_KEYWORD = 0xFF };
+static const uint8_t tok_class[256] = {
+    ['\0'] = T2_JSON_END,
+    ['"'] = T2_JSON_STRING, ['\''] = T2_JSON_STRING,
+    ['0' ... '9'] = T2_JSON_NUMBER, ['-'] = T2_JSON_NUMBER,
+    ['['] = '[', ['{'] = '{', [']'] = ']', ['}'] = '}', [':'] = ':', [','] = ',',
+    ['f'] = TOK_KEYWORD, ['t'] = TOK_KEYWORD, ['n'] = TOK_KEYWORD,
+    /* Everything else is T2_JSON_ERROR, which is 0. */
+};
+
+/* Keywords are compared as a single 4-byte word. */
+static inline uint32_t word(const char *S) { uint32_t w; memcpy(&w, S, sizeof(w)); return w; }
+
 static enum t2_json_type tok(struct t2_json__scanner *j)
 {
-    sync(j);
-
-    switch (hd(j)) {
-    case '\0':
-        return T2_JSON_END;
-    case '"':
-    case '\'':
-        return T2_JSON_STRING;
-    case '0':
-    case '1':
-    case '2':
-    case '3':
-    case '4':
-    case '5':
-    case '6':
-    case '7':
-    case '8':
-    case '9':
-    case '-':
-        return T2_JSON_NUMBER;
-    case '[':
-    case '{':
-    case ']':
-    case '}':
-    case ':':
-    case ',':
-        return (enum t2_json_type) hd(j);
-    default:
-        break;
-    }
-
-    if (match(j, "false")) return T2_JSON_FALSE;
-    if (match(j, "true"))  return T2_JSON_TRUE;
-    if (match(j, "null"))  return T2_JSON_NULL;
+    skip_ws(j);
+
+    uint8_t t = tok_class[(uint8_t) hd(j)];
+    if (t != TOK_KEYWORD)
+        return (enum t2_json_type) t;
+
+    if (left(j) < 4)
+        return T2_JSON_ERROR;
+
+    uint32_t w = word(j->S);
+    if (w == word("true")) return T2_JSON_TRUE;
+    if (w == word("null")) return T2_JSON_NULL;
+    if (w == word("fals") && pk(j, 4) == 'e') return T2_JSON_FALSE;
 
     return T2_JSON_ERROR;
 }
 
-static void chomp_string(struct t2_json__scanner *j)
+/* Reads a \uXXXX escape at the cursor, combining surrogate pairs into a
+ * single code point. Leaves the cursor on the last hex digit. Returns
+ * (uint32_t) -1 for a lone surrogate. */
+static uint32_t get_escaped_code_point(struct t2_json__scanner *j)
+{
+    if (left(j) < 6)
+        return (uint32_t) -1;
+    int32_t cp = dhex(j->S+2);
+    advn(j, 5);
+
+    if (cp < 0 || (cp >= 0xdc00 && cp <= 0xdfff))
+        return (uint32_t) -1;
+
+    if (cp >= 0xd800 && cp <= 0xdbff) {
+        if (left(j) < 7 || pk(j, 1) != '\\' || pk(j, 2) != 'u')
+            return (uint32_t) -1;
+        int32_t lo = dhex(j->S+3);
+        if (lo < 0xdc00 || lo > 0xdfff)
+            return (uint32_t) -1;
+        advn(j, 6);
+        cp = 0x10000 + (((cp - 0xd800) << 10) | (lo - 0xdc00));
+    }
+
+    return cp;
+}
+
+/* Skips over the current string, validating it as we go.
+ * Returns false if the string is unterminated, has a bad escape, or is
+ * not valid UTF-8, just as get_string would. */
+static bool chomp_string(struct t2_json__scanner *j)
 {
-    sync(j);
+    skip_ws(j);
 
     char delim = hd(j);
-    while (hd(j) != '\0') {
+    uint32_t u8 = 0;
+    uint8_t err = 0;
+    while (true) {
         adv(j);
 
-        if (hd(j) == delim) {
+        /* Plain ASCII following ASCII can't be a UTF-8 error, and it can't
+         * end the string, so runs of it are skipped without looking twice. */
+        if (!(u8 & 0x80))
+            j->S = (char *) plain_run(j->S, j->E);
+
+        char c = hd(j);
+        if (c == '\0')
+            return false;
+
+        err |= utf8_check(&u8, c);
+
+        if (c == delim) {
             adv(j);
             break;
         }
 
-        if (hd(j) == '\\')
-            adv(j);
+        if (c == '\\') {
+            switch (pk(j, 1)) {
+            case '"': case '\'': case '\\': case '/':
+            case 'b': case 'f': case 'n': case 'r': case 't':
+                adv(j);
+                break;
+            case 'u':
+                /* Leaves us on the last digit. */
+                if (get_escaped_code_point(j) == (uint32_t) -1)
+                    return false;
+                break;
+            default:
+                return false;
+            }
+        }
     }
+    return err == 0;
 }
 
-static char *get_string(struct t2_json__scanner *j, char *V, int Vl)
+/* Decodes the current string into V, truncating it if it doesn't fit.
+ * The whole string is always consumed. Returns false if the string is
+ * unterminated, has a bad escape, or is not valid UTF-8. */
+static bool get_string(struct t2_json__scanner *j, char *V, int Vl)
 {
-    sync(j);
+    skip_ws(j);
 
     char delim = hd(j);
+    uint32_t u8 = 0;
+    uint8_t err = 0;
 
-    int i = 0;
-    for (i = 0; i < Vl - 1;) {
+    /* Each character is decoded into tmp first, so that truncation
+     * never splits a multi-byte sequence. */
+    char tmp[4];
+    int i = 0, n;
+    while (true) {
         adv(j);
 
-        if (hd(j) == delim) {
+        /* As in chomp_string, but runs of plain ASCII are copied out in
+         * one go. */
+        if (!(u8 & 0x80)) {
+            char *run = j->S;
+            j->S = (char *) plain_run(j->S, j->E);
+            int m = j->S - run;
+            if (m > Vl - 1 - i)
+                m = Vl - 1 - i > 0 ? Vl - 1 - i : 0;
+            memcpy(&V[i], run, m);
+            i += m;
+        }
+
+        char c = hd(j);
+        if (c == '\0')
+            return false;
+
+        err |= utf8_check(&u8, c);
+
+        if (c == delim) {
             adv(j);
             break;
         }
 
-        if (hd(j) == '\\') {
+        if (c == '\\') {
             switch (pk(j, 1)) {
-            case '"':  V[i++] = '"';  break;
-            case '\'': V[i++] = '\''; break;
-            case '\\': V[i++] = '\\'; break;
-            case 'b':  V[i++] = '\b'; break;
-            case 'f':  V[i++] = '\f'; break;
-            case 'n':  V[i++] = '\n'; break;
-            case 'r':  V[i++] = '\r'; break;
-            case 't':  V[i++] = '\t'; break;
+            case '"':  tmp[0] = '"';  n = 1; break;
+            case '\'': tmp[0] = '\''; n = 1; break;
+            case '\\': tmp[0] = '\\'; n = 1; break;
+            case '/':  tmp[0] = '/';  n = 1; break;
+            case 'b':  tmp[0] = '\b'; n = 1; break;
+            case 'f':  tmp[0] = '\f'; n = 1; break;
+            case 'n':  tmp[0] = '\n'; n = 1; break;
+            case 'r':  tmp[0] = '\r'; n = 1; break;
+            case 't':  tmp[0] = '\t'; n = 1; break;
             case 'u': {
-                uint16_t cp = dhex(j->S+2);
-                i += cesu8_write(&V[i], cp);
-                advn(j, 4);
-                break;
+                uint32_t cp = get_escaped_code_point(j);
+                if (cp == (uint32_t) -1)
+                    return false;
+                n = utf8_write(tmp, cp);
+                /* get_escaped_code_point left us on the last digit. */
+                goto write;
             }
+            default:
+                return false;
             }
             adv(j);
         } else {
-            V[i++] = hd(j);
+            tmp[0] = c; n = 1;
+        }
+
+    write:
+        if (i + n < Vl) {
+            memcpy(&V[i], tmp, n);
+            i += n;
         }
     }
-    V[i] = '\0';
-    return V;
+    if (Vl > 0)
+        V[i] = '\0';
+    return err == 0;
 }
 
-static double chomp_number(struct t2_json__scanner *j)
+/* Reads the current number into *d. Returns false if it was too long
+ * for the stack and there was no memory to copy it out to. */
+static bool chomp_number(struct t2_json__scanner *j, double *d)
 {
-    sync(j);
-    /* XXX: We should at least verify the number ourselves
-     * so we don't parse hexadecimals and such. */
-    return strtod(j->S, &j->S);
+    skip_ws(j);
+
+    /* strtod wants a NUL-terminated string, and the input might not
+     * have one, so copy the number out first. This also keeps strtod
+     * from parsing hexadecimals and such. Numbers too long for the
+     * stack buffer, like 100-digit integers, go on the heap. */
+    char stack_buf[64], *buf = stack_buf, *end, c;
+    size_t n = 0;
+    while ((c = pk(j, n)) != '\0' && strchr("0123456789+-.eE", c))
+        n++;
+    if (n >= sizeof(stack_buf) && !(buf = T2_JSON_REALLOC(NULL, n + 1)))
+        return false;
+    for (size_t i = 0; i < n; i++)
+        buf[i] = pk(j, i);
+    buf[n] = '\0';
+
+    *d = strtod(buf, &end);
+    advn(j, end - buf);
+    if (buf != stack_buf)
+        T2_JSON_FREE(buf);
+    return true;
 }
 
 static void jreq(t2_json_t *j, char c) { if (!breq(&j->s, c)) j->e = true; }
 
-void t2_json_init(t2_json_t *j, char *S) { memset(j, 0, sizeof(*j)); t2_json__scanner_init(&j->s, S); }
+void t2_json_init(t2_json_t *j, char *S) { t2_json_init_n(j, S, strlen(S)); }
+void t2_json_init_n(t2_json_t *j, char *S, size_t n) { memset(j, 0, sizeof(*j)); t2_json__scanner_init(&j->s, S, n); }
 
 enum t2_json_type t2_json_get_type(t2_json_t *j) { if (j->e) return T2_JSON_ERROR; return tok(&j->s); }
 bool t2_json_has_error(t2_json_t *j) { return t2_json_get_type(j) == T2_JSON_ERROR; }
 
-char *t2_json_save(t2_json_t *j) { j->r.s[j->r.n++] = j->s; return j->s.S; }
-char *t2_json_restore(t2_json_t *j) { j->s = j->r.s[--j->r.n]; return j->r.s[j->r.n+1].S; }
+void t2_json_fini(t2_json_t *j) { if (j->r.owned) T2_JSON_FREE(j->r.s); j->r.s = NULL; j->r.owned = false; }
+
+void t2_json_set_save_stack(t2_json_t *j, void *buf, size_t size) {
+    assert(j->r.n == 0);
+    t2_json_fini(j);
+    /* Too small to hold anything, so stay on the inline stack. */
+    if (size < sizeof(struct t2_json__scanner))
+        return;
+    j->r.s = buf;
+    j->r.len = size / sizeof(struct t2_json__scanner);
+}
+
+void t2_json_set_max_depth(t2_json_t *j, int max) { j->r.max = max; }
 
-double t2_json_get_number(t2_json_t *j) { return chomp_number(&j->s); }
+static struct t2_json__scanner *save_stack(t2_json_t *j) { return j->r.s ? j->r.s : j->r.inline_s; }
+static int save_stack_len(t2_json_t *j) { return j->r.s ? j->r.len : T2_JSON__T_STACK_LENGTH; }
 
-char *t2_json_get_string(t2_json_t *j, char *buf, int len) { return get_string(&j->s, buf, len); }
+static bool grow_save_stack(t2_json_t *j) {
+    int len = save_stack_len(j) * 2;
+    if (j->r.max && len > j->r.max)
+        len = j->r.max;
+
+    struct t2_json__scanner *s = T2_JSON_REALLOC(j->r.owned ? j->r.s : NULL, len * sizeof(*s));
+    if (!s)
+        return false;
+    if (!j->r.owned)
+        memcpy(s, save_stack(j), j->r.n * sizeof(*s));
+
+    j->r.s = s;
+    j->r.len = len;
+    j->r.owned = true;
+    return true;
+}
+
+char *t2_json_save(t2_json_t *j) {
+    if ((j->r.max && j->r.n == j->r.max) || (j->r.n == save_stack_len(j) && !grow_save_stack(j))) {
+        j->e = true;
+        return NULL;
+    }
+    save_stack(j)[j->r.n++] = j->s;
+    return j->s.S;
+}
+char *t2_json_restore(t2_json_t *j) {
+    if (j->r.n == 0) {
+        j->e = true;
+        return NULL;
+    }
+    char *S = j->s.S;
+    j->s = save_stack(j)[--j->r.n];
+    return S;
+}
+
+double t2_json_get_number(t2_json_t *j) {
+    double d = 0;
+    if (!chomp_number(&j->s, &d))
+        j->e = true;
+    return d;
+}
+
+char *t2_json_get_string(t2_json_t *j, char *buf, int len) {
+    if (!get_string(&j->s, buf, len)) {
+        j->e = true;
+        return NULL;
+    }
+    return buf;
+}
 
 int t2_json_string_len(t2_json_t *j) {
     char *S = t2_json_save(j);
@@ -212,7 +556,8 @@ bool t2_json_find_object_child(t2_json_t *j, char *key) {
     assert(strlen(key) < sizeof(kbuf));
 
     while (true) {
-        get_string(&j->s, kbuf, sizeof(kbuf));
+        if (!t2_json_get_string(j, kbuf, sizeof(kbuf)))
+            return false;
         t2_json_read_key(j);
         if (strncmp(key, kbuf, sizeof(kbuf)) == 0)
             return true;
@@ -224,12 +569,12 @@ bool t2_json_find_object_child(t2_json_t *j, char *key) {
     return false;
 }
 
-static void skip_string(t2_json_t *j)  { chomp_string(&j->s); }
-static void skip_number(t2_json_t *j)  { chomp_number(&j->s); }
+static void skip_string(t2_json_t *j)  { if (!chomp_string(&j->s)) j->e = true; }
+static void skip_number(t2_json_t *j)  { double d; if (!chomp_number(&j->s, &d)) j->e = true; }
 
 static void skip_array(t2_json_t *j) {
     t2_json_enter_array(j);
-    while (true) {
+    while (t2_json_get_type(j) != ']') {
         t2_json_skip(j);
         if (t2_json_has_next_value(j))
             adv(&j->s);
@@ -240,7 +585,7 @@ static void skip_array(t2_json_t *j) {
 }
 static void skip_object(t2_json_t *j) {
     t2_json_enter_object(j);
-    while (true) {
+    while (t2_json_get_type(j) != '}') {
         t2_json_skip(j);
         jreq(j, ':');
         t2_json_skip(j);
@@ -265,6 +610,285 @@ void t2_json_skip(t2_json_t *j) {
     }
 }
 
+/* Struct binding */
+
+/* FNV-1a, with the offset basis replaced by a seed that
+ * t2_json_schema_init picks so that no two keys share a slot. The table
+ * uses four slots per field. */
+static uint32_t schema_slot(const struct t2_json_schema *schema, uint32_t seed, const char *key, size_t len) {
+    uint32_t h = seed;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t) key[i]) * 16777619;
+    return h % (schema->n * 4);
+}
+
+bool t2_json_schema_init(struct t2_json_schema *schema) {
+    memset(schema->slots, 0, sizeof(schema->slots));
+    if (schema->n > T2_JSON_SCHEMA_MAX_FIELDS)
+        return false;
+
+    /* No seed would ever separate two fields with the same key. */
+    for (int i = 0; i < schema->n; i++)
+        for (int k = 0; k < i; k++)
+            if (strcmp(schema->fields[i].key, schema->fields[k].key) == 0)
+                return false;
+
+    for (uint32_t seed = 2166136261u; ; seed++) {
+        /* With four slots per field, this many tries has never yet been
+         * needed, but don't spin forever if it is. */
+        if (seed - 2166136261u == 65536) {
+            memset(schema->slots, 0, sizeof(schema->slots));
+            return false;
+        }
+        memset(schema->slots, 0, sizeof(schema->slots));
+
+        int i;
+        for (i = 0; i < schema->n; i++) {
+            const char *key = schema->fields[i].key;
+            uint32_t slot = schema_slot(schema, seed, key, strlen(key));
+            if (schema->slots[slot])
+                break;
+            schema->slots[slot] = i + 1;
+        }
+
+        if (i == schema->n) {
+            schema->seed = seed;
+            break;
+        }
+    }
+
+    for (int i = 0; i < schema->n; i++) {
+        const struct t2_json_field *field = &schema->fields[i];
+        /* Catches a field declared with the wrong type for its member. */
+        assert(field->type != T2_JSON_FIELD_NUMBER || field->size == sizeof(double));
+        assert(field->type != T2_JSON_FIELD_INT || field->size == sizeof(int));
+        assert(field->type != T2_JSON_FIELD_BOOL || field->size == sizeof(bool));
+        if (field->type == T2_JSON_FIELD_OBJECT && !t2_json_schema_init(field->schema))
+            return false;
+    }
+    return true;
+}
+
+static const struct t2_json_field *schema_lookup(const struct t2_json_schema *schema, const char *key) {
+    if (schema->n == 0 || schema->n > T2_JSON_SCHEMA_MAX_FIELDS)
+        return NULL;
+    size_t len = strlen(key);
+    uint8_t idx = schema->slots[schema_slot(schema, schema->seed, key, len)];
+    if (idx == 0)
+        return NULL;
+    const struct t2_json_field *field = &schema->fields[idx - 1];
+    return strcmp(field->key, key) == 0 ? field : NULL;
+}
+
+/* Returns whether the value was stored. */
+static bool bind_value(t2_json_t *j, const struct t2_json_field *field, char *out) {
+    enum t2_json_type type = t2_json_get_type(j);
+
+    switch (field->type) {
+    case T2_JSON_FIELD_STRING:
+        if (type != T2_JSON_STRING) break;
+        return t2_json_get_string(j, out, field->size) != NULL;
+    case T2_JSON_FIELD_NUMBER:
+        if (type != T2_JSON_NUMBER) break;
+        *(double *) out = t2_json_get_number(j);
+        return true;
+    case T2_JSON_FIELD_INT: {
+        if (type != T2_JSON_NUMBER) break;
+        /* Converting a double that doesn't fit is undefined, so that's
+         * an error rather than a skip. */
+        double d = t2_json_get_number(j);
+        if (!(d > (double) INT_MIN - 1 && d < (double) INT_MAX + 1)) {
+            j->e = true;
+            return false;
+        }
+        *(int *) out = d;
+        return true;
+    }
+    case T2_JSON_FIELD_BOOL:
+        if (type != T2_JSON_TRUE && type != T2_JSON_FALSE) break;
+        *(bool *) out = (type == T2_JSON_TRUE);
+        t2_json_skip(j);
+        return true;
+    case T2_JSON_FIELD_OBJECT:
+        if (type != T2_JSON_OBJECT) break;
+        t2_json_bind_object(j, field->schema, out);
+        return !j->e;
+    }
+
+    t2_json_skip(j);
+    return false;
+}
+
+uint32_t t2_json_bind_object(t2_json_t *j, const struct t2_json_schema *schema, void *out) {
+    char kbuf[T2_JSON_STATIC_BUFFER_LENGTH];
+    uint32_t found = 0;
+
+    t2_json_enter_object(j);
+    if (t2_json_get_type(j) == '}') {
+        t2_json_leave_object(j);
+        return found;
+    }
+
+    while (true) {
+        if (!t2_json_get_string(j, kbuf, sizeof(kbuf)))
+            return found;
+        t2_json_read_key(j);
+
+        const struct t2_json_field *field = schema_lookup(schema, kbuf);
+        if (field) {
+            if (bind_value(j, field, (char *) out + field->offset))
+                found |= 1u << (field - schema->fields);
+        } else {
+            t2_json_skip(j);
+        }
+
+        if (j->e || !t2_json_has_next_value(j))
+            break;
+        t2_json_next_value(j);
+    }
+    t2_json_leave_object(j);
+    return found;
+}
+
+/* Streams of values */
+
+void t2_json_stream_init(struct t2_json_stream *s, char *buf, size_t size) {
+    memset(s, 0, sizeof(*s));
+    s->buf = buf;
+    s->size = size;
+}
+
+void t2_json_stream_feed(struct t2_json_stream *s, char *chunk, size_t n) {
+    s->S = s->V = chunk;
+    s->E = chunk + n;
+    s->end = chunk == NULL;
+}
+
+bool t2_json_stream_has_error(struct t2_json_stream *s) { return s->e; }
+
+/* Carries on through the current value, and returns whether it got to
+ * the end of it. Numbers and keywords end at whatever comes after them.
+ * Inside something, only quotes and brackets matter, so everything else
+ * is skipped over. Records are mostly short strings, with a quote every
+ * few chars, so that's a plain loop; SIMD doesn't get going in time. */
+static const uint8_t stream_class[256] = {
+    ['"'] = 1, ['\''] = 1, ['\\'] = 1, ['['] = 1, ['{'] = 1, [']'] = 1, ['}'] = 1,
+};
+
+static bool stream_scan(struct t2_json_stream *s)
+{
+    char *S = s->S, *E = s->E;
+    bool done = false;
+
+    while (S < E && !done) {
+        if (s->escape) {
+            s->escape = false;
+            S++;
+            continue;
+        }
+        if (s->quote || s->depth > 0) {
+            while (S < E && !stream_class[(uint8_t) *S])
+                S++;
+            if (S == E)
+                break;
+        }
+
+        char c = *S++;
+        if (s->quote) {
+            if (c == '\\')
+                s->escape = true;
+            else if (c == s->quote)
+                s->quote = 0, done = s->depth == 0;
+        } else if (c == '"' || c == '\'') {
+            s->quote = c;
+        } else if (c == '[' || c == '{') {
+            s->depth++;
+        } else if (c == ']' || c == '}') {
+            if (s->depth == 0)
+                S--, done = true;
+            else
+                done = --s->depth == 0;
+        } else if (s->depth == 0 && (c == ',' || (char_class[(uint8_t) c] & CC_SPACE))) {
+            S--, done = true;
+        }
+    }
+
+    s->S = S;
+    return done;
+}
+
+static bool stream_carry(struct t2_json_stream *s, char *S, char *E) {
+    if (S == E)
+        return true;
+    if (s->len + (E - S) > s->size)
+        return false;
+    memcpy(s->buf + s->len, S, E - S);
+    s->len += E - S;
+    return true;
+}
+
+bool t2_json_stream_next(struct t2_json_stream *s, t2_json_t *j)
+{
+    while (!s->e) {
+        if (!s->in_value) {
+            /* Find where the next one starts. */
+            while (s->S < s->E && ((char_class[(uint8_t) *s->S] & CC_SPACE) || (s->mode == T2_JSON__STREAM_ARRAY && *s->S == ',')))
+                s->S++;
+            if (s->S == s->E) {
+                if (s->end && s->mode == T2_JSON__STREAM_ARRAY)
+                    s->e = true;
+                return false;
+            }
+
+            char c = *s->S;
+            if (s->mode == T2_JSON__STREAM_START) {
+                s->mode = c == '[' ? T2_JSON__STREAM_ARRAY : T2_JSON__STREAM_VALUES;
+                if (c == '[') {
+                    s->S++;
+                    continue;
+                }
+            }
+            if (s->mode == T2_JSON__STREAM_ARRAY && c == ']') {
+                s->mode = T2_JSON__STREAM_DONE;
+                s->S++;
+                continue;
+            }
+            if (s->mode == T2_JSON__STREAM_DONE || c == ']' || c == '}' || c == ',') {
+                s->e = true;
+                return false;
+            }
+
+            s->in_value = true;
+            s->V = s->S;
+            s->len = 0;
+        }
+
+        /* At the end, a number or keyword just ends. */
+        bool done = stream_scan(s);
+        if (!done && s->end && !s->quote && s->depth == 0 && s->len)
+            done = true;
+
+        if (done) {
+            s->in_value = false;
+            if (s->len == 0) {
+                t2_json_init_n(j, s->V, s->S - s->V);
+            } else {
+                if (!stream_carry(s, s->V, s->S))
+                    break;
+                t2_json_init_n(j, s->buf, s->len);
+            }
+            return true;
+        }
+
+        if (s->end || !stream_carry(s, s->V, s->E))
+            break;
+        return false;
+    }
+
+    s->e = true;
+    return false;
+}
+
 #if T2_JSON_PRINT_VALUE
 #include <stdio.h>
 
@@ -272,7 +896,7 @@ static void print_value(t2_json_t *j);
 
 static void print_array(t2_json_t *j) {
     t2_json_enter_array(j); printf("[");
-    while (true) {
+    while (t2_json_get_type(j) != ']') {
         print_value(j);
         if (!t2_json_has_next_value(j)) break;
         t2_json_next_value(j); printf(", ");
@@ -281,7 +905,7 @@ static void print_array(t2_json_t *j) {
 }
 static void print_object(t2_json_t *j) {
     t2_json_enter_object(j); printf("{");
-    while (true) {
+    while (t2_json_get_type(j) != '}') {
         print_value(j);
         t2_json_read_key(j); printf(": ");
         print_value(j);
@@ -300,7 +924,7 @@ static void print_value(t2_json_t *j) {
     case T2_JSON_ARRAY:  print_array(j); break;
     case T2_JSON_OBJECT: print_object(j); break;
     case T2_JSON_NUMBER: printf("%g", t2_json_get_number(j)); break;
-    case T2_JSON_STRING: printf("\"%s\"", t2_json_get_string(j, strbuf, sizeof(strbuf))); break;
+    case T2_JSON_STRING: printf("\"%s\"", t2_json_get_string(j, strbuf, sizeof(strbuf)) ? strbuf : "ERROR"); break;
     case T2_JSON_ERROR:  printf("ERROR"); break;
     default:         printf("UNK"); break;
     }
@@ -342,4 +966,505 @@ int main(int argc, char *argv[])
     return 0;
 }
 
-#endif
\ No newline at end of file
+#endif
+#if T2_RUN_TESTS
+#include "t2_tests.h"
+
+static int test_escapes(void)
+{
+    char buf[32];
+    t2_json_t _j, *j = &_j;
+
+    t2_json_init(j, "\"\\u20AC\\ud83d\\ude00\\n\"");
+    t2_t_assert(t2_json_get_string(j, buf, sizeof(buf)) != NULL);
+    t2_t_assert(strcmp(buf, "\xE2\x82\xAC\xF0\x9F\x98\x80\n") == 0);
+    t2_t_assert(t2_json_get_type(j) == T2_JSON_END);
+
+    /* Lone surrogates can't be represented in UTF-8. */
+    t2_json_init(j, "\"\\ud83d\"");
+    t2_t_assert(t2_json_get_string(j, buf, sizeof(buf)) == NULL);
+    t2_t_assert(t2_json_has_error(j));
+
+    t2_json_init(j, "\"\\ude00\\ud83d\"");
+    t2_t_assert(t2_json_get_string(j, buf, sizeof(buf)) == NULL);
+
+    /* Skipping a string checks its escapes just as reading it does. */
+    static const char *bad[] = {
+        "\"\\x\"", "\"\\u12\"", "\"\\uZZZZ\"", "\"\\ud83d\"", "\"\\ud83d\\n\"", "\"\\\xC3\xA9\"",
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(*bad); i++) {
+        t2_json_init(j, (char *) bad[i]);
+        t2_t_assert(t2_json_get_string(j, buf, sizeof(buf)) == NULL);
+        t2_json_init(j, (char *) bad[i]);
+        t2_json_skip(j);
+        t2_t_assert(t2_json_has_error(j));
+    }
+
+    t2_json_init(j, "[\"\\u20AC\\ud83d\\ude00\\\"\\/\\b\\f\\n\\r\\t\\\\\", 1]");
+    t2_json_skip(j);
+    t2_t_assert(!t2_json_has_error(j));
+    t2_t_assert(t2_json_get_type(j) == T2_JSON_END);
+
+    return 0;
+}
+
+static int test_truncation(void)
+{
+    char buf[4];
+    t2_json_t _j, *j = &_j;
+
+    /* Truncation never splits a sequence, and always consumes the whole string. */
+    t2_json_init(j, "[\"ab\\u20AC\", 1]");
+    t2_json_enter_array(j);
+    t2_t_assert(t2_json_get_string(j, buf, sizeof(buf)) != NULL);
+    t2_t_assert(strcmp(buf, "ab") == 0);
+    t2_t_assert(t2_json_has_next_value(j));
+
+    return 0;
+}
+
+static int test_long_number(void)
+{
+    char doc[128];
+    t2_json_t _j, *j = &_j;
+
+    /* 1 followed by 99 zeroes, all of which count. */
+    doc[0] = '[';
+    doc[1] = '1';
+    memset(doc + 2, '0', 99);
+    strcpy(doc + 101, ", 2]");
+
+    t2_json_init(j, doc);
+    t2_json_enter_array(j);
+    t2_t_assert(t2_json_get_number(j) == 1e99);
+    t2_t_assert(t2_json_has_next_value(j));
+    t2_json_next_value(j);
+    t2_t_assert(t2_json_get_number(j) == 2);
+    t2_t_assert(!t2_json_has_next_value(j));
+    t2_t_assert(!t2_json_has_error(j));
+
+    t2_json_init(j, doc);
+    t2_json_skip(j);
+    t2_t_assert(t2_json_get_type(j) == T2_JSON_END);
+
+    return 0;
+}
+
+static int test_utf8_validation(void)
+{
+    static const char *valid[] = {
+        "\"h\xC3\xA9llo\"",
+        "\"\xE2\x82\xAC\"",
+        "\"\xF0\x9F\x98\x80\"",
+        "\"\xF4\x8F\xBF\xBF\"",
+        "\"\xEF\xBF\xBF\\n\"",
+    };
+    static const char *invalid[] = {
+        "\"\x80\"",                /* stray continuation */
+        "\"\xC0\xAF\"",            /* overlong 2-byte */
+        "\"\xE0\x80\xAF\"",        /* overlong 3-byte */
+        "\"\xF0\x80\x80\xAF\"",    /* overlong 4-byte */
+        "\"\xED\xA0\x80\"",        /* surrogate */
+        "\"\xF4\x90\x80\x80\"",    /* above U+10FFFF */
+        "\"\xE2\x82\"",            /* cut short by the quote */
+        "\"\xE2\x82\\n\"",         /* cut short by an escape */
+        "\"\xF0\x9F\x98\xE2\x82\xAC\"",
+        "\"\xFF\"",
+    };
+    char buf[32];
+    t2_json_t _j, *j = &_j;
+
+    for (size_t i = 0; i < sizeof(valid) / sizeof(*valid); i++) {
+        t2_json_init(j, (char *) valid[i]);
+        t2_t_assert(t2_json_get_string(j, buf, sizeof(buf)) != NULL);
+        t2_json_init(j, (char *) valid[i]);
+        t2_json_skip(j);
+        t2_t_assert(t2_json_get_type(j) == T2_JSON_END);
+    }
+
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(*invalid); i++) {
+        t2_json_init(j, (char *) invalid[i]);
+        t2_t_assert(t2_json_get_string(j, buf, sizeof(buf)) == NULL);
+        t2_json_init(j, (char *) invalid[i]);
+        t2_json_skip(j);
+        t2_t_assert(t2_json_has_error(j));
+    }
+
+    return 0;
+}
+
+static int test_bounded_input(void)
+{
+    char buf[32];
+    t2_json_t _j, *j = &_j;
+
+    /* A slice out of the middle of a larger buffer, with no NUL after it. */
+    char doc[] = "[1, \"ab\", true] [12345, \"cdef\", truex";
+
+    t2_json_init_n(j, doc, 16);
+    t2_json_enter_array(j);
+    t2_t_assert(t2_json_get_number(j) == 1);
+    t2_json_next_value(j);
+    t2_t_assert(strcmp(t2_json_get_string(j, buf, sizeof(buf)), "ab") == 0);
+    t2_json_next_value(j);
+    t2_t_assert(t2_json_get_type(j) == T2_JSON_TRUE);
+    t2_json_skip(j);
+    t2_json_leave_array(j);
+    t2_t_assert(t2_json_get_type(j) == T2_JSON_END);
+
+    /* Numbers, strings and keywords cut off by the end of the input. */
+    t2_json_init_n(j, doc + 17, 3);
+    t2_t_assert(t2_json_get_number(j) == 123);
+    t2_t_assert(t2_json_get_type(j) == T2_JSON_END);
+
+    t2_json_init_n(j, doc + 24, 4);
+    t2_t_assert(t2_json_get_string(j, buf, sizeof(buf)) == NULL);
+
+    t2_json_init_n(j, doc + 32, 3);
+    t2_t_assert(t2_json_get_type(j) == T2_JSON_ERROR);
+
+    t2_json_init_n(j, "\"\\u20AC\"", 6);
+    t2_t_assert(t2_json_get_string(j, buf, sizeof(buf)) == NULL);
+
+    return 0;
+}
+
+static int test_save_stack(void)
+{
+    enum { DEPTH = 1000 };
+    static char doc[DEPTH * 2 + 1];
+    t2_json_t _j, *j = &_j;
+
+    memset(doc, '[', DEPTH);
+    memset(doc + DEPTH, ']', DEPTH);
+
+    /* Grows onto the heap. */
+    t2_json_init(j, doc);
+    for (int i = 0; i < DEPTH; i++) {
+        t2_t_assert(t2_json_save(j) == doc + i);
+        t2_json_enter_array(j);
+    }
+    for (int i = DEPTH - 1; i >= 0; i--)
+        t2_t_assert(t2_json_restore(j) == doc + i + 1);
+    t2_t_assert(t2_json__parser_get_cursor(j) == doc);
+    t2_t_assert(!t2_json_has_error(j));
+    t2_json_fini(j);
+
+    /* Runs in a caller-supplied buffer without touching the heap, and
+     * then hits the depth limit. */
+    void *stack[T2_JSON_SAVE_STACK_SIZE(64) / sizeof(void *)];
+    t2_json_init(j, doc);
+    t2_json_set_save_stack(j, stack, sizeof(stack));
+    t2_json_set_max_depth(j, 64);
+    for (int i = 0; i < 64; i++) {
+        t2_t_assert(t2_json_save(j) != NULL);
+        t2_json_enter_array(j);
+    }
+    t2_t_assert(!j->r.owned);
+    t2_t_assert(t2_json_save(j) == NULL);
+    t2_t_assert(t2_json_has_error(j));
+    t2_json_fini(j);
+
+    /* An empty buffer is the same as none. */
+    t2_json_init(j, doc);
+    t2_json_set_save_stack(j, stack, 0);
+    for (int i = 0; i < 16; i++)
+        t2_t_assert(t2_json_save(j) != NULL);
+    t2_t_assert(j->r.owned);
+    t2_t_assert(!t2_json_has_error(j));
+    t2_json_fini(j);
+
+    /* Nothing to restore. */
+    t2_json_init(j, doc);
+    t2_t_assert(t2_json_restore(j) == NULL);
+    t2_t_assert(t2_json_has_error(j));
+
+    /* The depth limit applies to the inline stack too. */
+    t2_json_init(j, doc);
+    t2_json_set_max_depth(j, 2);
+    t2_t_assert(t2_json_save(j) != NULL);
+    t2_t_assert(t2_json_save(j) != NULL);
+    t2_t_assert(t2_json_save(j) == NULL);
+
+    return 0;
+}
+
+struct test_point { double x, y; };
+struct test_shape {
+    char name[8];
+    int sides;
+    bool filled;
+    struct test_point origin;
+};
+
+static const struct t2_json_field test_point_fields[] = {
+    T2_JSON_FIELD(struct test_point, x, NUMBER),
+    T2_JSON_FIELD(struct test_point, y, NUMBER),
+};
+static struct t2_json_schema test_point_schema = T2_JSON_SCHEMA(test_point_fields);
+
+static const struct t2_json_field test_shape_fields[] = {
+    T2_JSON_FIELD(struct test_shape, name, STRING),
+    T2_JSON_FIELD_KEY(struct test_shape, sides, "n_sides", INT),
+    T2_JSON_FIELD(struct test_shape, filled, BOOL),
+    T2_JSON_FIELD_OBJECT(struct test_shape, origin, &test_point_schema),
+};
+static struct t2_json_schema test_shape_schema = T2_JSON_SCHEMA(test_shape_fields);
+
+static int test_bind_object(void)
+{
+    t2_json_t _j, *j = &_j;
+    struct test_shape shape = {};
+
+    t2_t_assert(t2_json_schema_init(&test_shape_schema));
+
+    t2_json_init(j, "{ \"extra\": [1, {\"x\": 2}], \"origin\": { \"y\": -1.5, \"x\": 3 }, "
+                 "\"n_sides\": 4, \"filled\": null, \"na\\u006De\": \"squareish\" }");
+    uint32_t found = t2_json_bind_object(j, &test_shape_schema, &shape);
+    t2_t_assert(!t2_json_has_error(j));
+    t2_t_assert(t2_json_get_type(j) == T2_JSON_END);
+
+    /* filled was null, so it is left alone. */
+    t2_t_assert(found == 0xB);
+    t2_t_assert(strcmp(shape.name, "squarei") == 0);
+    t2_t_assert(shape.sides == 4);
+    t2_t_assert(!shape.filled);
+    t2_t_assert(shape.origin.x == 3 && shape.origin.y == -1.5);
+
+    t2_json_init(j, "[{}, {\"filled\": true}]");
+    t2_json_enter_array(j);
+    t2_t_assert(t2_json_bind_object(j, &test_shape_schema, &shape) == 0);
+    t2_json_next_value(j);
+    t2_t_assert(t2_json_bind_object(j, &test_shape_schema, &shape) == 0x4);
+    t2_t_assert(shape.filled);
+    t2_json_leave_array(j);
+    t2_t_assert(!t2_json_has_error(j));
+
+    /* An int that doesn't fit is an error. */
+    t2_json_init(j, "{\"n_sides\": 3e9}");
+    t2_t_assert(t2_json_bind_object(j, &test_shape_schema, &shape) == 0);
+    t2_t_assert(t2_json_has_error(j));
+    t2_t_assert(shape.sides == 4);
+
+    t2_json_init(j, "{\"n_sides\": -2147483648}");
+    t2_t_assert(t2_json_bind_object(j, &test_shape_schema, &shape) == 0x2);
+    t2_t_assert(shape.sides == INT_MIN);
+
+    /* Two fields with the same key can't be told apart. */
+    static const struct t2_json_field dup_fields[] = {
+        T2_JSON_FIELD_KEY(struct test_shape, sides, "n", INT),
+        T2_JSON_FIELD_KEY(struct test_shape, filled, "n", BOOL),
+    };
+    struct t2_json_schema dup_schema = T2_JSON_SCHEMA(dup_fields);
+    t2_t_assert(!t2_json_schema_init(&dup_schema));
+
+    /* Empty things can be skipped too. */
+    t2_json_init(j, "[{}, [], {\"a\": {}}, 1]");
+    t2_json_skip(j);
+    t2_t_assert(!t2_json_has_error(j));
+    t2_t_assert(t2_json_get_type(j) == T2_JSON_END);
+
+    return 0;
+}
+
+static int test_tokens(void)
+{
+    t2_json_t _j, *j = &_j;
+
+    t2_json_init(j, "\r\n\t [true,\n false, null]\n");
+    t2_json_enter_array(j);
+    t2_t_assert(t2_json_get_type(j) == T2_JSON_TRUE);
+    t2_json_skip(j);
+    t2_json_next_value(j);
+    t2_t_assert(t2_json_get_type(j) == T2_JSON_FALSE);
+    t2_json_skip(j);
+    t2_json_next_value(j);
+    t2_t_assert(t2_json_get_type(j) == T2_JSON_NULL);
+    t2_json_skip(j);
+    t2_json_leave_array(j);
+    t2_t_assert(t2_json_get_type(j) == T2_JSON_END);
+
+    /* Anything that isn't a token, or a keyword that's cut short. */
+    static const char *bad[] = { "xyz", "fals", "falsy", "nul", "tru", "True", "\x80", "+1" };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(*bad); i++) {
+        t2_json_init(j, (char *) bad[i]);
+        t2_t_assert(t2_json_get_type(j) == T2_JSON_ERROR);
+    }
+
+    return 0;
+}
+
+static int test_plain_run(void)
+{
+    static const char specials[] = { '\0', '"', '\'', '\\', (char) 0x80, (char) 0xe9, (char) 0xff };
+    char buf[200];
+
+    /* Every kernel this machine can run has to agree with the scalar one,
+     * wherever the special char is, and however much input is left. */
+    for (int level = T2_CPU_SSE42; level <= t2_cpu_level(); level++) {
+        if (!plain_run_kernels[level])
+            continue;
+        for (size_t k = 0; k < sizeof(specials); k++) {
+            for (int pos = 0; pos < 150; pos += 7) {
+                memset(buf, 'a', sizeof(buf));
+                buf[pos] = specials[k];
+                for (int len = 0; len < 160; len += 3) {
+                    const char *E = buf + 3 + len;
+                    t2_t_assert(plain_run_kernels[level](buf + 3, E) == plain_run_scalar(buf + 3, E));
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* A document of small records, padded out with whitespace to a fixed
+ * size, so that bytes per second can be reported. */
+enum { BENCH_DOC_SIZE = 64 * 1024 };
+static char bench_doc[BENCH_DOC_SIZE + 1];
+
+static char *get_bench_doc(void)
+{
+    if (bench_doc[0])
+        return bench_doc;
+
+    char *S = bench_doc, *E = bench_doc + BENCH_DOC_SIZE - 256;
+    S += sprintf(S, "[");
+    for (int i = 0; S < E; i++)
+        S += sprintf(S, "%s{\"id\": %d, \"name\": \"item \\u00e9 %d\", \"tags\": [\"a\", \"b\"], \"price\": %d.%02d, \"ok\": %s}\n",
+                     i ? ", " : "", i, i, i * 7 % 1000, i % 100, i % 3 ? "true" : "false");
+    S += sprintf(S, "]");
+    memset(S, ' ', bench_doc + BENCH_DOC_SIZE - S);
+    return bench_doc;
+}
+
+static int bench_skip(size_t n)
+{
+    t2_json_t _j, *j = &_j;
+    char *doc = get_bench_doc();
+
+    for (size_t i = 0; i < n; i++) {
+        t2_json_init_n(j, doc, BENCH_DOC_SIZE);
+        t2_json_skip(j);
+        t2_t_assert(!t2_json_has_error(j));
+    }
+
+    return 0;
+}
+
+static int bench_bind_object(size_t n)
+{
+    struct record { char name[32]; double price; int id; bool ok; } r;
+    static struct t2_json_field fields[] = {
+        T2_JSON_FIELD(struct record, id, INT),
+        T2_JSON_FIELD(struct record, name, STRING),
+        T2_JSON_FIELD(struct record, price, NUMBER),
+        T2_JSON_FIELD(struct record, ok, BOOL),
+    };
+    static struct t2_json_schema schema = T2_JSON_SCHEMA(fields);
+    t2_json_t _j, *j = &_j;
+    char *doc = get_bench_doc();
+
+    t2_t_assert(t2_json_schema_init(&schema));
+    for (size_t i = 0; i < n; i++) {
+        t2_json_init_n(j, doc, BENCH_DOC_SIZE);
+        t2_json_enter_array(j);
+        while (true) {
+            t2_t_assert(t2_json_bind_object(j, &schema, &r) == 0xF);
+            if (!t2_json_has_next_value(j))
+                break;
+            t2_json_next_value(j);
+        }
+        t2_json_leave_array(j);
+        t2_t_assert(!t2_json_has_error(j));
+    }
+
+    return 0;
+}
+
+/* Feeds doc to a stream chunk bytes at a time, and checks that the
+ * values come out as expected, one per line. */
+static int stream_chunks(char *doc, size_t chunk, const char *expected)
+{
+    char buf[64], copy[256], got[256] = "";
+    struct t2_json_stream s;
+    t2_json_t _j, *j = &_j;
+    size_t n = strlen(doc);
+
+    t2_json_stream_init(&s, buf, sizeof(buf));
+    for (size_t i = 0; i < n + chunk; i += chunk) {
+        /* A copy, so that nothing can look past the chunk. The last
+         * time around is the end. */
+        size_t size = n - i < chunk ? n - i : chunk;
+        if (i < n)
+            memcpy(copy, doc + i, size);
+        t2_json_stream_feed(&s, i < n ? copy : NULL, i < n ? size : 0);
+        while (t2_json_stream_next(&s, j)) {
+            char *S = t2_json__parser_get_cursor(j);
+            t2_json_skip(j);
+            t2_t_assert(!t2_json_has_error(j));
+            strncat(got, S, t2_json__parser_get_cursor(j) - S);
+            strcat(got, "\n");
+        }
+        t2_t_assert(!t2_json_stream_has_error(&s));
+    }
+
+    t2_t_assert(strcmp(got, expected) == 0);
+    return 0;
+}
+
+static int test_stream(void)
+{
+    char array[] = " [ {\"a\": [1, \"]}\\\"\"]}, 12, \"x,y\" ,[[]], true,-3.5e2 ] ";
+    const char *array_values = "{\"a\": [1, \"]}\\\"\"]}\n12\n\"x,y\"\n[[]]\ntrue\n-3.5e2\n";
+    char lines[] = "{\"id\": 1}\n{\"id\": 2, \"s\": \"\\u20AC\"}\n\"str\"\n42";
+    const char *lines_values = "{\"id\": 1}\n{\"id\": 2, \"s\": \"\\u20AC\"}\n\"str\"\n42\n";
+
+    /* Every way of cutting them up. */
+    for (size_t chunk = 1; chunk <= sizeof(array); chunk++) {
+        if (stream_chunks(array, chunk, array_values) || stream_chunks(lines, chunk, lines_values))
+            return 1;
+    }
+
+    struct t2_json_stream s;
+    t2_json_t _j, *j = &_j;
+    char buf[4];
+
+    /* Cut off, or too big to carry over. */
+    char unterminated[] = "[1, 2";
+    t2_json_stream_init(&s, buf, sizeof(buf));
+    t2_json_stream_feed(&s, unterminated, 5);
+    t2_t_assert(t2_json_stream_next(&s, j) && t2_json_get_number(j) == 1);
+    t2_t_assert(!t2_json_stream_next(&s, j));
+    t2_json_stream_feed(&s, NULL, 0);
+    t2_t_assert(t2_json_stream_next(&s, j) && t2_json_get_number(j) == 2);
+    t2_t_assert(!t2_json_stream_next(&s, j) && t2_json_stream_has_error(&s));
+
+    char big[] = "\"abcdef\" 1";
+    t2_json_stream_init(&s, buf, sizeof(buf));
+    t2_json_stream_feed(&s, big, 4);
+    t2_t_assert(!t2_json_stream_next(&s, j) && !t2_json_stream_has_error(&s));
+    t2_json_stream_feed(&s, big + 4, 6);
+    t2_t_assert(!t2_json_stream_next(&s, j) && t2_json_stream_has_error(&s));
+
+    return 0;
+}
+
+static struct t2_t_test tests[] = {
+    t2_t_test(test_escapes),
+    t2_t_test(test_truncation),
+    t2_t_test(test_long_number),
+    t2_t_test(test_utf8_validation),
+    t2_t_test(test_bounded_input),
+    t2_t_test(test_save_stack),
+    t2_t_test(test_bind_object),
+    t2_t_test(test_tokens),
+    t2_t_test(test_plain_run),
+    t2_t_test(test_stream),
+    t2_t_bench(bench_skip, BENCH_DOC_SIZE),
+    t2_t_bench(bench_bind_object, BENCH_DOC_SIZE),
+    {},
+};
+
+#endif /* T2_RUN_TESTS */
@@ -7,6 +7,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /* Define to enable extra assertions to know when things go wrong. */
 #define T2_JSON_DEBUG 1
@@ -34,24 +36,60 @@ enum t2_json_type {
 /* Scanner -- intended to be private. Only included here 
  * so that you can place a t2_json_t on the stack. */
 
-struct t2_json__scanner { char *S; };
+struct t2_json__scanner { char *S, *E; };
 
 /* Simple high-level parser interface */
 
-/* A t2_json_t is composed of a scanner, along with a stack of up to ten (by default)
- * restore points, to save your position and come back later with. */
+/* A t2_json_t is composed of a scanner, along with a stack of restore points,
+ * to save your position and come back later with. The first ten (by default)
+ * live inside the t2_json_t itself. Past that, the stack moves to a buffer
+ * given with t2_json_set_save_stack, or to the heap, doubling each time
+ * it runs out. */
 
 #define T2_JSON__T_STACK_LENGTH 10
 
+/* The allocator used to grow the save stack. Define these to use an arena. */
+#ifndef T2_JSON_REALLOC
+#define T2_JSON_REALLOC(p, size) realloc(p, size)
+#define T2_JSON_FREE(p) free(p)
+#endif
+
 typedef struct {
     struct t2_json__scanner s;
-    struct { struct t2_json__scanner s[T2_JSON__T_STACK_LENGTH]; int n; } r;
+    struct {
+        /* Either NULL for the inline stack, or the caller's or our own buffer. */
+        struct t2_json__scanner *s;
+        int n, len, max;
+        bool owned;
+        struct t2_json__scanner inline_s[T2_JSON__T_STACK_LENGTH];
+    } r;
     /* Error. */
     bool e;
 } t2_json_t;
 
+/* The size of the buffer to pass to t2_json_set_save_stack for n restore points. */
+#define T2_JSON_SAVE_STACK_SIZE(n) ((n) * sizeof(struct t2_json__scanner))
+
 void t2_json_init(t2_json_t *parser, char *string);
 
+/* Like t2_json_init, but parses exactly n bytes of string, which does
+ * not need to be NUL-terminated. The parser never reads past the end,
+ * so this can point straight into a network buffer or mmap'd file. */
+void t2_json_init_n(t2_json_t *parser, char *string, size_t n);
+
+/* Frees the save stack, if it had to be grown onto the heap. */
+void t2_json_fini(t2_json_t *parser);
+
+/* Moves the save stack into buf, which should be T2_JSON_SAVE_STACK_SIZE(n)
+ * bytes, aligned for a pointer. Should be called right after t2_json_init.
+ * A buffer too small for one restore point, such as size 0, is ignored,
+ * and the inline stack is used as if this wasn't called. */
+void t2_json_set_save_stack(t2_json_t *parser, void *buf, size_t size);
+
+/* Limits the save stack to max restore points. Saving past that sets the
+ * error flag instead. 0, the default, means no limit. */
+void t2_json_set_max_depth(t2_json_t *parser, int max);
+
 /* Returns the current pointer into the string. */
 static inline char *t2_json__parser_get_cursor(t2_json_t *j) { return j->s.S; }
 
@@ -61,12 +99,15 @@ enum t2_json_type t2_json_get_type(t2_json_t *j);
 bool t2_json_has_error(t2_json_t *j);
 
 /* These save the current position in the stack, and also return the current
- * cursor *before* these functions took effect. */
+ * cursor *before* these functions took effect. If the stack can't grow,
+ * or there's nothing to restore, they set the error flag and return NULL. */
 char *t2_json_save(t2_json_t *j);
 char *t2_json_restore(t2_json_t *j);
 
 /* Gets and decodes the contents of the currently pointed to string into
- * the given buffer.
+ * the given buffer. \u escapes, including surrogate pairs, are decoded to
+ * UTF-8. Returns NULL and sets the error flag if the string is not valid
+ * UTF-8 or contains a bad escape.
  *
  * XXX: A way to detect string truncation. Return the length that would
  * have been without truncation? */
@@ -77,6 +118,8 @@ char *t2_json_get_string(t2_json_t *j, char *buf, int len);
  * actual length of the string. */
 int t2_json_string_len(t2_json_t *j);
 
+double t2_json_get_number(t2_json_t *j);
+
 void t2_json_enter_object(t2_json_t *j);
 void t2_json_enter_array(t2_json_t *j);
 void t2_json_leave_object(t2_json_t *j);
@@ -103,6 +146,126 @@ bool t2_json_find_object_child(t2_json_t *j, char *key);
  * about the current value. */
 void t2_json_skip(t2_json_t *j);
 
+/* Struct binding
+ *
+ * Rather than a long chain of t2_json_find_object_child calls, describe
+ * the struct you want filled in with a table of fields:
+ *
+ *     struct point { double x, y; char name[16]; };
+ *
+ *     static const struct t2_json_field point_fields[] = {
+ *         T2_JSON_FIELD(struct point, x, NUMBER),
+ *         T2_JSON_FIELD(struct point, y, NUMBER),
+ *         T2_JSON_FIELD_KEY(struct point, name, "label", STRING),
+ *     };
+ *     static struct t2_json_schema point_schema = T2_JSON_SCHEMA(point_fields);
+ *
+ *     t2_json_schema_init(&point_schema);
+ *     uint32_t found = t2_json_bind_object(j, &point_schema, &p);
+ *
+ * t2_json_bind_object walks the object once, looking each key up in a
+ * perfect hash table that t2_json_schema_init builds for the schema. */
+
+enum t2_json_field_type {
+    T2_JSON_FIELD_STRING, /* char[], truncated to fit */
+    T2_JSON_FIELD_NUMBER, /* double */
+    T2_JSON_FIELD_INT,    /* int */
+    T2_JSON_FIELD_BOOL,   /* bool */
+    T2_JSON_FIELD_OBJECT, /* nested struct, described by .schema */
+};
+
+struct t2_json_schema;
+
+struct t2_json_field {
+    const char *key;
+    enum t2_json_field_type type;
+    size_t offset, size;
+    struct t2_json_schema *schema;
+};
+
+#define T2_JSON_FIELD_KEY(st, member, key_, type_) \
+    { .key = key_, .type = T2_JSON_FIELD_##type_, .offset = offsetof(st, member), .size = sizeof(((st *) 0)->member) }
+#define T2_JSON_FIELD(st, member, type_) T2_JSON_FIELD_KEY(st, member, #member, type_)
+#define T2_JSON_FIELD_OBJECT(st, member, schema_) \
+    { .key = #member, .type = T2_JSON_FIELD_OBJECT, .offset = offsetof(st, member), .size = sizeof(((st *) 0)->member), .schema = schema_ }
+
+/* Schemas have at most 32 fields, so that the fields found fit in a uint32_t,
+ * and the hash table has four slots per field, so a perfect hash is quick
+ * to find. */
+#define T2_JSON_SCHEMA_MAX_FIELDS 32
+#define T2_JSON__SCHEMA_SLOTS (T2_JSON_SCHEMA_MAX_FIELDS * 4)
+
+struct t2_json_schema {
+    const struct t2_json_field *fields;
+    int n;
+    /* Filled in by t2_json_schema_init. Each slot is a field index + 1, or 0. */
+    uint32_t seed;
+    uint8_t slots[T2_JSON__SCHEMA_SLOTS];
+};
+
+#define T2_JSON_SCHEMA(fields_) { .fields = fields_, .n = sizeof(fields_) / sizeof(*(fields_)) }
+
+/* Builds the key lookup table. Must be called once before binding, and
+ * also initializes the schemas of any nested objects. Returns false if a
+ * schema has two fields with the same key, or more than
+ * T2_JSON_SCHEMA_MAX_FIELDS fields; binding with it then finds nothing. */
+bool t2_json_schema_init(struct t2_json_schema *schema);
+
+/* Reads the current object into out. Unknown keys are skipped, as are
+ * fields whose value has the wrong type, which leaves them untouched.
+ * A number too big for an INT field is an error.
+ * Returns a bitmask of the fields that were filled in, by index. */
+uint32_t t2_json_bind_object(t2_json_t *j, const struct t2_json_schema *schema, void *out);
+
+/* Streams of values
+ *
+ * The parser needs the whole document in memory at once. A big stream of
+ * records, read off a socket or inflated a chunk at a time, is hardly
+ * ever that, but it's almost always a lot of small values: one after
+ * another, as in NDJSON, or the elements of one top-level array. A
+ * t2_json_stream finds where each of those ends, across chunks, and hands
+ * them out one at a time, each to be parsed as a document of its own.
+ * A value that's all in one chunk is parsed right where it is. One that's
+ * cut off by the end of a chunk is copied into buf, so that only has to
+ * be as big as the biggest value, rather than the whole stream.
+ *
+ * So memory is only bounded for a stream of values that are each small.
+ * A value that's cut off and is bigger than buf is an error, and so one
+ * big top-level object, which is one value, needs a buf as big as the
+ * document.
+ *
+ * t2_z_json.h feeds one straight from inflate, for gzip'd JSON.
+ *
+ * A stream that starts with [ is taken to be one big array. Only the
+ * nesting, and where strings are, is looked at to find the ends, and
+ * not the values themselves, which is up to the parser. */
+
+struct t2_json_stream {
+    char *buf;
+    size_t len, size;
+    /* What's left of the chunk, and where the value started in it. */
+    char *S, *E, *V;
+    bool end, in_value, escape;
+    char quote;
+    int depth;
+    enum { T2_JSON__STREAM_START, T2_JSON__STREAM_VALUES, T2_JSON__STREAM_ARRAY, T2_JSON__STREAM_DONE } mode;
+    /* Error. */
+    bool e;
+};
+
+void t2_json_stream_init(struct t2_json_stream *s, char *buf, size_t size);
+
+/* Gives the stream its next chunk, which has to stay put until
+ * t2_json_stream_next returns false. A NULL chunk is the end. */
+void t2_json_stream_feed(struct t2_json_stream *s, char *chunk, size_t n);
+
+/* Sets up j to parse the next value, which is good until the next call.
+ * Returns false once the chunk is used up, and then at the end, or if
+ * something isn't right, in which case the error flag is set. */
+bool t2_json_stream_next(struct t2_json_stream *s, t2_json_t *j);
+
+bool t2_json_stream_has_error(struct t2_json_stream *s);
+
 #if T2_JSON_PRINT_VALUE
 /* A convenience function for debugging to help you figure out the
  * current value. */
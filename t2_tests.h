@@ -9,28 +9,304 @@
 
 typedef int (*t2_t__test_func) (void);
 #define t2_t_test(fp) { .name = #fp, .func = fp }
+
+/* A benchmark does whatever it measures n times, and returns non-zero
+ * if something went wrong, so t2_t_assert works in it too. The harness
+ * picks n so that each run takes a while, and times a bunch of runs.
+ * If bytes isn't 0, it's how many bytes one of the n operations goes
+ * through, and the throughput gets reported too. */
+typedef int (*t2_t__bench_func) (size_t n);
+#define t2_t_bench(fp, nbytes) { .name = #fp, .bench = fp, .bytes = nbytes }
+
 struct t2_t_test {
     const char *name;
     t2_t__test_func func;
+    t2_t__bench_func bench;
+    size_t bytes;
 };
 
 static struct t2_t_test tests[];
 
-int main (int argc, char *argv[]) {
+/* Usage: ./tests [-j jobs] [-b] [-l] [name...]
+ *
+ * Only the tests whose names contain one of the given names are run; -l
+ * lists them instead. Each test runs in its own process, so one that
+ * crashes or hangs only fails itself, and up to one per core run at
+ * once. What a test prints is held back until it's done, so the output
+ * doesn't interleave. A test that takes longer than T2_T_TIMEOUT seconds
+ * is killed.
+ *
+ * Only the tests run by default. -b runs the benchmarks instead, one at
+ * a time, so they have the machine to themselves. Each benchmark gets
+ * T2_T_BENCH_MS of runs, after warming up, and prints the median and p99
+ * time per operation, and how much the runs varied from one another. */
+
+#ifndef T2_T_TIMEOUT
+#define T2_T_TIMEOUT 300
+#endif
+
+#ifndef T2_T_BENCH_MS
+#define T2_T_BENCH_MS 250
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static bool t2_t__selected (const char *name, int n_filters, char **filters) {
+    if (n_filters == 0)
+        return true;
+    for (int i = 0; i < n_filters; i++)
+        if (strstr (name, filters[i]))
+            return true;
+    return false;
+}
+
+static double t2_t__now_ms (void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int t2_t__compare_double (const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static int t2_t__run_bench (struct t2_t_test *test) {
+    enum { MAX_RUNS = 200 };
+    /* Runs this long are well above the clock's resolution, and there's
+     * time for a good number of them. */
+    const double run_ms = T2_T_BENCH_MS / 50.0;
+    double samples[MAX_RUNS];
+    size_t n = 1;
+
+    /* Grow n until a run takes long enough. This also warms up caches,
+     * branch predictors and the CPU's clock. */
+    while (1) {
+        double start = t2_t__now_ms ();
+        if (test->bench (n))
+            return 1;
+        double ms = t2_t__now_ms () - start;
+        if (ms >= run_ms)
+            break;
+        n = ms > run_ms / 100 ? n * (run_ms / ms) + 1 : n * 10;
+    }
+
+    int n_runs = 0;
+    double end = t2_t__now_ms () + T2_T_BENCH_MS;
+    while (n_runs < MAX_RUNS && (n_runs < 5 || t2_t__now_ms () < end)) {
+        double start = t2_t__now_ms ();
+        if (test->bench (n))
+            return 1;
+        samples[n_runs++] = (t2_t__now_ms () - start) * 1e6 / n;
+    }
+
+    qsort (samples, n_runs, sizeof (*samples), t2_t__compare_double);
+    double median = samples[n_runs / 2];
+    double p99 = samples[(n_runs * 99) / 100];
+
+    /* How much the runs varied, as the median absolute deviation, which
+     * unlike the standard deviation isn't thrown by a few runs that got
+     * preempted. */
+    double deviations[MAX_RUNS];
+    for (int i = 0; i < n_runs; i++)
+        deviations[i] = samples[i] > median ? samples[i] - median : median - samples[i];
+    qsort (deviations, n_runs, sizeof (*deviations), t2_t__compare_double);
+    double mad = deviations[n_runs / 2];
+
+    fprintf (stderr, "%s: %.1f ns/op, p99 %.1f, +/- %.1f%% (%d runs of %zu)",
+             test->name, median, p99, 100 * mad / median, n_runs, n);
+    if (test->bytes)
+        fprintf (stderr, ", %.1f MB/s", test->bytes / median * 1e3);
+    fprintf (stderr, "\n");
+    return 0;
+}
+
+#ifdef _WIN32
+
+/* No fork, so run everything in-process, one at a time. */
+static int t2_t__run (struct t2_t_test *tests, bool benches, int n_jobs, int n_filters, char **filters) {
     int retval = 0;
-    struct t2_t_test *_tests = tests; 
+    for (struct t2_t_test *test = tests; test->func || test->bench; test++) {
+        if (!test->bench != !benches || !t2_t__selected (test->name, n_filters, filters))
+            continue;
+
+        if (benches) {
+            if (t2_t__run_bench (test)) {
+                fprintf (stderr, "%s: FAIL\n", test->name);
+                retval = 1;
+            }
+            continue;
+        }
+
+        double start = t2_t__now_ms ();
+        int failed = test->func ();
+        double ms = t2_t__now_ms () - start;
+
+        fprintf (stderr, "%s: %s (%.1f ms)\n", test->name, failed ? "FAIL" : "OK", ms);
+        retval |= failed;
+    }
+    return retval;
+}
+
+#else
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct t2_t__job {
+    struct t2_t_test *test;
+    pid_t pid;
+    FILE *output;
+    double start;
+};
+
+static pid_t t2_t__spawn (struct t2_t__job *job) {
+    /* Don't let the child flush anything we've buffered a second time. */
+    fflush (stdout);
+    fflush (stderr);
+
+    job->output = tmpfile ();
+    job->start = t2_t__now_ms ();
+    job->pid = fork ();
+    if (job->pid == 0) {
+        if (job->output) {
+            dup2 (fileno (job->output), STDOUT_FILENO);
+            dup2 (fileno (job->output), STDERR_FILENO);
+        }
+        alarm (T2_T_TIMEOUT);
+        int failed = job->test->bench ? t2_t__run_bench (job->test) : job->test->func ();
+        /* exit rather than _exit, so that coverage and PGO counters
+         * get written out. */
+        exit (failed ? 1 : 0);
+    }
+    return job->pid;
+}
+
+/* Prints what the test printed, and then how it went. */
+static int t2_t__reap (struct t2_t__job *job, int status) {
+    double ms = t2_t__now_ms () - job->start;
+    int failed = 1;
+
+    if (job->output) {
+        char buf[4096];
+        size_t n;
+        rewind (job->output);
+        while ((n = fread (buf, 1, sizeof (buf), job->output)) > 0)
+            fwrite (buf, 1, n, stderr);
+        fclose (job->output);
+    }
+
+    if (WIFEXITED (status)) {
+        failed = WEXITSTATUS (status) != 0;
+        /* Benchmarks print their own results. */
+        if (job->test->bench && !failed)
+            return 0;
+        fprintf (stderr, "%s: %s (%.1f ms)\n", job->test->name, failed ? "FAIL" : "OK", ms);
+    } else if (WIFSIGNALED (status) && WTERMSIG (status) == SIGALRM) {
+        fprintf (stderr, "%s: FAIL (timed out after %d s)\n", job->test->name, T2_T_TIMEOUT);
+    } else {
+        fprintf (stderr, "%s: FAIL (%s, %.1f ms)\n", job->test->name, strsignal (WTERMSIG (status)), ms);
+    }
+    return failed;
+}
+
+static int t2_t__run (struct t2_t_test *tests, bool benches, int n_jobs, int n_filters, char **filters) {
+    struct t2_t__job *jobs;
+    struct t2_t_test *next = tests;
+    int running = 0, n_run = 0, n_failed = 0;
+
+    if (benches)
+        n_jobs = 1;
+    jobs = calloc (n_jobs, sizeof (*jobs));
 
     while (1) {
-        struct t2_t_test test = *_tests++;
+        while (running < n_jobs && (next->func || next->bench)) {
+            struct t2_t_test *test = next++;
+            if (!test->bench != !benches || !t2_t__selected (test->name, n_filters, filters))
+                continue;
 
-        if (!test.func)
-            return retval;
+            struct t2_t__job *job = jobs;
+            while (job->test)
+                job++;
+            job->test = test;
+            if (t2_t__spawn (job) < 0) {
+                perror ("fork");
+                exit (1);
+            }
+            running++;
+        }
+
+        if (running == 0)
+            break;
 
-        if (!test.func ()) {
-            fprintf (stderr, "%s: OK\n", test.name);
-        } else {
-            fprintf (stderr, "%s: FAIL\n", test.name);
-            retval = 1;
+        int status;
+        pid_t pid = wait (&status);
+        if (pid < 0) {
+            perror ("wait");
+            exit (1);
+        }
+        for (int i = 0; i < n_jobs; i++) {
+            if (jobs[i].test && jobs[i].pid == pid) {
+                n_failed += t2_t__reap (&jobs[i], status);
+                n_run++;
+                jobs[i].test = NULL;
+                running--;
+                break;
+            }
         }
     }
+
+    free (jobs);
+    if (n_failed)
+        fprintf (stderr, "%d of %d %s failed\n", n_failed, n_run, benches ? "benchmarks" : "tests");
+    return n_failed ? 1 : 0;
+}
+
+#endif /* !_WIN32 */
+
+int main (int argc, char *argv[]) {
+    int n_jobs = 0, n_filters = 0;
+    bool list = false, run_tests = true, run_benches = false;
+    char **filters = calloc (argc, sizeof (*filters));
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp (argv[i], "-j") == 0 && i + 1 < argc)
+            n_jobs = atoi (argv[++i]);
+        else if (strncmp (argv[i], "-j", 2) == 0 && argv[i][2])
+            n_jobs = atoi (argv[i] + 2);
+        else if (strcmp (argv[i], "-l") == 0)
+            list = true;
+        else if (strcmp (argv[i], "-t") == 0)
+            run_tests = true, run_benches = false;
+        else if (strcmp (argv[i], "-b") == 0)
+            run_tests = false, run_benches = true;
+        else
+            filters[n_filters++] = argv[i];
+    }
+
+    if (list) {
+        for (struct t2_t_test *test = tests; test->func || test->bench; test++)
+            if ((test->bench ? run_benches : run_tests) && t2_t__selected (test->name, n_filters, filters))
+                printf ("%s\n", test->name);
+        return 0;
+    }
+
+#ifndef _WIN32
+    if (n_jobs <= 0)
+        n_jobs = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+    if (n_jobs <= 0)
+        n_jobs = 1;
+
+    int retval = 0;
+    if (run_tests)
+        retval |= t2_t__run (tests, false, n_jobs, n_filters, filters);
+    if (run_benches)
+        retval |= t2_t__run (tests, true, n_jobs, n_filters, filters);
+    free (filters);
+    return retval;
 }
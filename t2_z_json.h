@@ -0,0 +1,353 @@
+
+/* t2_z_json: gzip'd JSON, parsed a value at a time as it's inflated. */
+
+/* Written by Jasper St. Pierre <jstpierre@mecheye.net>
+ * I license this work into the public domain. */
+
+/* This is glue for three of the others: t2_inflate.h decompresses into
+ * a sliding window, a chunk at a time, and t2_json's streams split those
+ * chunks into whole values. The inflate runs in a t2_co of its own, and
+ * sends each chunk down a channel as soon as it's made, so each value is
+ * parsed while the chunk it's in is still in cache, and the document is
+ * never all in memory at once. This end is a plain loop:
+ *
+ *     struct t2_z_json zj;
+ *     t2_json_t j;
+ *
+ *     t2_z_json_init (&zj, gzip, gzip_size, carry, sizeof (carry));
+ *     while (t2_z_json_next (&zj, &j))
+ *         bind_record (&j);
+ *     if (t2_z_json_has_error (&zj))
+ *         fail ();
+ *     t2_z_json_destroy (&zj);
+ *
+ * The document is either one big array or values one after another, as
+ * in NDJSON. What this needs is the T2_Z_INFLATE_WINDOW_SIZE window and
+ * the coroutine's stack, which are allocated here, and carry, which has
+ * to be as big as the biggest value; see t2_json_stream.
+ *
+ * Like t2_inflate.h, this is all static, and implemented where
+ * T2_Z_IMPLEMENTATION and T2_CO_IMPLEMENTATION are defined. t2_json.c
+ * is built on its own, as usual. */
+
+#pragma once
+
+/* Tests are only for this header, not the ones it brings in. */
+#ifdef T2_RUN_TESTS
+#undef T2_RUN_TESTS
+#define T2_Z_JSON__RUN_TESTS
+#endif
+
+#include "t2_co.h"
+#include "t2_inflate.h"
+#include "t2_json.h"
+
+struct t2_z_json {
+    /* Inflate, sending each chunk of the window as a t2_co_view. */
+    struct t2_co co;
+    struct t2_co_chan chunks;
+    struct t2_co_view slot;
+    struct t2_z_buffer in, window;
+
+    struct t2_json_stream stream;
+    /* Whether there are chunks still to come. */
+    bool more;
+};
+
+/* Starts reading the gzip file gzip, which has to stay put until the end.
+ * carry is where a value that's cut off by the end of a chunk is put
+ * back together. */
+static void t2_z_json_init (struct t2_z_json *zj, const uint8_t *gzip, size_t size, char *carry, size_t carry_size);
+
+/* Sets up j to parse the next value, which is good until the next call.
+ * Returns false at the end, or if something isn't right, in which case
+ * the error flag is set. Broken gzip data is fatal, as it is everywhere
+ * else in t2_inflate. */
+static bool t2_z_json_next (struct t2_z_json *zj, t2_json_t *j);
+
+static bool t2_z_json_has_error (struct t2_z_json *zj);
+
+/* Frees everything. It's fine to stop reading before the end, in which
+ * case the inflate is cancelled. */
+static void t2_z_json_destroy (struct t2_z_json *zj);
+
+#ifdef T2_Z_IMPLEMENTATION
+
+static void t2_z_json__send (void *data, const uint8_t *chunk, size_t size) {
+    struct t2_z_json *zj = data;
+    struct t2_co_view view = { chunk, size };
+    t2_co_chan_send (&zj->chunks, &view);
+}
+
+static void t2_z_json__inflate (void *data) {
+    struct t2_z_json *zj = data;
+    t2_z_gzip_inflate_chunked (&zj->in, &zj->window, t2_z_json__send, zj);
+    t2_co_chan_close (&zj->chunks);
+}
+
+static void t2_z_json_init (struct t2_z_json *zj, const uint8_t *gzip, size_t size, char *carry, size_t carry_size) {
+    *zj = (struct t2_z_json) {
+        .in = { (uint8_t *) gzip, size, 0 },
+        .window = { malloc (T2_Z_INFLATE_WINDOW_SIZE), T2_Z_INFLATE_WINDOW_SIZE, 0 },
+        .more = true,
+    };
+    t2_d_assert (zj->window.data != NULL);
+
+    /* With a capacity of one, inflate doesn't go on until we come back
+     * for more, so each chunk stays good until then. */
+    t2_co_create (&zj->co, t2_z_json__inflate, zj);
+    t2_co_chan_init (&zj->chunks, &zj->slot, sizeof (struct t2_co_view), 1, &zj->co);
+    t2_json_stream_init (&zj->stream, carry, carry_size);
+}
+
+static bool t2_z_json_next (struct t2_z_json *zj, t2_json_t *j) {
+    while (!t2_json_stream_next (&zj->stream, j)) {
+        if (!zj->more || t2_json_stream_has_error (&zj->stream))
+            return false;
+
+        struct t2_co_view view;
+        zj->more = t2_co_chan_recv (&zj->chunks, &view);
+        if (zj->more)
+            t2_json_stream_feed (&zj->stream, (char *) view.data, view.size);
+        else
+            t2_json_stream_feed (&zj->stream, NULL, 0);
+    }
+    return true;
+}
+
+static bool t2_z_json_has_error (struct t2_z_json *zj) {
+    return t2_json_stream_has_error (&zj->stream);
+}
+
+static void t2_z_json_destroy (struct t2_z_json *zj) {
+    /* Nothing in inflate needs cleaning up, so it can just unwind. */
+    t2_co_cancel (&zj->co);
+    t2_co_destroy (&zj->co);
+    free (zj->window.data);
+}
+
+#ifdef T2_Z_JSON__RUN_TESTS
+
+/* t2_json's implementation, but not its tests. */
+#include "t2_json.c"
+#include "t2_deflate.h"
+
+#define T2_RUN_TESTS
+#include "t2_tests.h"
+
+#include <stdio.h>
+
+/* A gzip file with one member, as gzip itself would write. */
+static size_t make_gzip (uint8_t *out, size_t out_size, const uint8_t *data, size_t size) {
+    static const uint8_t header[] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF };
+    memcpy (out, header, sizeof (header));
+
+    struct t2_z_buffer in = { (uint8_t *) data, size, 0 }, o = { out, out_size, sizeof (header) };
+    t2_z_deflate (&in, &o);
+
+    uint32_t trailer[2] = { t2_z_crc32 (0, data, size), size };
+    for (int i = 0; i < 8; i++)
+        out[o.position++] = trailer[i / 4] >> (8 * (i % 4));
+    return o.position;
+}
+
+struct record { double price; int id; bool ok; };
+
+static struct t2_json_field record_fields[] = {
+    T2_JSON_FIELD(struct record, id, INT),
+    T2_JSON_FIELD(struct record, price, NUMBER),
+    T2_JSON_FIELD(struct record, ok, BOOL),
+};
+static struct t2_json_schema record_schema = T2_JSON_SCHEMA(record_fields);
+
+enum { RECORDS = 20000 };
+
+static uint8_t *records_gzip;
+static size_t records_gzip_size, records_size;
+static char carry[4096];
+
+/* RECORDS records, in one big array, about 1.7MB of them. */
+static void make_records (void) {
+    if (records_gzip)
+        return;
+
+    size_t max_size = RECORDS * 128;
+    char *doc = malloc (max_size), *S = doc;
+    S += sprintf (S, "[");
+    for (int i = 0; i < RECORDS; i++)
+        S += sprintf (S, "%s{\"id\": %d, \"name\": \"item %d\", \"tags\": [\"a\", \"b\"], \"price\": %d.%02d, \"ok\": %s}\n",
+                      i ? ", " : "", i, i * 7919 % 100003, i * 7 % 1000, i % 100, i % 3 ? "true" : "false");
+    S += sprintf (S, "]");
+    records_size = S - doc;
+
+    records_gzip = malloc (t2_z_deflate_bound (records_size) + 1024);
+    records_gzip_size = make_gzip (records_gzip, t2_z_deflate_bound (records_size) + 1024, (uint8_t *) doc, records_size);
+    free (doc);
+    t2_json_schema_init (&record_schema);
+}
+
+/* Adds up the ids of the records, or returns -1. n_carried is how many
+ * of them were cut in two by the end of a chunk. */
+static long sum_records (const uint8_t *gzip, size_t size, int *n_carried) {
+    struct t2_z_json zj;
+    t2_json_t j;
+    struct record r;
+    long sum = 0;
+
+    t2_z_json_init (&zj, gzip, size, carry, sizeof (carry));
+    while (t2_z_json_next (&zj, &j)) {
+        if (j.s.S >= carry && j.s.S < carry + sizeof (carry))
+            (*n_carried)++;
+        if (t2_json_bind_object (&j, &record_schema, &r) != 0x7) {
+            sum = -1;
+            break;
+        }
+        sum += r.id;
+    }
+    if (t2_z_json_has_error (&zj))
+        sum = -1;
+    t2_z_json_destroy (&zj);
+    return sum;
+}
+
+/* The same, the usual way: the whole document, then the whole parse. */
+static long sum_records_buffered (const uint8_t *gzip, size_t size, uint8_t *out, size_t out_size) {
+    struct t2_z_buffer in = { (uint8_t *) gzip, size, 0 }, o = { out, out_size, 0 };
+    t2_json_t j;
+    struct record r;
+    long sum = 0;
+
+    t2_z_gzip_inflate (&in, &o);
+    t2_json_init_n (&j, (char *) out, o.position);
+    t2_json_enter_array (&j);
+    while (1) {
+        if (t2_json_bind_object (&j, &record_schema, &r) != 0x7)
+            return -1;
+        sum += r.id;
+        if (!t2_json_has_next_value (&j))
+            break;
+        t2_json_next_value (&j);
+    }
+    t2_json_leave_array (&j);
+    return t2_json_has_error (&j) ? -1 : sum;
+}
+
+static int test_records (void) {
+    long expected = (long) RECORDS * (RECORDS - 1) / 2;
+    int n_carried = 0;
+    make_records ();
+
+    uint8_t *out = malloc (records_size);
+    t2_t_assert (sum_records_buffered (records_gzip, records_gzip_size, out, records_size) == expected);
+    free (out);
+
+    /* The document is many chunks, and the records that were cut in two
+     * by their ends came out the same as the rest. */
+    t2_t_assert (sum_records (records_gzip, records_gzip_size, &n_carried) == expected);
+    t2_t_assert (n_carried >= (int) (records_size / T2_Z_INFLATE_WINDOW_SIZE));
+    return 0;
+}
+
+static int test_split_value (void) {
+    /* NDJSON with a record big enough that it can't help but be split:
+     * it goes from the first chunk, of 96K at most, into the next. */
+    enum { SIZE = 128 * 1024 };
+    char *doc = malloc (SIZE);
+    uint8_t *gzip = malloc (t2_z_deflate_bound (SIZE) + 1024);
+    static char big_carry[SIZE];
+    size_t starts[3], n = 0;
+
+    starts[0] = n;
+    n += sprintf (doc + n, "{\"id\": 1}\n");
+    starts[1] = n;
+    n += sprintf (doc + n, "{\"id\": 2, \"name\": \"");
+    for (; n < SIZE - 64; n++)
+        doc[n] = 'a' + n % 26;
+    n += sprintf (doc + n, "\"}\n");
+    starts[2] = n;
+    n += sprintf (doc + n, "{\"id\": 3}");
+    size_t size = make_gzip (gzip, t2_z_deflate_bound (SIZE) + 1024, (uint8_t *) doc, n);
+
+    /* Each value comes out exactly as it went in, whole. */
+    struct t2_z_json zj;
+    t2_json_t j;
+    int n_values = 0;
+    t2_z_json_init (&zj, gzip, size, big_carry, sizeof (big_carry));
+    while (t2_z_json_next (&zj, &j)) {
+        t2_t_assert (n_values < 3);
+        size_t end = n_values < 2 ? starts[n_values + 1] - 1 : n;
+        t2_t_assert (j.s.E - j.s.S == (ptrdiff_t) (end - starts[n_values]));
+        t2_t_assert (memcmp (j.s.S, doc + starts[n_values], end - starts[n_values]) == 0);
+        t2_t_assert ((j.s.S == big_carry) == (n_values == 1));
+
+        t2_json_enter_object (&j);
+        t2_t_assert (t2_json_find_object_child (&j, "id"));
+        t2_t_assert (t2_json_get_number (&j) == n_values + 1);
+        n_values++;
+    }
+    t2_t_assert (!t2_z_json_has_error (&zj));
+    t2_t_assert (n_values == 3);
+    t2_z_json_destroy (&zj);
+
+    /* A carry that's too small for it is an error, and the rest of the
+     * file is never inflated. */
+    n_values = 0;
+    t2_z_json_init (&zj, gzip, size, carry, sizeof (carry));
+    while (t2_z_json_next (&zj, &j))
+        n_values++;
+    t2_t_assert (n_values == 1 && t2_z_json_has_error (&zj));
+    t2_z_json_destroy (&zj);
+
+    free (doc);
+    free (gzip);
+    return 0;
+}
+
+static int test_errors (void) {
+    int n_carried = 0;
+    uint8_t *gzip = malloc (1024);
+
+    /* A broken record is an error, and not the end. */
+    uint8_t broken[] = "[{\"id\": 1, \"price\": 2, \"ok\": true}, {\"id\": 2, ";
+    t2_t_assert (sum_records (gzip, make_gzip (gzip, 1024, broken, sizeof (broken) - 1), &n_carried) == -1);
+
+    /* And so is a bad one, which stops early. */
+    uint8_t bad[] = "[{\"id\": 1, \"price\": 2, \"ok\": true}, {\"id\": \"2\"}, {\"id\": 3, \"price\": 2, \"ok\": true}]";
+    t2_t_assert (sum_records (gzip, make_gzip (gzip, 1024, bad, sizeof (bad) - 1), &n_carried) == -1);
+
+    /* Nothing at all is fine. */
+    t2_t_assert (sum_records (gzip, make_gzip (gzip, 1024, (uint8_t *) "", 0), &n_carried) == 0);
+
+    free (gzip);
+    return 0;
+}
+
+static int bench_records (size_t n) {
+    int n_carried = 0;
+    make_records ();
+    for (size_t i = 0; i < n; i++)
+        t2_t_assert (sum_records (records_gzip, records_gzip_size, &n_carried) >= 0);
+    return 0;
+}
+
+static int bench_records_buffered (size_t n) {
+    make_records ();
+    uint8_t *out = malloc (records_size);
+    for (size_t i = 0; i < n; i++)
+        t2_t_assert (sum_records_buffered (records_gzip, records_gzip_size, out, records_size) >= 0);
+    free (out);
+    return 0;
+}
+
+static struct t2_t_test tests[] = {
+    t2_t_test(test_records),
+    t2_t_test(test_split_value),
+    t2_t_test(test_errors),
+    t2_t_bench(bench_records, 0),
+    t2_t_bench(bench_records_buffered, 0),
+    {},
+};
+
+#endif /* T2_Z_JSON__RUN_TESTS */
+
+#endif /* T2_Z_IMPLEMENTATION */